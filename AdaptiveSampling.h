@@ -0,0 +1,41 @@
+#pragma once
+#include <glm.hpp>
+#include <algorithm>
+#include <cmath>
+
+// With isEnabled every pixel gets minSamples samples and then more in passes. Each pass gives the
+// pixels of a tile whose error is still above targetError as many more samples as the estimate
+// says they need, up to doubling their count, until the tile converges or reaches maxSamples. The
+// error is the root mean square over the tile of the standard error of each pixel's mean
+// luminance, clamped to 1 the way the image is displayed. It is judged per tile rather than per
+// pixel because a pixel that has not yet seen a rare bright path looks converged on its own.
+// Converged tiles are skipped, and the frame ends once every tile is. Both the CPU megakernel and
+// the GPU's time-sliced accumulation sample this way.
+struct AdaptiveSamplingSettings
+{
+	bool isEnabled = false;
+	float targetError = 0.02f;
+	int minSamples = 16;
+	int maxSamples = 1024;
+};
+
+// The standard error of the mean of numSamples samples whose clamped luminance has the given sum
+// and sum of squares, squared, for summing over a tile.
+inline float meanVariance(glm::vec2 sums, int numSamples)
+{
+	glm::vec2 mean = sums / float(numSamples);
+	return std::max(mean.y - mean.x * mean.x, 0.0f) / numSamples;
+}
+
+// How many more samples a tile with numSamples samples and the given error needs. None once the
+// error is within the target or it has maxSamples. Otherwise as many as the error, falling with
+// the square root of the count, says, but no more than it already has, so an estimate from a few
+// unlucky samples at most doubles its count.
+inline int additionalTileSamples(const AdaptiveSamplingSettings& settings, int numSamples, int maxSamples, float error)
+{
+	if (numSamples >= maxSamples || error <= settings.targetError)
+		return 0;
+	float errorRatio = error / settings.targetError;
+	float neededSamples = std::min(numSamples * errorRatio * errorRatio, float(maxSamples));
+	return glm::clamp(int(std::ceil(neededSamples)) - numSamples, 1, std::min(numSamples, maxSamples - numSamples));
+}
@@ -0,0 +1,51 @@
+#include "Arena.h"
+#include <algorithm>
+#include <cstdint>
+
+const size_t minArenaBlockSize = 64 * 1024;
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+	if (!blocks.empty())
+	{
+		Block& block = blocks.back();
+		uintptr_t base = reinterpret_cast<uintptr_t>(block.memory.get());
+		size_t offset = (base + used + alignment - 1) / alignment * alignment - base;
+		if (offset + size <= block.size)
+		{
+			totalUsed += offset + size - used;
+			used = offset + size;
+			return block.memory.get() + offset;
+		}
+	}
+
+	size_t blockSize = std::max(minArenaBlockSize, size + alignment);
+	if (!blocks.empty())
+		blockSize = std::max(blockSize, blocks.back().size * 2);
+	blocks.push_back({ std::unique_ptr<char[]>(new char[blockSize]), blockSize });
+	used = 0;
+	return allocate(size, alignment);
+}
+
+// Keeps a single block big enough for the largest pass seen so far, with a little room for
+// alignment padding that a differently laid out pass might need.
+void Arena::reset()
+{
+	peakUsed = std::max(peakUsed, totalUsed);
+	if (blocks.size() > 1)
+	{
+		size_t blockSize = peakUsed + peakUsed / 8;
+		blocks.clear();
+		blocks.push_back({ std::unique_ptr<char[]>(new char[blockSize]), blockSize });
+	}
+	used = 0;
+	totalUsed = 0;
+}
+
+size_t Arena::capacity() const
+{
+	size_t total = 0;
+	for (const Block& block : blocks)
+		total += block.size;
+	return total;
+}
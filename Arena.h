@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for scratch memory whose lifetime ends at a known point, such as the end of a
+// tile or a frame. Allocation is a pointer increment within the current block and reset() frees
+// everything at once. When a pass needs more than the current block holds a new one is taken
+// from the heap, and the next reset() merges them into a single block of the combined size, so
+// after the first few frames the arena never touches the heap again.
+class Arena
+{
+public:
+	void* allocate(size_t size, size_t alignment);
+	void reset();
+	size_t capacity() const;
+
+	// Only for types that need no destructor, since reset() never runs one.
+	template <typename T>
+	T* allocateArray(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without destructors");
+		T* items = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+		for (size_t i = 0; i < count; i++)
+			new (items + i) T();
+		return items;
+	}
+private:
+	struct Block
+	{
+		std::unique_ptr<char[]> memory;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	size_t used = 0;
+	size_t totalUsed = 0;
+	size_t peakUsed = 0;
+};
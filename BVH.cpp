@@ -0,0 +1,402 @@
+#include "BVH.h"
+#include <algorithm>
+#include <cstring>
+
+void AABB::grow(vec3 point)
+{
+	min = glm::min(min, point);
+	max = glm::max(max, point);
+}
+
+void AABB::grow(const AABB& box)
+{
+	min = glm::min(min, box.min);
+	max = glm::max(max, box.max);
+}
+
+vec3 AABB::centroid() const
+{
+	return (min + max) * 0.5f;
+}
+
+float AABB::surfaceArea() const
+{
+	vec3 extent = max - min;
+	if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f)
+		return 0.0f;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+bool AABB::operator==(const AABB& other) const
+{
+	return min == other.min && max == other.max;
+}
+
+float intersectAABB(const AABB& box, vec3 origin, vec3 inverseDirection, float tMax)
+{
+	vec3 t1 = (box.min - origin) * inverseDirection;
+	vec3 t2 = (box.max - origin) * inverseDirection;
+	vec3 tSmall = glm::min(t1, t2);
+	vec3 tBig = glm::max(t1, t2);
+
+	float tEnter = std::max(std::max(tSmall.x, tSmall.y), tSmall.z);
+	float tExit = std::min(std::min(tBig.x, tBig.y), tBig.z);
+
+	if (tExit < std::max(tEnter, 0.0f) || tEnter > tMax)
+		return FLT_MAX;
+	return tEnter;
+}
+
+AABB transformBounds(const AABB& box, const mat4& transform)
+{
+	vec3 translation = vec3(transform[3]);
+	AABB transformed = AABB(translation, translation);
+	for (int column = 0; column < 3; column++)
+	{
+		vec3 axis = vec3(transform[column]);
+		vec3 a = axis * box.min[column];
+		vec3 b = axis * box.max[column];
+		transformed.min += glm::min(a, b);
+		transformed.max += glm::max(a, b);
+	}
+	return transformed;
+}
+
+void BVH::build(const std::vector<AABB>& bounds)
+{
+	int numPrimitives = int(bounds.size());
+	primitiveBounds = bounds;
+	primitiveIndices.resize(numPrimitives);
+	primitiveLeaves.assign(numPrimitives, -1);
+	nodes.clear();
+
+	if (numPrimitives == 0)
+		return;
+
+	std::vector<vec3> centroids(numPrimitives);
+	for (int i = 0; i < numPrimitives; i++)
+	{
+		primitiveIndices[i] = i;
+		centroids[i] = bounds[i].centroid();
+	}
+
+	nodes.reserve(2 * numPrimitives - 1);
+	BVHNode root;
+	root.leftChild = 0;
+	root.firstPrimitive = 0;
+	root.numPrimitives = numPrimitives;
+	root.parent = -1;
+	nodes.push_back(root);
+
+	updateLeafBounds(0);
+	subdivide(0, centroids, 0);
+}
+
+void BVH::updateLeafBounds(int nodeIndex)
+{
+	BVHNode& node = nodes[nodeIndex];
+	node.bounds = AABB();
+	for (int i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+		node.bounds.grow(primitiveBounds[primitiveIndices[i]]);
+}
+
+int partitionSah(int* indices, int count, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, float parentArea)
+{
+	AABB centroidBounds;
+	for (int i = 0; i < count; i++)
+		centroidBounds.grow(centroids[indices[i]]);
+
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = count * intersectionCost;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float axisMin = centroidBounds.min[axis];
+		float axisExtent = centroidBounds.max[axis] - axisMin;
+		if (axisExtent <= 0.0f)
+			continue;
+
+		AABB binBounds[numSahBins];
+		int binCounts[numSahBins] = {};
+		float binScale = numSahBins / axisExtent;
+		for (int i = 0; i < count; i++)
+		{
+			int primitive = indices[i];
+			int bin = std::min(numSahBins - 1, int((centroids[primitive][axis] - axisMin) * binScale));
+			binCounts[bin]++;
+			binBounds[bin].grow(primitiveBounds[primitive]);
+		}
+
+		float rightAreas[numSahBins];
+		int rightCounts[numSahBins];
+		AABB accumulated;
+		int accumulatedCount = 0;
+		for (int bin = numSahBins - 1; bin > 0; bin--)
+		{
+			accumulated.grow(binBounds[bin]);
+			accumulatedCount += binCounts[bin];
+			rightAreas[bin] = accumulated.surfaceArea();
+			rightCounts[bin] = accumulatedCount;
+		}
+
+		accumulated = AABB();
+		accumulatedCount = 0;
+		for (int split = 1; split < numSahBins; split++)
+		{
+			accumulated.grow(binBounds[split - 1]);
+			accumulatedCount += binCounts[split - 1];
+			if (accumulatedCount == 0 || rightCounts[split] == 0)
+				continue;
+
+			float cost = traversalCost + intersectionCost *
+				(accumulated.surfaceArea() * accumulatedCount + rightAreas[split] * rightCounts[split]) / parentArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	if (bestAxis == -1)
+		return 0;
+
+	float axisMin = centroidBounds.min[bestAxis];
+	float binScale = numSahBins / (centroidBounds.max[bestAxis] - axisMin);
+	int* middle = std::partition(indices, indices + count, [&](int primitive)
+	{
+		return std::min(numSahBins - 1, int((centroids[primitive][bestAxis] - axisMin) * binScale)) < bestSplit;
+	});
+	return int(middle - indices);
+}
+
+void BVH::subdivide(int nodeIndex, const std::vector<vec3>& centroids, int depth)
+{
+	BVHNode& node = nodes[nodeIndex];
+	int first = node.firstPrimitive;
+	int count = node.numPrimitives;
+
+	for (int i = first; i < first + count; i++)
+		primitiveLeaves[primitiveIndices[i]] = nodeIndex;
+
+	if (count <= maxLeafPrimitives || depth >= maxBVHDepth - 1)
+		return;
+
+	int leftCount = partitionSah(&primitiveIndices[first], count, primitiveBounds, centroids, node.bounds.surfaceArea());
+	if (leftCount == 0)
+		return;
+
+	int leftChild = int(nodes.size());
+	BVHNode left;
+	left.leftChild = 0;
+	left.firstPrimitive = first;
+	left.numPrimitives = leftCount;
+	left.parent = nodeIndex;
+	BVHNode right = left;
+	right.firstPrimitive = first + leftCount;
+	right.numPrimitives = count - leftCount;
+	nodes.push_back(left);
+	nodes.push_back(right);
+
+	nodes[nodeIndex].leftChild = leftChild;
+	nodes[nodeIndex].numPrimitives = 0;
+
+	updateLeafBounds(leftChild);
+	updateLeafBounds(leftChild + 1);
+	subdivide(leftChild, centroids, depth + 1);
+	subdivide(leftChild + 1, centroids, depth + 1);
+}
+
+// What a node adds to surfaceCost().
+static float nodeCost(const BVHNode& node)
+{
+	return node.bounds.surfaceArea() * (node.isLeaf() ? node.numPrimitives * intersectionCost : traversalCost);
+}
+
+static float areaGrowth(const AABB& box, const AABB& added)
+{
+	AABB grown = box;
+	grown.grow(added);
+	return grown.surfaceArea() - box.surfaceArea();
+}
+
+// Only the nodes whose bounds change are visited, and the change in surfaceCost() is summed along
+// the way, so an edit costs a walk up one path rather than over the whole tree.
+float BVH::refit(int primitive, const AABB& bounds)
+{
+	primitiveBounds[primitive] = bounds;
+
+	int nodeIndex = primitiveLeaves[primitive];
+	float costChange = -nodeCost(nodes[nodeIndex]);
+	updateLeafBounds(nodeIndex);
+	costChange += nodeCost(nodes[nodeIndex]);
+	return costChange + refitAncestors(nodes[nodeIndex].parent);
+}
+
+float BVH::refitAncestors(int nodeIndex)
+{
+	float costChange = 0.0f;
+	while (nodeIndex != -1)
+	{
+		BVHNode& node = nodes[nodeIndex];
+		AABB refitted = nodes[node.leftChild].bounds;
+		refitted.grow(nodes[node.leftChild + 1].bounds);
+		if (refitted == node.bounds)
+			break;
+		costChange -= nodeCost(node);
+		node.bounds = refitted;
+		costChange += nodeCost(node);
+		nodeIndex = node.parent;
+	}
+	return costChange;
+}
+
+// The new primitive becomes a leaf of its own next to the leaf found by descending into whichever
+// child grows least to take it, and the path above is refitted. Nothing is rebalanced, which is
+// left to a rebuild once the cost has drifted. A path already at the depth limit falls back to a
+// full build. Returns the change in surfaceCost().
+float BVH::insert(const AABB& bounds)
+{
+	float oldCost = nodes.empty() ? 0.0f : -1.0f;
+	int nodeIndex = 0;
+	int depth = 0;
+	while (!nodes.empty() && !nodes[nodeIndex].isLeaf())
+	{
+		int leftChild = nodes[nodeIndex].leftChild;
+		nodeIndex = areaGrowth(nodes[leftChild].bounds, bounds) <= areaGrowth(nodes[leftChild + 1].bounds, bounds) ? leftChild : leftChild + 1;
+		depth++;
+	}
+	if (nodes.empty() || depth >= maxBVHDepth - 1)
+	{
+		if (oldCost < 0.0f)
+			oldCost = surfaceCost();
+		std::vector<AABB> allBounds = primitiveBounds;
+		allBounds.push_back(bounds);
+		build(allBounds);
+		return surfaceCost() - oldCost;
+	}
+
+	int primitive = int(primitiveBounds.size());
+	primitiveBounds.push_back(bounds);
+	primitiveIndices.push_back(primitive);
+
+	int leftChild = int(nodes.size());
+	BVHNode moved = nodes[nodeIndex];
+	moved.parent = nodeIndex;
+	BVHNode added = moved;
+	added.bounds = bounds;
+	added.firstPrimitive = int(primitiveIndices.size()) - 1;
+	added.numPrimitives = 1;
+	nodes.push_back(moved);
+	nodes.push_back(added);
+	for (int i = moved.firstPrimitive; i < moved.firstPrimitive + moved.numPrimitives; i++)
+		primitiveLeaves[primitiveIndices[i]] = leftChild;
+	primitiveLeaves.push_back(leftChild + 1);
+
+	BVHNode& node = nodes[nodeIndex];
+	float costChange = -nodeCost(node);
+	node.leftChild = leftChild;
+	node.numPrimitives = 0;
+	node.bounds.grow(bounds);
+	costChange += nodeCost(node) + nodeCost(moved) + nodeCost(added);
+	return costChange + refitAncestors(node.parent);
+}
+
+void BVH::refitAll(const std::vector<AABB>& bounds)
+{
+	primitiveBounds = bounds;
+
+	// Children are always pushed after their parent, so a reverse sweep visits them first.
+	for (int i = int(nodes.size()) - 1; i >= 0; i--)
+	{
+		BVHNode& node = nodes[i];
+		if (node.isLeaf())
+		{
+			updateLeafBounds(i);
+			continue;
+		}
+		node.bounds = nodes[node.leftChild].bounds;
+		node.bounds.grow(nodes[node.leftChild + 1].bounds);
+	}
+}
+
+float BVH::surfaceCost() const
+{
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes)
+		cost += nodeCost(node);
+	return cost;
+}
+
+float BVH::sahCost() const
+{
+	return sahCost(surfaceCost());
+}
+
+float BVH::sahCost(float surfaceCost) const
+{
+	float rootArea = nodes.empty() ? 0.0f : nodes[0].bounds.surfaceArea();
+	return rootArea > 0.0f ? surfaceCost / rootArea : 0.0f;
+}
+
+static float intAsFloat(int value)
+{
+	float result;
+	memcpy(&result, &value, sizeof(result));
+	return result;
+}
+
+static void appendThreadedNode(const BVHNode* nodes, const int* primitiveIndices, int nodeIndex, int missLink, const std::vector<int>& subtreeSizes, std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset)
+{
+	const BVHNode& node = nodes[nodeIndex];
+	int leaf = -1;
+	if (node.isLeaf())
+	{
+		leaf = int(primitiveData.size());
+		primitiveData.push_back(node.numPrimitives);
+		for (int i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+			primitiveData.push_back(primitiveIndices[i] + primitiveOffset);
+	}
+
+	int flatIndex = int(nodeData.size() / 2);
+	nodeData.push_back(vec4(node.bounds.min, intAsFloat(missLink)));
+	nodeData.push_back(vec4(node.bounds.max, intAsFloat(leaf)));
+	if (node.isLeaf())
+		return;
+
+	int rightIndex = flatIndex + 1 + subtreeSizes[node.leftChild];
+	appendThreadedNode(nodes, primitiveIndices, node.leftChild, rightIndex, subtreeSizes, nodeData, primitiveData, primitiveOffset);
+	appendThreadedNode(nodes, primitiveIndices, node.leftChild + 1, missLink, subtreeSizes, nodeData, primitiveData, primitiveOffset);
+}
+
+// Flattens the tree in depth-first order for stackless traversal on the GPU. Each node takes two
+// texels: (min, miss link) and (max, leaf), where following a hit always means moving to the next
+// node and a miss jumps to the miss link, with -1 ending the traversal. The leaf field is -1 for
+// interior nodes and otherwise points at a count in primitiveData followed by that many primitive
+// indices offset by primitiveOffset. Returns the index of the root node.
+int appendThreadedBVH(const BVHNode* nodes, int numNodes, const int* primitiveIndices, std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset)
+{
+	if (numNodes == 0)
+		return -1;
+
+	std::vector<int> subtreeSizes(numNodes, 1);
+	for (int i = numNodes - 1; i >= 0; i--)
+		if (!nodes[i].isLeaf())
+			subtreeSizes[i] += subtreeSizes[nodes[i].leftChild] + subtreeSizes[nodes[i].leftChild + 1];
+
+	int root = int(nodeData.size() / 2);
+	appendThreadedNode(nodes, primitiveIndices, 0, -1, subtreeSizes, nodeData, primitiveData, primitiveOffset);
+	return root;
+}
+
+int BVH::appendThreaded(std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset) const
+{
+	return appendThreadedBVH(nodes.data(), int(nodes.size()), primitiveIndices.data(), nodeData, primitiveData, primitiveOffset);
+}
+
+bool BVH::isEmpty() const
+{
+	return nodes.empty();
+}
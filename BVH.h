@@ -0,0 +1,113 @@
+#pragma once
+#include <glm.hpp>
+#include <vector>
+#include <cfloat>
+
+using namespace glm;
+
+struct AABB
+{
+	vec3 min;
+	vec3 max;
+	AABB(vec3 min = vec3(FLT_MAX), vec3 max = vec3(-FLT_MAX)) : min(min), max(max)
+	{}
+	void grow(vec3 point);
+	void grow(const AABB& box);
+	vec3 centroid() const;
+	float surfaceArea() const;
+	bool operator==(const AABB& other) const;
+};
+
+float intersectAABB(const AABB& box, vec3 origin, vec3 inverseDirection, float tMax);
+AABB transformBounds(const AABB& box, const mat4& transform);
+
+struct BVHNode
+{
+	AABB bounds;
+	int leftChild;
+	int firstPrimitive;
+	int numPrimitives;
+	int parent;
+	bool isLeaf() const { return numPrimitives > 0; }
+};
+
+const int maxBVHDepth = 64;
+const int maxLeafPrimitives = 2;
+const int numSahBins = 12;
+const float traversalCost = 1.0f;
+const float intersectionCost = 1.0f;
+
+// Partitions indices around the cheapest binned SAH split and returns the size of the left half,
+// or 0 when keeping the primitives together as a leaf is cheaper.
+int partitionSah(int* indices, int count, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, float parentArea);
+
+// BVH::appendThreaded over raw arrays, so a tree can be uploaded straight from a mapped file.
+int appendThreadedBVH(const BVHNode* nodes, int numNodes, const int* primitiveIndices, std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset);
+
+class BVH
+{
+public:
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitiveIndices;
+	std::vector<AABB> primitiveBounds;
+	std::vector<int> primitiveLeaves;
+
+	void build(const std::vector<AABB>& bounds);
+	float refit(int primitive, const AABB& bounds);
+	float insert(const AABB& bounds);
+	void refitAll(const std::vector<AABB>& bounds);
+	// The sum over all nodes of their surface area times their traversal or intersection cost.
+	// sahCost() divides it by the root's area; refit() and insert() return how much they changed it.
+	float surfaceCost() const;
+	float sahCost() const;
+	float sahCost(float surfaceCost) const;
+	bool isEmpty() const;
+	int appendThreaded(std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset) const;
+
+	template <typename Intersect>
+	void traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const;
+private:
+	void subdivide(int nodeIndex, const std::vector<vec3>& centroids, int depth);
+	void updateLeafBounds(int nodeIndex);
+	float refitAncestors(int nodeIndex);
+};
+
+template <typename Intersect>
+void BVH::traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const
+{
+	if (nodes.empty())
+		return;
+
+	vec3 inverseDirection = 1.0f / direction;
+	int stack[maxBVHDepth * 2];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (intersectAABB(node.bounds, origin, inverseDirection, tMax) == FLT_MAX)
+			continue;
+
+		if (node.isLeaf())
+		{
+			for (int i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+				intersect(primitiveIndices[i]);
+			continue;
+		}
+
+		int nearChild = node.leftChild;
+		int farChild = node.leftChild + 1;
+		float tNear = intersectAABB(nodes[nearChild].bounds, origin, inverseDirection, tMax);
+		float tFar = intersectAABB(nodes[farChild].bounds, origin, inverseDirection, tMax);
+		if (tFar < tNear)
+		{
+			std::swap(nearChild, farChild);
+			std::swap(tNear, tFar);
+		}
+		if (tFar != FLT_MAX)
+			stack[stackSize++] = farChild;
+		if (tNear != FLT_MAX)
+			stack[stackSize++] = nearChild;
+	}
+}
@@ -0,0 +1,354 @@
+#include "BVHCache.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char bvhCacheMagic[8] = { 'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E' };
+
+MappedFile::MappedFile() : mapped(nullptr), mappedSize(0)
+{
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	file = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping)
+		mapped = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	mappedSize = size_t(fileSize.QuadPart);
+#else
+	file = ::open(path.c_str(), O_RDONLY);
+	if (file == -1)
+		return false;
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	mappedSize = size_t(status.st_size);
+	void* view = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, file, 0);
+	if (view != MAP_FAILED)
+		mapped = static_cast<const char*>(view);
+#endif
+	if (!mapped)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (mapped)
+		UnmapViewOfFile(mapped);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	if (mapped)
+		munmap(const_cast<char*>(mapped), mappedSize);
+	if (file != -1)
+		::close(file);
+	file = -1;
+#endif
+	mapped = nullptr;
+	mappedSize = 0;
+}
+
+const char* MappedFile::data() const
+{
+	return mapped;
+}
+
+size_t MappedFile::size() const
+{
+	return mappedSize;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// FNV-1a over the primitive bounds and every setting that changes the built tree, so a cache
+// written by a different build configuration is never mistaken for a valid one.
+uint64_t hashBVHInput(const std::vector<AABB>& bounds)
+{
+	const int settings[] = { int(bvhCacheVersion), maxBVHDepth, maxLeafPrimitives, numSahBins };
+	const float costs[] = { traversalCost, intersectionCost };
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = hashBytes(hash, settings, sizeof(settings));
+	hash = hashBytes(hash, costs, sizeof(costs));
+	if (!bounds.empty())
+		hash = hashBytes(hash, bounds.data(), bounds.size() * sizeof(AABB));
+	return hash;
+}
+
+// Sections start on a cache line, which also satisfies the alignment of the wide nodes.
+static uint64_t alignSection(uint64_t offset)
+{
+	const uint64_t alignment = 64;
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+static BVHCacheHeader makeHeader(uint64_t key, uint64_t numNodes, uint64_t numWideNodes, uint64_t numPrimitives)
+{
+	BVHCacheHeader header;
+	memcpy(header.magic, bvhCacheMagic, sizeof(header.magic));
+	header.version = bvhCacheVersion;
+	header.nodeSize = sizeof(BVHNode);
+	header.wideNodeSize = sizeof(WideBVHNode<defaultBVHWidth>);
+	header.wideWidth = defaultBVHWidth;
+	header.key = key;
+	header.numNodes = numNodes;
+	header.numWideNodes = numWideNodes;
+	header.numPrimitives = numPrimitives;
+	header.nodesOffset = alignSection(sizeof(BVHCacheHeader));
+	header.wideNodesOffset = alignSection(header.nodesOffset + numNodes * sizeof(BVHNode));
+	header.indicesOffset = header.wideNodesOffset + numWideNodes * sizeof(WideBVHNode<defaultBVHWidth>);
+	header.fileSize = header.indicesOffset + numPrimitives * sizeof(int);
+	return header;
+}
+
+// Written to a temporary file first and moved into place in one step, which rename does on POSIX
+// and MoveFileEx does on Windows, so a reader never finds the path missing or half written and
+// concurrent writers of the same scene simply replace each other.
+bool saveBVHCache(const std::string& path, uint64_t key, const BVH& bvh, const CpuBVH& wide)
+{
+	if (wide.primitiveIndices.size() != bvh.primitiveIndices.size())
+		return false;
+	BVHCacheHeader header = makeHeader(key, bvh.nodes.size(), wide.nodes.size(), bvh.primitiveIndices.size());
+
+	std::string temporaryPath = path + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+		const char padding[64] = {};
+		uint64_t written = 0;
+		auto write = [&](uint64_t offset, const void* data, uint64_t size)
+		{
+			file.write(padding, std::streamsize(offset - written));
+			file.write(static_cast<const char*>(data), std::streamsize(size));
+			written = offset + size;
+		};
+		write(0, &header, sizeof(header));
+		write(header.nodesOffset, bvh.nodes.data(), header.numNodes * sizeof(BVHNode));
+		write(header.wideNodesOffset, wide.nodes.data(), header.numWideNodes * sizeof(WideBVHNode<defaultBVHWidth>));
+		write(header.indicesOffset, bvh.primitiveIndices.data(), header.numPrimitives * sizeof(int));
+		if (!file)
+			return false;
+	}
+
+#ifdef _WIN32
+	return MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+#endif
+}
+
+static bool contains(const AABB& outer, const AABB& inner)
+{
+	return all(lessThanEqual(outer.min, inner.min)) && all(lessThanEqual(inner.max, outer.max));
+}
+
+static AABB slotBounds(const WideBVHNode<defaultBVHWidth>& node, int slot)
+{
+	return AABB(vec3(node.minX[slot], node.minY[slot], node.minZ[slot]), vec3(node.maxX[slot], node.maxY[slot], node.maxZ[slot]));
+}
+
+// Maps the file and checks the header against the expected key before trusting any of it. A
+// truncated or corrupted file then falls back to a rebuild instead of producing out of range
+// traversal.
+bool BVHCacheFile::open(const std::string& path, uint64_t key, const std::vector<AABB>& bounds)
+{
+	if (!file.open(path) || file.size() < sizeof(BVHCacheHeader))
+		return false;
+
+	memcpy(&header, file.data(), sizeof(header));
+	uint64_t numPrimitives = bounds.size();
+	bool isHeaderValid = header.numNodes > 0 && header.numNodes < 2 * numPrimitives &&
+		header.numWideNodes > 0 && header.numWideNodes <= header.numNodes;
+	if (isHeaderValid)
+	{
+		BVHCacheHeader expected = makeHeader(key, header.numNodes, header.numWideNodes, numPrimitives);
+		isHeaderValid = memcmp(&header, &expected, sizeof(header)) == 0 && header.fileSize == file.size();
+	}
+	if (!isHeaderValid || !isValid(bounds))
+	{
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+// Both trees are walked from their roots: every node has to be reached exactly once and no
+// deeper than the traversal stacks allow, every primitive exactly once through the shared
+// indices, and every box has to contain what is below it, so a damaged box cannot hide geometry.
+// Children always follow their parent, which the threaded upload relies on and which turns each
+// walk into one forward sweep.
+bool BVHCacheFile::isValid(const std::vector<AABB>& bounds) const
+{
+	int numPrimitives = int(header.numPrimitives);
+	int count = numNodes();
+	const BVHNode* binary = nodes();
+	const int* indices = primitiveIndices();
+	std::vector<int> depths(count, -1);
+	std::vector<char> isSlotReached(numPrimitives, 0);
+	std::vector<char> isPrimitiveReached(numPrimitives, 0);
+	int numSlotsReached = 0;
+	depths[0] = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const BVHNode& node = binary[i];
+		if (depths[i] < 0 || depths[i] >= maxBVHDepth || (i == 0 && node.parent != -1))
+			return false;
+		if (!node.isLeaf())
+		{
+			if (node.numPrimitives != 0 || node.leftChild <= i || node.leftChild + 1 >= count)
+				return false;
+			for (int child = node.leftChild; child <= node.leftChild + 1; child++)
+			{
+				if (depths[child] != -1 || binary[child].parent != i || !contains(node.bounds, binary[child].bounds))
+					return false;
+				depths[child] = depths[i] + 1;
+			}
+			continue;
+		}
+		if (node.firstPrimitive < 0 || node.numPrimitives > numPrimitives - node.firstPrimitive)
+			return false;
+		for (int j = node.firstPrimitive; j < node.firstPrimitive + node.numPrimitives; j++)
+		{
+			int primitive = indices[j];
+			if (isSlotReached[j] || primitive < 0 || primitive >= numPrimitives || isPrimitiveReached[primitive] || !contains(node.bounds, bounds[primitive]))
+				return false;
+			isSlotReached[j] = isPrimitiveReached[primitive] = 1;
+			numSlotsReached++;
+		}
+	}
+	if (numSlotsReached != numPrimitives)
+		return false;
+
+	int numWideNodes = int(header.numWideNodes);
+	const WideBVHNode<defaultBVHWidth>* wide = wideNodes();
+	std::vector<AABB> parentBounds(numWideNodes);
+	depths.assign(numWideNodes, -1);
+	isSlotReached.assign(numPrimitives, 0);
+	numSlotsReached = 0;
+	depths[0] = 0;
+	parentBounds[0] = AABB(vec3(-FLT_MAX), vec3(FLT_MAX));
+	for (int i = 0; i < numWideNodes; i++)
+	{
+		if (depths[i] < 0 || depths[i] >= maxBVHDepth)
+			return false;
+		const WideBVHNode<defaultBVHWidth>& node = wide[i];
+		for (int slot = 0; slot < defaultBVHWidth; slot++)
+		{
+			int child = node.children[slot];
+			int childCount = node.counts[slot];
+			AABB box = slotBounds(node, slot);
+			if (childCount == -1)
+				continue;
+			if (childCount < -1 || !contains(parentBounds[i], box))
+				return false;
+			if (childCount == 0)
+			{
+				if (child <= i || child >= numWideNodes || depths[child] != -1)
+					return false;
+				depths[child] = depths[i] + 1;
+				parentBounds[child] = box;
+				continue;
+			}
+			if (child < 0 || childCount > numPrimitives - child)
+				return false;
+			for (int j = child; j < child + childCount; j++)
+			{
+				if (isSlotReached[j] || !contains(box, bounds[indices[j]]))
+					return false;
+				isSlotReached[j] = 1;
+				numSlotsReached++;
+			}
+		}
+	}
+	return numSlotsReached == numPrimitives;
+}
+
+int BVHCacheFile::numNodes() const
+{
+	return int(header.numNodes);
+}
+
+const BVHNode* BVHCacheFile::nodes() const
+{
+	return reinterpret_cast<const BVHNode*>(file.data() + header.nodesOffset);
+}
+
+const WideBVHNode<defaultBVHWidth>* BVHCacheFile::wideNodes() const
+{
+	return reinterpret_cast<const WideBVHNode<defaultBVHWidth>*>(file.data() + header.wideNodesOffset);
+}
+
+const int* BVHCacheFile::primitiveIndices() const
+{
+	return reinterpret_cast<const int*>(file.data() + header.indicesOffset);
+}
+
+// For the few users that need a binary tree of their own, such as a layout switch.
+void BVHCacheFile::copyInto(BVH& bvh, const std::vector<AABB>& bounds) const
+{
+	bvh.nodes.assign(nodes(), nodes() + header.numNodes);
+	bvh.primitiveIndices.assign(primitiveIndices(), primitiveIndices() + header.numPrimitives);
+	bvh.primitiveBounds = bounds;
+	bvh.primitiveLeaves.assign(bounds.size(), -1);
+	for (int i = 0; i < numNodes(); i++)
+	{
+		const BVHNode& node = bvh.nodes[i];
+		for (int j = node.firstPrimitive; j < node.firstPrimitive + node.numPrimitives; j++)
+			bvh.primitiveLeaves[bvh.primitiveIndices[j]] = i;
+	}
+}
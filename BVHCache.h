@@ -0,0 +1,83 @@
+#pragma once
+#include "BVH.h"
+#include "WideBVH.h"
+#include <cstdint>
+#include <string>
+
+const uint32_t bvhCacheVersion = 2;
+
+static_assert(sizeof(BVHNode) == 40, "BVHNode is written to the cache as raw bytes");
+
+// Header of a BVH cache file. Sections are addressed by byte offsets from the start of the file
+// rather than pointers, so the file can be mapped at any address and used without fixups. Both
+// trees share the primitive indices: the binary one the GPU upload flattens and the CpuBVH the
+// CPU traces, each section starting on a cache line.
+struct BVHCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;
+	uint32_t wideNodeSize;
+	uint32_t wideWidth;
+	uint64_t key;
+	uint64_t numNodes;
+	uint64_t numWideNodes;
+	uint64_t numPrimitives;
+	uint64_t nodesOffset;
+	uint64_t wideNodesOffset;
+	uint64_t indicesOffset;
+	uint64_t fileSize;
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows it.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+	const char* data() const;
+	size_t size() const;
+private:
+	const char* mapped;
+	size_t mappedSize;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+};
+
+// A cache file that has been checked against the primitives it was built for and is kept mapped,
+// so both trees are read from it in place for as long as it stays open.
+class BVHCacheFile
+{
+public:
+	bool open(const std::string& path, uint64_t key, const std::vector<AABB>& bounds);
+	int numNodes() const;
+	const BVHNode* nodes() const;
+	const WideBVHNode<defaultBVHWidth>* wideNodes() const;
+	const int* primitiveIndices() const;
+	void copyInto(BVH& bvh, const std::vector<AABB>& bounds) const;
+
+	template <typename Intersect>
+	void traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const;
+private:
+	MappedFile file;
+	BVHCacheHeader header;
+	bool isValid(const std::vector<AABB>& bounds) const;
+};
+
+uint64_t hashBVHInput(const std::vector<AABB>& bounds);
+bool saveBVHCache(const std::string& path, uint64_t key, const BVH& bvh, const CpuBVH& wide);
+
+template <typename Intersect>
+void BVHCacheFile::traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const
+{
+	traverseWideBVH(wideNodes(), primitiveIndices(), origin, direction, tMax, intersect);
+}
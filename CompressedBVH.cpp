@@ -0,0 +1,122 @@
+#include "CompressedBVH.h"
+#include <cmath>
+#include <cstring>
+
+static float exponentScale(int exponent)
+{
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+void decompressNode(const CompressedBVHNode& node, WideBVHNode<4>& decompressed)
+{
+	float scaleX = exponentScale(node.exponents[0]);
+	float scaleY = exponentScale(node.exponents[1]);
+	float scaleZ = exponentScale(node.exponents[2]);
+	for (int i = 0; i < 4; i++)
+	{
+		decompressed.minX[i] = node.origin[0] + float(node.qMinX[i]) * scaleX;
+		decompressed.minY[i] = node.origin[1] + float(node.qMinY[i]) * scaleY;
+		decompressed.minZ[i] = node.origin[2] + float(node.qMinZ[i]) * scaleZ;
+		decompressed.maxX[i] = node.origin[0] + float(node.qMaxX[i]) * scaleX;
+		decompressed.maxY[i] = node.origin[1] + float(node.qMaxY[i]) * scaleY;
+		decompressed.maxZ[i] = node.origin[2] + float(node.qMaxZ[i]) * scaleZ;
+	}
+}
+
+// Quantizes one axis of every child, growing the cell size until the rounded-out grid bounds
+// contain the child bounds exactly as decompressNode will reconstruct them.
+static void quantizeAxis(float origin, float extent, const float* childMin, const float* childMax, int numChildren, int8_t& exponent, uint8_t* qMin, uint8_t* qMax)
+{
+	int e = extent > 0.0f ? int(std::ceil(std::log2(extent / 255.0f))) : -126;
+	for (e = std::max(e, -126); e < 127; e++)
+	{
+		float scale = exponentScale(e);
+		bool contained = true;
+		for (int i = 0; i < numChildren && contained; i++)
+		{
+			int low = std::max(0, std::min(255, int(std::floor((childMin[i] - origin) / scale))));
+			while (low > 0 && origin + float(low) * scale > childMin[i])
+				low--;
+			int high = std::max(0, std::min(255, int(std::ceil((childMax[i] - origin) / scale))));
+			while (high < 255 && origin + float(high) * scale < childMax[i])
+				high++;
+
+			contained = origin + float(low) * scale <= childMin[i] && origin + float(high) * scale >= childMax[i];
+			qMin[i] = uint8_t(low);
+			qMax[i] = uint8_t(high);
+		}
+		if (contained)
+			break;
+	}
+	exponent = int8_t(e);
+}
+
+void CompressedBVH::build(const WideBVH<4>& wide)
+{
+	nodes.resize(wide.nodes.size());
+	primitiveIndices = wide.primitiveIndices;
+
+	for (int n = 0; n < int(wide.nodes.size()); n++)
+	{
+		const WideBVHNode<4>& source = wide.nodes[n];
+		CompressedBVHNode& node = nodes[n];
+		memset(&node, 0, sizeof(node));
+
+		int numChildren = 0;
+		while (numChildren < 4 && source.counts[numChildren] >= 0)
+			numChildren++;
+		node.numChildren = uint8_t(numChildren);
+
+		AABB bounds;
+		for (int i = 0; i < numChildren; i++)
+		{
+			bounds.grow(AABB(vec3(source.minX[i], source.minY[i], source.minZ[i]), vec3(source.maxX[i], source.maxY[i], source.maxZ[i])));
+			node.children[i] = source.children[i];
+			node.counts[i] = uint16_t(source.counts[i]);
+		}
+		for (int i = numChildren; i < 4; i++)
+			node.counts[i] = compressedEmptySlot;
+
+		vec3 extent = bounds.max - bounds.min;
+		node.origin[0] = bounds.min.x;
+		node.origin[1] = bounds.min.y;
+		node.origin[2] = bounds.min.z;
+		quantizeAxis(bounds.min.x, extent.x, source.minX, source.maxX, numChildren, node.exponents[0], node.qMinX, node.qMaxX);
+		quantizeAxis(bounds.min.y, extent.y, source.minY, source.maxY, numChildren, node.exponents[1], node.qMinY, node.qMaxY);
+		quantizeAxis(bounds.min.z, extent.z, source.minZ, source.maxZ, numChildren, node.exponents[2], node.qMinZ, node.qMaxZ);
+	}
+}
+
+size_t CompressedBVH::memoryBytes() const
+{
+	return nodes.size() * sizeof(CompressedBVHNode) + primitiveIndices.size() * sizeof(int);
+}
+
+bool CompressedBVH::isEmpty() const
+{
+	return nodes.empty();
+}
+
+BVHMemory measureBVHMemory(const BVH& binary)
+{
+	BVHMemory memory = {};
+	float numPrimitives = float(binary.primitiveIndices.size());
+	if (numPrimitives == 0.0f)
+		return memory;
+
+	WideBVH<4> wide4;
+	WideBVH<8> wide8;
+	CompressedBVH compressed;
+	wide4.build(binary);
+	wide8.build(binary);
+	compressed.build(wide4);
+
+	memory.binary = (binary.nodes.size() * sizeof(BVHNode) + binary.primitiveIndices.size() * sizeof(int)) / numPrimitives;
+	memory.wide4 = wide4.memoryBytes() / numPrimitives;
+	memory.wide8 = wide8.memoryBytes() / numPrimitives;
+	memory.compressed = compressed.memoryBytes() / numPrimitives;
+	return memory;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include "WideBVH.h"
+#include <cstdint>
+
+// A 4-wide node in 64 bytes. Child bounds are stored as 8-bit offsets on a grid anchored at
+// origin with a power of two cell size per axis, rounded outwards so the decompressed boxes
+// always contain the originals. Leaf counts use 0 for interior children and 0xFFFF for empty slots.
+struct CompressedBVHNode
+{
+	float origin[3];
+	int8_t exponents[3];
+	uint8_t numChildren;
+	uint8_t qMinX[4], qMinY[4], qMinZ[4];
+	uint8_t qMaxX[4], qMaxY[4], qMaxZ[4];
+	int children[4];
+	uint16_t counts[4];
+};
+
+static_assert(sizeof(CompressedBVHNode) == 64, "CompressedBVHNode should fill one cache line");
+
+const uint16_t compressedEmptySlot = 0xFFFF;
+
+void decompressNode(const CompressedBVHNode& node, WideBVHNode<4>& decompressed);
+
+class CompressedBVH
+{
+public:
+	std::vector<CompressedBVHNode> nodes;
+	std::vector<int> primitiveIndices;
+
+	void build(const WideBVH<4>& wide);
+	size_t memoryBytes() const;
+	bool isEmpty() const;
+
+	template <typename Intersect>
+	void traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const;
+};
+
+struct BVHMemory
+{
+	float binary;
+	float wide4;
+	float wide8;
+	float compressed;
+};
+
+BVHMemory measureBVHMemory(const BVH& binary);
+
+template <typename Intersect>
+void CompressedBVH::traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const
+{
+	if (nodes.empty())
+		return;
+
+	struct StackEntry
+	{
+		int child;
+		int count;
+		float tEnter;
+	};
+
+	WideRay ray = WideRay(origin, direction);
+	StackEntry stack[maxBVHDepth * 4];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.0f };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		if (entry.tEnter > tMax)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (int i = entry.child; i < entry.child + entry.count; i++)
+				intersect(primitiveIndices[i]);
+			continue;
+		}
+
+		const CompressedBVHNode& node = nodes[entry.child];
+		WideBVHNode<4> decompressed;
+		decompressNode(node, decompressed);
+		float tEnter[4];
+		int hitMask = intersectChildren<4>(decompressed, ray, tMax, tEnter);
+
+		int first = stackSize;
+		for (int i = 0; i < node.numChildren; i++)
+		{
+			if (!(hitMask & (1 << i)))
+				continue;
+			StackEntry child = { node.children[i], node.counts[i], tEnter[i] };
+			int j = stackSize++;
+			while (j > first && stack[j - 1].tEnter < child.tEnter)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+}
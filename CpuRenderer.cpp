@@ -0,0 +1,774 @@
+#include "CpuRenderer.h"
+#include "HeapCounter.h"
+#include <stb/stb_image.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+const float PI = 3.14159265359f;
+const int parallelBlockSize = 64;
+const int packetsPerBlock = 4;
+
+// Hands out blocks of parallelBlockSize items to the scheduler's workers until count is reached.
+template <typename Function>
+static void parallelFor(TileScheduler& scheduler, int count, Function function)
+{
+	scheduler.parallelForBlocks(count, parallelBlockSize, [&](int first, int last, Arena&)
+	{
+		for (int i = first; i < last; i++)
+			function(i);
+	});
+}
+
+static uint32_t expandBits(uint32_t value)
+{
+	value = (value * 0x00010001u) & 0xFF0000FFu;
+	value = (value * 0x00000101u) & 0x0F00F00Fu;
+	value = (value * 0x00000011u) & 0xC30C30C3u;
+	value = (value * 0x00000005u) & 0x49249249u;
+	return value;
+}
+
+// The direction octant in the top bits followed by a 30-bit Morton code of the origin within
+// the bounds of the batch, so rays that leave nearby points in similar directions end up next
+// to each other and walk the same BVH nodes while they are still in cache.
+static uint32_t rayOrderKey(vec3 origin, vec3 direction, const AABB& bounds)
+{
+	uint32_t octant = (direction.x < 0.0f ? 1u : 0u) | (direction.y < 0.0f ? 2u : 0u) | (direction.z < 0.0f ? 4u : 0u);
+	vec3 extent = max(bounds.max - bounds.min, vec3(1e-6f));
+	uvec3 cell = uvec3(clamp((origin - bounds.min) / extent * 1023.0f, 0.0f, 1023.0f));
+	uint32_t morton = (expandBits(cell.x) << 2) | (expandBits(cell.y) << 1) | expandBits(cell.z);
+	return (octant << 29) | (morton >> 1);
+}
+
+// Least significant digit radix sort on the upper 32 bits, which hold the key, carrying the
+// queue index in the lower 32.
+static void radixSort(uint64_t*& keys, uint64_t*& scratch, int count)
+{
+	for (int shift = 32; shift < 64; shift += 8)
+	{
+		size_t offsets[257] = {};
+		for (int i = 0; i < count; i++)
+			offsets[((keys[i] >> shift) & 0xFF) + 1]++;
+		for (int i = 1; i < 257; i++)
+			offsets[i] += offsets[i - 1];
+		for (int i = 0; i < count; i++)
+			scratch[offsets[(keys[i] >> shift) & 0xFF]++] = keys[i];
+		swap(keys, scratch);
+	}
+}
+
+// queue and scratch, like keys and keyScratch, hold at least count entries and swap roles.
+template <typename QueuedRay>
+static void sortQueue(TileScheduler& scheduler, QueuedRay*& queue, QueuedRay*& scratch, int count, uint64_t*& keys, uint64_t*& keyScratch)
+{
+	AABB bounds;
+	for (int i = 0; i < count; i++)
+		bounds.grow(queue[i].origin);
+
+	parallelFor(scheduler, count, [&](int i)
+	{
+		keys[i] = (uint64_t(rayOrderKey(queue[i].origin, queue[i].direction, bounds)) << 32) | uint32_t(i);
+	});
+	radixSort(keys, keyScratch, count);
+
+	parallelFor(scheduler, count, [&](int i)
+	{
+		scratch[i] = queue[uint32_t(keys[i])];
+	});
+	swap(queue, scratch);
+}
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static float random(uint32_t& state)
+{
+	state = state * 747796405u + 2891336453u;
+	uint32_t result = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return result / 4294967295.0f;
+}
+
+static float randomNormalDistribution(uint32_t& seed)
+{
+	float theta = 2 * PI * random(seed);
+	float rho = sqrt(-2 * log(random(seed)));
+	return rho * cos(theta);
+}
+
+static vec3 randomDirection(uint32_t& seed)
+{
+	float x = randomNormalDistribution(seed);
+	float y = randomNormalDistribution(seed);
+	float z = randomNormalDistribution(seed);
+	return normalize(vec3(x, y, z));
+}
+
+static vec3 reflectRough(vec3 direction, vec3 normal, float roughness, uint32_t& seed)
+{
+	vec3 reflected = normalize(direction) - 2 * dot(normalize(direction), normalize(normal)) * normal;
+	return normalize(reflected + randomDirection(seed) * roughness);
+}
+
+bool CpuRenderer::loadHdri(const string& path)
+{
+	int numChannels;
+	unsigned char* pixels = stbi_load(path.c_str(), &hdriWidth, &hdriHeight, &numChannels, 3);
+	if (!pixels)
+	{
+		cout << "Failed to load hdri " << path << endl;
+		return false;
+	}
+	hdriPixels.assign(pixels, pixels + hdriWidth * hdriHeight * 3);
+	stbi_image_free(pixels);
+	return true;
+}
+
+// Matches equirectangularProjection in the shader, with repeat wrapping and bilinear filtering.
+vec3 CpuRenderer::sampleHdri(vec3 direction) const
+{
+	if (!showHdri || hdriPixels.empty())
+		return vec3(0.0);
+
+	float u = 0.5f + atan(direction.x / direction.z) / (2 * PI);
+	float v = -(0.5f + asin(clamp(direction.y, -1.0f, 1.0f)) / PI);
+	float x = (u - floor(u)) * hdriWidth - 0.5f;
+	float y = (v - floor(v)) * hdriHeight - 0.5f;
+	int x0 = int(floor(x));
+	int y0 = int(floor(y));
+	float fx = x - x0;
+	float fy = y - y0;
+
+	auto texel = [&](int tx, int ty)
+	{
+		tx = (tx % hdriWidth + hdriWidth) % hdriWidth;
+		ty = (ty % hdriHeight + hdriHeight) % hdriHeight;
+		const unsigned char* p = &hdriPixels[(ty * hdriWidth + tx) * 3];
+		return vec3(p[0], p[1], p[2]) / 255.0f;
+	};
+	vec3 top = mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+	vec3 bottom = mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+	return mix(top, bottom, fy);
+}
+
+// Pixels are stored bottom row first, like gl_FragCoord.
+vec3 CpuRenderer::cameraDirection(Scene& scene, int pixel) const
+{
+	float x = (pixel % width + 0.5f - width / 2.0f) / width;
+	float y = (pixel / width + 0.5f - height / 2.0f) / height;
+	return normalize(scene.camera.getForward() + x * scene.camera.getRight() + y * scene.camera.getUp());
+}
+
+void CpuRenderer::render(Scene& scene, const CpuRenderSettings& settings)
+{
+	auto start = chrono::steady_clock::now();
+	stats = {};
+	width = settings.width;
+	height = settings.height;
+	showHdri = settings.showHdri;
+	lastNumSamples = settings.numSamples;
+
+	if (scene.instanceBVHDirty)
+		scene.buildInstanceBVH();
+	replicateMeshes(scene);
+	preparePixels(scene);
+
+	// Everything from here on takes its scratch memory from the frame arena or the workers'
+	// arenas. Once a frame with the same layout has sized them, rendering must not allocate.
+	RenderLayout layout = { width, height, mode, sortRays, usePackets, scheduler.pinThreads, denoiseSettings.isEnabled, adaptiveSettings.isEnabled };
+	bool isSteadyState = layout.width == lastLayout.width && layout.height == lastLayout.height && layout.mode == lastLayout.mode &&
+		layout.sortRays == lastLayout.sortRays && layout.usePackets == lastLayout.usePackets && layout.pinThreads == lastLayout.pinThreads &&
+		layout.denoise == lastLayout.denoise && layout.adaptive == lastLayout.adaptive;
+	lastLayout = layout;
+	frameArena.reset();
+	long long heapAllocations = heapAllocationCount();
+
+	if (mode == CpuRenderMode::Megakernel)
+		renderMegakernel(scene, settings);
+	else
+		renderWavefront(scene, settings);
+
+	parallelFor(scheduler, width * height, [&](int pixel)
+	{
+		image[pixel] /= float(std::max(sampleCounts[pixel], 1));
+	});
+
+	if (denoiseSettings.isEnabled)
+	{
+		auto denoiseStart = chrono::steady_clock::now();
+		writeFeatures(scene);
+		denoiseImage(scheduler, frameArena, denoiseSettings, width, height, sampleCounts.get(), image.get(), moments.get(), features.get());
+		stats.denoise = millisecondsSince(denoiseStart);
+	}
+
+	stats.heapAllocations = heapAllocationCount() - heapAllocations;
+	stats.isSteadyState = isSteadyState;
+	if (isHeapCounting && logHeapAllocations && isSteadyState && stats.heapAllocations != 0)
+		cout << "CPU renderer made " << stats.heapAllocations << " heap allocations in a steady state frame" << endl;
+	stats.total = millisecondsSince(start);
+	uploadImage();
+}
+
+// The buffers are allocated without being written, so each page is placed by the first worker to
+// clear part of it. The clear does not steal, which keeps every tile with the worker, and so the
+// node, that the megakernel deals it to first.
+void CpuRenderer::preparePixels(Scene& scene)
+{
+	if (numAllocatedPixels != width * height)
+	{
+		numAllocatedPixels = width * height;
+		image.reset(new vec3[numAllocatedPixels]);
+		lensOrigins.reset(new vec3[numAllocatedPixels]);
+		pixelSeeds.reset(new uint32_t[numAllocatedPixels]);
+		sampleCounts.reset(new int[numAllocatedPixels]);
+		displayMoments.reset(new vec2[numAllocatedPixels]);
+		moments.reset(new vec2[numAllocatedPixels]);
+		features.reset(new PixelFeatures[numAllocatedPixels]);
+	}
+
+	vec3 cameraOrigin = scene.camera.getOrigin();
+	scheduler.run(width, height, [&](const Tile& tile, Arena&)
+	{
+		for (int y = tile.y; y < tile.y + tile.height; y++)
+			for (int pixel = y * width + tile.x; pixel < y * width + tile.x + tile.width; pixel++)
+			{
+				image[pixel] = vec3(0.0);
+				moments[pixel] = vec2(0.0);
+				displayMoments[pixel] = vec2(0.0);
+				features[pixel] = PixelFeatures();
+				lensOrigins[pixel] = cameraOrigin;
+				pixelSeeds[pixel] = uint32_t(pixel);
+				sampleCounts[pixel] = 0;
+			}
+	}, false);
+}
+
+// With pinned threads on more than one node, each node gets its own copy of the meshes, made by a
+// worker on that node, and Scene::localMesh hands threads the copy on their node. Anything else
+// the scene traces is small enough to stay in cache.
+void CpuRenderer::replicateMeshes(Scene& scene)
+{
+	int numNodes = scheduler.pinThreads ? scheduler.numNodes() : 1;
+	for (MeshObject& meshObject : scene.meshes)
+	{
+		if (numNodes == 1)
+		{
+			meshObject.nodeReplicas.clear();
+			continue;
+		}
+		if (int(meshObject.nodeReplicas.size()) == numNodes)
+			continue;
+
+		meshObject.mesh.requireBVH();
+		meshObject.nodeReplicas.clear();
+		meshObject.nodeReplicas.resize(numNodes);
+		scheduler.forEachNode([&](int node)
+		{
+			meshObject.nodeReplicas[node] = meshObject.mesh.replicate();
+		});
+	}
+}
+
+// Each tile is given the number of samples its pixels need in the next pass, which without
+// adaptive sampling is numSamples for the first and none after it.
+void CpuRenderer::renderMegakernel(Scene& scene, const CpuRenderSettings& settings)
+{
+	bool isAdaptive = adaptiveSettings.isEnabled;
+	int maxSamples = isAdaptive ? std::max(adaptiveSettings.maxSamples, 1) : settings.numSamples;
+	int firstSamples = isAdaptive ? clamp(adaptiveSettings.minSamples, 1, maxSamples) : settings.numSamples;
+	int tileSize = std::max(scheduler.tileSize, 1);
+	int tilesWide = (width + tileSize - 1) / tileSize;
+	int numTiles = tilesWide * ((height + tileSize - 1) / tileSize);
+	int* tileSamples = frameArena.allocateArray<int>(numTiles);
+	fill(tileSamples, tileSamples + numTiles, firstSamples);
+
+	atomic<long long> numRays(0);
+	atomic<long long> numShadowRays(0);
+	atomic<int> numActiveTiles(numTiles);
+	while (numActiveTiles > 0)
+	{
+		numActiveTiles = 0;
+		scheduler.run(width, height, [&](const Tile& tile, Arena&)
+		{
+			int& numSamples = tileSamples[(tile.y / tileSize) * tilesWide + tile.x / tileSize];
+			if (numSamples == 0)
+				return;
+
+			RayCounts counts = {};
+			for (int y = tile.y; y < tile.y + tile.height; y++)
+				for (int pixel = y * width + tile.x; pixel < y * width + tile.x + tile.width; pixel++)
+					samplePixel(scene, settings, pixel, numSamples, counts);
+			numSamples = isAdaptive ? additionalSamples(tile, maxSamples) : 0;
+			if (numSamples > 0)
+				numActiveTiles++;
+			numRays += counts.rays;
+			numShadowRays += counts.shadowRays;
+		});
+		stats.numPasses++;
+	}
+	stats.numRays = numRays.load();
+	stats.numShadowRays = numShadowRays.load();
+
+	long long totalSamples = 0;
+	for (int pixel = 0; pixel < width * height; pixel++)
+		totalSamples += sampleCounts[pixel];
+	stats.meanSamples = double(totalSamples) / (width * height);
+}
+
+// The lens origin carries on from the pixel's previous pass, so splitting its samples over several
+// passes gives the same result as taking them all at once.
+void CpuRenderer::samplePixel(Scene& scene, const CpuRenderSettings& settings, int pixel, int numSamples, RayCounts& counts)
+{
+	uint32_t& seed = pixelSeeds[pixel];
+	vec3 direction = cameraDirection(scene, pixel);
+	vec3 focusPoint = scene.camera.getOrigin() + direction * std::max(0.001f, settings.blurDistance);
+	Ray ray = Ray(lensOrigins[pixel], direction);
+	for (int i = 0; i < numSamples; i++)
+	{
+		ray.origin += randomDirection(seed) * settings.blurStrength;
+		ray.direction = normalize(focusPoint - ray.origin);
+		vec3 color = trace(scene, ray, std::max(settings.numLightBounces, 1), seed, counts);
+		float colorLuminance = luminance(color);
+		float displayLuminance = std::min(colorLuminance, 1.0f);
+		image[pixel] += color;
+		moments[pixel] += vec2(colorLuminance, colorLuminance * colorLuminance);
+		displayMoments[pixel] += vec2(displayLuminance, displayLuminance * displayLuminance);
+	}
+	lensOrigins[pixel] = ray.origin;
+	sampleCounts[pixel] += numSamples;
+}
+
+// Every pixel of a tile has the same number of samples.
+int CpuRenderer::additionalSamples(const Tile& tile, int maxSamples) const
+{
+	int numSamples = sampleCounts[tile.y * width + tile.x];
+	float sumVariance = 0.0f;
+	for (int y = tile.y; y < tile.y + tile.height; y++)
+		for (int pixel = y * width + tile.x; pixel < y * width + tile.x + tile.width; pixel++)
+			sumVariance += meanVariance(displayMoments[pixel], numSamples);
+	float error = sqrt(sumVariance / (tile.width * tile.height));
+	return additionalTileSamples(adaptiveSettings, numSamples, maxSamples, error);
+}
+
+vec3 CpuRenderer::trace(Scene& scene, Ray ray, int maxBounces, uint32_t& seed, RayCounts& counts)
+{
+	HitInfo closestHit = scene.hitScene(ray);
+	counts.rays++;
+	if (!closestHit.hasHit)
+		return sampleHdri(ray.direction);
+
+	vec3 hitPoint = ray.origin + ray.direction * closestHit.t;
+	vec3 totalLight = directLight(scene, closestHit.hitNormal, hitPoint, closestHit.material, seed, counts);
+
+	vec3 indirectLight = vec3(0.0);
+	Material hitMaterial = closestHit.material;
+	vec3 normal = closestHit.hitNormal;
+	for (int i = 0; i < maxBounces; i++)
+	{
+		Ray reflectedRay = Ray(hitPoint, reflectRough(ray.direction, normal, hitMaterial.roughness, seed));
+		HitInfo hitInfo = scene.hitScene(reflectedRay);
+		counts.rays++;
+		if (!hitInfo.hasHit)
+		{
+			indirectLight += hitMaterial.color * sampleHdri(reflectedRay.direction);
+			break;
+		}
+		hitPoint = reflectedRay.origin + reflectedRay.direction * hitInfo.t;
+		indirectLight += hitMaterial.color * directLight(scene, hitInfo.hitNormal, hitPoint, hitInfo.material, seed, counts);
+		ray = reflectedRay;
+		normal = hitInfo.hitNormal;
+		hitMaterial = hitInfo.material;
+	}
+	return totalLight + indirectLight / float(maxBounces) * 2.0f;
+}
+
+// Like calculateDirectLight in the shader, an occluded light also hides the surface's emission.
+vec3 CpuRenderer::directLight(Scene& scene, vec3 normal, vec3 hitPoint, const Material& material, uint32_t& seed, RayCounts& counts)
+{
+	vec3 emission = material.color * material.emission * 10.0f;
+	if (scene.numLights == 0)
+		return emission;
+
+	const Light& light = scene.lights[0];
+	vec3 shadowRayDirection = light.origin - hitPoint + randomDirection(seed) * light.radius;
+	float distanceToLight = length(shadowRayDirection);
+	shadowRayDirection = normalize(shadowRayDirection);
+	HitInfo occluder = scene.hitScene(Ray(hitPoint, shadowRayDirection), distanceToLight, true);
+	counts.shadowRays++;
+	if (occluder.hasHit)
+		return vec3(0.0);
+
+	vec3 lightColor = material.color * light.color * light.strength * dot(normalize(normal), shadowRayDirection);
+	return lightColor / (4.0f * PI * distanceToLight * distanceToLight) + emission;
+}
+
+// Runs one sample of every pixel per pass, so each pixel owns at most one path and one shadow
+// request at a time and the stages can add to the image without synchronization.
+void CpuRenderer::renderWavefront(Scene& scene, const CpuRenderSettings& settings)
+{
+	int numPixels = width * height;
+	int maxBounces = std::max(settings.numLightBounces, 1);
+	buildPixelOrder();
+	paths = frameArena.allocateArray<WavefrontPath>(numPixels);
+	nextPaths = frameArena.allocateArray<WavefrontPath>(numPixels);
+	hits = frameArena.allocateArray<HitInfo>(numPixels);
+	shadowRequests = frameArena.allocateArray<ShadowRequest>(numPixels);
+	if (sortRays)
+	{
+		sortedPaths = frameArena.allocateArray<WavefrontPath>(numPixels);
+		sortedShadowRequests = frameArena.allocateArray<ShadowRequest>(numPixels);
+		sortKeys = frameArena.allocateArray<uint64_t>(numPixels);
+		sortKeyScratch = frameArena.allocateArray<uint64_t>(numPixels);
+	}
+	if (denoiseSettings.isEnabled)
+		sampleLuminance = frameArena.allocateArray<float>(numPixels);
+
+	for (int sample = 0; sample < settings.numSamples; sample++)
+	{
+		auto start = chrono::steady_clock::now();
+		int numPaths = generate(sample, settings, scene);
+		stats.generate += millisecondsSince(start);
+
+		for (int depth = 0; numPaths > 0; depth++)
+		{
+			// Camera rays are already coherent; sorting pays off from the first bounce on.
+			if (sortRays && depth > 0)
+			{
+				start = chrono::steady_clock::now();
+				sortQueue(scheduler, paths, sortedPaths, numPaths, sortKeys, sortKeyScratch);
+				stats.sort += millisecondsSince(start);
+			}
+
+			start = chrono::steady_clock::now();
+			extend(scene, numPaths, depth == 0);
+			double extendTime = millisecondsSince(start);
+			stats.extend += extendTime;
+			if (depth == 0)
+				stats.primary += extendTime;
+			stats.numRays += numPaths;
+
+			int numNextPaths, numShadowRequests;
+			start = chrono::steady_clock::now();
+			shade(scene, numPaths, maxBounces, numNextPaths, numShadowRequests);
+			stats.shade += millisecondsSince(start);
+
+			if (sortRays)
+			{
+				start = chrono::steady_clock::now();
+				sortQueue(scheduler, shadowRequests, sortedShadowRequests, numShadowRequests, sortKeys, sortKeyScratch);
+				stats.sort += millisecondsSince(start);
+			}
+
+			start = chrono::steady_clock::now();
+			traceShadows(scene, numShadowRequests);
+			stats.shadow += millisecondsSince(start);
+			stats.numShadowRays += numShadowRequests;
+
+			swap(paths, nextPaths);
+			numPaths = numNextPaths;
+		}
+
+		if (denoiseSettings.isEnabled)
+			accumulateMoments();
+	}
+}
+
+// A sample's contributions reach the image from several stages, so its luminance is only known
+// as the change in the pixel's total since the previous sample.
+void CpuRenderer::accumulateMoments()
+{
+	parallelFor(scheduler, width * height, [&](int pixel)
+	{
+		float totalLuminance = luminance(image[pixel]);
+		float colorLuminance = totalLuminance - sampleLuminance[pixel];
+		sampleLuminance[pixel] = totalLuminance;
+		moments[pixel] += vec2(colorLuminance, colorLuminance * colorLuminance);
+	});
+}
+
+// Through the pixel centre from the camera origin, without depth of field, so the features are
+// free of noise.
+void CpuRenderer::writeFeatures(Scene& scene)
+{
+	scheduler.forEachPixel(width, height, [&](int pixel)
+	{
+		HitInfo hit = scene.hitScene(Ray(scene.camera.getOrigin(), cameraDirection(scene, pixel)));
+		features[pixel] = PixelFeatures();
+		if (hit.hasHit)
+		{
+			features[pixel].albedo = hit.material.color;
+			features[pixel].normal = normalize(hit.hitNormal);
+			features[pixel].depth = hit.t;
+		}
+	});
+	stats.numRays += width * height;
+}
+
+// Paths are laid out in packetWidth by packetWidth pixel tiles, so consecutive runs of
+// packetSize camera rays leave neighbouring pixels and can be traced as one packet.
+void CpuRenderer::buildPixelOrder()
+{
+	pixelOrder = frameArena.allocateArray<int>(width * height);
+	int numOrdered = 0;
+	for (int tileY = 0; tileY < height; tileY += packetWidth)
+		for (int tileX = 0; tileX < width; tileX += packetWidth)
+			for (int y = tileY; y < std::min(tileY + packetWidth, height); y++)
+				for (int x = tileX; x < std::min(tileX + packetWidth, width); x++)
+					pixelOrder[numOrdered++] = y * width + x;
+}
+
+int CpuRenderer::generate(int sample, const CpuRenderSettings& settings, Scene& scene)
+{
+	int numPixels = width * height;
+	vec3 cameraOrigin = scene.camera.getOrigin();
+	float focusDistance = std::max(0.001f, settings.blurDistance);
+	parallelFor(scheduler, numPixels, [&](int i)
+	{
+		int pixel = pixelOrder[i];
+		uint32_t seed = pixelSeeds[pixel];
+		vec3 focusPoint = cameraOrigin + cameraDirection(scene, pixel) * focusDistance;
+		lensOrigins[pixel] += randomDirection(seed) * settings.blurStrength;
+
+		WavefrontPath& path = paths[i];
+		path.origin = lensOrigins[pixel];
+		path.direction = normalize(focusPoint - path.origin);
+		path.weight = vec3(1.0);
+		path.pixel = pixel;
+		path.depth = 0;
+		path.seed = seed;
+		pixelSeeds[pixel] = seed * 1664525u + 1013904223u + uint32_t(sample);
+		sampleCounts[pixel]++;
+	});
+	return numPixels;
+}
+
+void CpuRenderer::extend(Scene& scene, int numPaths, bool isPrimary)
+{
+	if (usePackets && isPrimary)
+	{
+		scheduler.parallelForBlocks(numPaths, packetSize * packetsPerBlock, [&](int blockFirst, int blockLast, Arena& scratch)
+		{
+			RayPacket& packet = *scratch.allocateArray<RayPacket>(1);
+			for (int first = blockFirst; first < blockLast; first += packetSize)
+			{
+				packet.count = 0;
+				for (int i = first; i < std::min(first + packetSize, blockLast); i++)
+					packet.add(paths[i].origin, paths[i].direction, FLT_MAX);
+				scene.hitScenePacket(packet, &hits[first]);
+			}
+		});
+		return;
+	}
+
+	parallelFor(scheduler, numPaths, [&](int i)
+	{
+		hits[i] = scene.hitScene(Ray(paths[i].origin, paths[i].direction));
+	});
+}
+
+// A miss picks up the environment and ends the path. A hit queues a shadow ray towards the light
+// carrying the direct light and emission it delivers when unoccluded, and queues the rough
+// reflection as the next path until numLightBounces indirect bounces have been traced.
+void CpuRenderer::shade(Scene& scene, int numPaths, int maxBounces, int& numNextPaths, int& numShadowRequests)
+{
+	atomic<int> nextCount(0);
+	atomic<int> shadowCount(0);
+	float indirectScale = 2.0f / maxBounces;
+
+	// Each block fills local queues and reserves space in the shared ones once, instead of
+	// contending on the counters for every path.
+	scheduler.parallelForBlocks(numPaths, parallelBlockSize, [&](int first, int last, Arena& scratch)
+	{
+		WavefrontPath* blockPaths = scratch.allocateArray<WavefrontPath>(last - first);
+		ShadowRequest* blockRequests = scratch.allocateArray<ShadowRequest>(last - first);
+		int numBlockPaths = 0;
+		int numBlockRequests = 0;
+
+		for (int i = first; i < last; i++)
+		{
+			WavefrontPath path = paths[i];
+			const HitInfo& hit = hits[i];
+			if (!hit.hasHit)
+			{
+				image[path.pixel] += path.weight * sampleHdri(path.direction);
+				continue;
+			}
+
+			const Material& material = hit.material;
+			vec3 hitPoint = path.origin + path.direction * hit.t;
+			vec3 emission = material.color * material.emission * 10.0f;
+			if (scene.numLights == 0)
+			{
+				image[path.pixel] += path.weight * emission;
+			}
+			else
+			{
+				const Light& light = scene.lights[0];
+				vec3 shadowRayDirection = light.origin - hitPoint + randomDirection(path.seed) * light.radius;
+				float distanceToLight = length(shadowRayDirection);
+				shadowRayDirection = normalize(shadowRayDirection);
+				vec3 lightColor = material.color * light.color * light.strength * dot(normalize(hit.hitNormal), shadowRayDirection);
+
+				ShadowRequest& request = blockRequests[numBlockRequests++];
+				request.origin = hitPoint;
+				request.direction = shadowRayDirection;
+				request.distance = distanceToLight;
+				request.radiance = path.weight * (lightColor / (4.0f * PI * distanceToLight * distanceToLight) + emission);
+				request.pixel = path.pixel;
+			}
+
+			if (path.depth == maxBounces)
+				continue;
+
+			WavefrontPath& next = blockPaths[numBlockPaths++];
+			next.origin = hitPoint;
+			next.direction = reflectRough(path.direction, hit.hitNormal, material.roughness, path.seed);
+			next.weight = material.color * indirectScale;
+			next.pixel = path.pixel;
+			next.depth = path.depth + 1;
+			next.seed = path.seed;
+		}
+
+		copy(blockPaths, blockPaths + numBlockPaths, nextPaths + nextCount.fetch_add(numBlockPaths));
+		copy(blockRequests, blockRequests + numBlockRequests, shadowRequests + shadowCount.fetch_add(numBlockRequests));
+	});
+	numNextPaths = nextCount.load();
+	numShadowRequests = shadowCount.load();
+}
+
+// Shadow rays are traced one at a time even with usePackets: they start on the surface and stop
+// at their first hit, so a packet shares too few nodes between its rays to pay for itself.
+void CpuRenderer::traceShadows(Scene& scene, int numShadowRequests)
+{
+	parallelFor(scheduler, numShadowRequests, [&](int i)
+	{
+		const ShadowRequest& request = shadowRequests[i];
+		HitInfo occluder = scene.hitScene(Ray(request.origin, request.direction), request.distance, true);
+		if (!occluder.hasHit)
+			image[request.pixel] += request.radiance;
+	});
+}
+
+// Renders the same frame without and with sorting. The speedup compares the time spent tracing
+// secondary and shadow rays, counting the sort itself against the sorted run.
+void CpuRenderer::measureSortingSpeedup(Scene& scene, const CpuRenderSettings& settings)
+{
+	bool wasSorting = sortRays;
+	sortRays = false;
+	render(scene, settings);
+	double unsortedTime = stats.extend + stats.shadow;
+	sortRays = true;
+	render(scene, settings);
+	double sortedTime = stats.extend + stats.shadow + stats.sort;
+	sortRays = wasSorting;
+	sortingSpeedup = sortedTime > 0.0 ? float(unsortedTime / sortedTime) : 0.0f;
+}
+
+void CpuRenderer::uploadImage()
+{
+	unsigned char* pixels = frameArena.allocateArray<unsigned char>(width * height * 4);
+	for (int i = 0; i < width * height; i++)
+	{
+		vec3 color = clamp(image[i], 0.0f, 1.0f) * 255.0f;
+		pixels[i * 4 + 0] = (unsigned char)(color.r + 0.5f);
+		pixels[i * 4 + 1] = (unsigned char)(color.g + 0.5f);
+		pixels[i * 4 + 2] = (unsigned char)(color.b + 0.5f);
+		pixels[i * 4 + 3] = 255;
+	}
+
+	if (imageTexture == 0)
+		glGenTextures(1, &imageTexture);
+	glBindTexture(GL_TEXTURE_2D, imageTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void CpuRenderer::gui(Scene& scene, CpuRenderSettings settings)
+{
+	Begin("CPU Renderer", nullptr, 0);
+	int modeIndex = int(mode);
+	Combo("Mode", &modeIndex, "Megakernel\0Wavefront\0");
+	mode = CpuRenderMode(modeIndex);
+	SliderInt("Resolution Divisor", &resolutionDivisor, 1, 16);
+	if (mode == CpuRenderMode::Megakernel)
+	{
+		SliderInt("Tile Size", &scheduler.tileSize, 4, 64);
+		Checkbox("Adaptive Sampling", &adaptiveSettings.isEnabled);
+		if (adaptiveSettings.isEnabled)
+		{
+			SliderFloat("Target Error", &adaptiveSettings.targetError, 0.005f, 0.2f, "%.3f");
+			SliderInt("Min Samples", &adaptiveSettings.minSamples, 1, 64);
+			SliderInt("Max Samples", &adaptiveSettings.maxSamples, 1, 4096);
+		}
+	}
+	Checkbox("Pin Threads to NUMA Nodes", &scheduler.pinThreads);
+	Checkbox("Denoise", &denoiseSettings.isEnabled);
+	if (denoiseSettings.isEnabled)
+		SliderInt("Denoise Iterations", &denoiseSettings.numIterations, 1, maxDenoiseIterations);
+	if (ImGui::Button("Render on CPU"))
+	{
+		settings.width = std::max(1, settings.width / resolutionDivisor);
+		settings.height = std::max(1, settings.height / resolutionDivisor);
+		render(scene, settings);
+	}
+	if (mode == CpuRenderMode::Wavefront)
+	{
+		Checkbox("Sort Rays", &sortRays);
+		Checkbox("Ray Packets", &usePackets);
+		if (ImGui::Button("Measure Sorting Speedup"))
+		{
+			settings.width = std::max(1, settings.width / resolutionDivisor);
+			settings.height = std::max(1, settings.height / resolutionDivisor);
+			measureSortingSpeedup(scene, settings);
+		}
+		if (sortingSpeedup > 0.0f)
+			Text("Sorted traversal is %.2fx the speed of unsorted", sortingSpeedup);
+	}
+
+	if (imageTexture != 0)
+	{
+		Text("Total %.1f ms, %.2f Mrays/s", stats.total, (stats.numRays + stats.numShadowRays) / (stats.total * 1000.0));
+		if (mode == CpuRenderMode::Wavefront)
+		{
+			Text("Generate %.1f ms", stats.generate);
+			Text("Extend %.1f ms (%lld rays)", stats.extend, stats.numRays);
+			if (stats.primary > 0.0)
+				Text("Camera rays %.1f ms, %.2f Mrays/s", stats.primary, double(width) * height * lastNumSamples / (stats.primary * 1000.0));
+			else
+				Text("Camera rays %.1f ms", stats.primary);
+			Text("Shade %.1f ms", stats.shade);
+			Text("Shadow %.1f ms (%lld rays)", stats.shadow, stats.numShadowRays);
+			if (sortRays)
+				Text("Sort %.1f ms", stats.sort);
+		}
+		if (denoiseSettings.isEnabled)
+			Text("Denoise %.1f ms", stats.denoise);
+		if (isHeapCounting)
+		{
+			Text("Heap allocations %lld%s", stats.heapAllocations, stats.isSteadyState ? " (should be 0)" : "");
+			Checkbox("Log Steady State Allocations", &logHeapAllocations);
+		}
+		if (mode == CpuRenderMode::Megakernel && adaptiveSettings.isEnabled)
+			Text("Adaptive %d passes, %.1f samples per pixel", stats.numPasses, stats.meanSamples);
+		if (mode == CpuRenderMode::Megakernel)
+		{
+			const TileSchedulerStats& tileStats = scheduler.stats;
+			Text("%d tiles on %d threads, %d stolen", tileStats.numTiles, tileStats.numThreads, tileStats.numSteals);
+			Text("Idle %.1f ms of %.1f ms, %.1f%% utilization", tileStats.idle, tileStats.wall * tileStats.numThreads,
+				100.0 * tileStats.busy / std::max(tileStats.wall * tileStats.numThreads, 1e-6));
+			for (int node = 0; node < tileStats.numNodes; node++)
+				Text("Node %d: %d threads, %.2f Msamples/s, %.1f%% busy", node, tileStats.nodeThreads[node],
+					double(tileStats.nodePixels[node]) * lastNumSamples / (tileStats.wall * 1000.0),
+					100.0 * tileStats.nodeBusy[node] / std::max(tileStats.wall * tileStats.nodeThreads[node], 1e-6));
+		}
+		Image((ImTextureID)(intptr_t)imageTexture, ImVec2(float(width), float(height)), ImVec2(0, 1), ImVec2(1, 0));
+	}
+	End();
+}
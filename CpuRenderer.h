@@ -0,0 +1,178 @@
+#pragma once
+#include "Scene.h"
+#include "TileScheduler.h"
+#include "Denoiser.h"
+#include "AdaptiveSampling.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <memory>
+
+enum class CpuRenderMode
+{
+	Megakernel,
+	Wavefront
+};
+
+struct CpuRenderSettings
+{
+	int width;
+	int height;
+	int numSamples;
+	int numLightBounces;
+	float blurDistance;
+	float blurStrength;
+	bool showHdri;
+};
+
+// Milliseconds spent in each wavefront stage during the last render, summed over all samples
+// and bounces, with primary being the part of extend spent on camera rays. The megakernel mode
+// only fills in total and denoise, and with adaptive sampling the number of passes and the mean
+// number of samples a pixel got. heapAllocations is only counted in debug builds; isSteadyState
+// says the previous frame had the same layout, so it should be zero.
+struct CpuRenderStats
+{
+	double generate;
+	double extend;
+	double primary;
+	double shade;
+	double shadow;
+	double sort;
+	double denoise;
+	double total;
+	int numPasses;
+	double meanSamples;
+	long long numRays;
+	long long numShadowRays;
+	long long heapAllocations;
+	bool isSteadyState;
+};
+
+// One path in the wavefront queues. weight is what a contribution found by this path is scaled
+// by, which follows the estimator of trace() in fragmentshader.glsl.
+struct WavefrontPath
+{
+	vec3 origin;
+	vec3 direction;
+	vec3 weight;
+	int pixel;
+	int depth;
+	uint32_t seed;
+};
+
+struct RayCounts
+{
+	long long rays;
+	long long shadowRays;
+};
+
+struct ShadowRequest
+{
+	vec3 origin;
+	vec3 direction;
+	float distance;
+	vec3 radiance;
+	int pixel;
+};
+
+// Renders the scene on the CPU with the same estimator as the fragment shader. The megakernel mode
+// follows each pixel's paths to the end the way trace() does, with the pixels handed out in tiles
+// by the work stealing scheduler since their cost varies so much across the frame. The wavefront
+// mode instead keeps explicit queues and runs one stage at a time over all of them: camera ray
+// generation, closest hit extension, material shading and shadow ray occlusion. Every stage is a
+// flat loop over its queue, split across threads. With sortRays, secondary and shadow queues are
+// reordered by direction octant and origin before they are traced; paths carry their pixel, so
+// results land in the right place regardless of order. With usePackets, camera rays are generated
+// in small tiles and traced as packets.
+//
+// The megakernel can also sample adaptively, spending samples only on pixels whose mean is still
+// uncertain and stopping once they all meet the target; see AdaptiveSamplingSettings.
+//
+// With denoising enabled both modes also keep the luminance moments of every pixel's samples, and
+// once the frame is done a ray through each pixel centre records the features the à-trous filter
+// in Denoiser.h is guided by.
+class CpuRenderer
+{
+public:
+	CpuRenderMode mode = CpuRenderMode::Wavefront;
+	int resolutionDivisor = 4;
+	bool sortRays = false;
+	bool usePackets = false;
+	float sortingSpeedup = 0.0f;
+	// Debug builds print every steady state frame that touched the heap.
+	bool logHeapAllocations = false;
+	CpuRenderStats stats = {};
+	TileScheduler scheduler;
+	DenoiseSettings denoiseSettings;
+	AdaptiveSamplingSettings adaptiveSettings;
+
+	bool loadHdri(const std::string& path);
+	void render(Scene& scene, const CpuRenderSettings& settings);
+	void measureSortingSpeedup(Scene& scene, const CpuRenderSettings& settings);
+	void gui(Scene& scene, CpuRenderSettings settings);
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> hdriPixels;
+	int hdriWidth = 0;
+	int hdriHeight = 0;
+	bool showHdri = true;
+	int lastNumSamples = 0;
+	GLuint imageTexture = 0;
+
+	// Per pixel state, reallocated only when the frame size changes and first touched by the
+	// worker that owns each tile, so with pinned threads it is spread over the NUMA nodes.
+	std::unique_ptr<vec3[]> image;
+	std::unique_ptr<vec3[]> lensOrigins;
+	std::unique_ptr<uint32_t[]> pixelSeeds;
+	std::unique_ptr<int[]> sampleCounts;
+	std::unique_ptr<vec2[]> moments;
+	std::unique_ptr<vec2[]> displayMoments;
+	std::unique_ptr<PixelFeatures[]> features;
+	int numAllocatedPixels = 0;
+
+	struct RenderLayout
+	{
+		int width;
+		int height;
+		CpuRenderMode mode;
+		bool sortRays;
+		bool usePackets;
+		bool pinThreads;
+		bool denoise;
+		bool adaptive;
+	};
+	RenderLayout lastLayout = {};
+
+	// The queues live in frameArena and are only valid during a render.
+	Arena frameArena;
+	int* pixelOrder = nullptr;
+	WavefrontPath* paths = nullptr;
+	WavefrontPath* nextPaths = nullptr;
+	HitInfo* hits = nullptr;
+	ShadowRequest* shadowRequests = nullptr;
+	WavefrontPath* sortedPaths = nullptr;
+	ShadowRequest* sortedShadowRequests = nullptr;
+	uint64_t* sortKeys = nullptr;
+	uint64_t* sortKeyScratch = nullptr;
+	float* sampleLuminance = nullptr;
+
+	vec3 sampleHdri(vec3 direction) const;
+	vec3 cameraDirection(Scene& scene, int pixel) const;
+	void preparePixels(Scene& scene);
+	void replicateMeshes(Scene& scene);
+	void renderMegakernel(Scene& scene, const CpuRenderSettings& settings);
+	void samplePixel(Scene& scene, const CpuRenderSettings& settings, int pixel, int numSamples, RayCounts& counts);
+	int additionalSamples(const Tile& tile, int maxSamples) const;
+	vec3 trace(Scene& scene, Ray ray, int maxBounces, uint32_t& seed, RayCounts& counts);
+	vec3 directLight(Scene& scene, vec3 normal, vec3 hitPoint, const Material& material, uint32_t& seed, RayCounts& counts);
+	void renderWavefront(Scene& scene, const CpuRenderSettings& settings);
+	void buildPixelOrder();
+	int generate(int sample, const CpuRenderSettings& settings, Scene& scene);
+	void extend(Scene& scene, int numPaths, bool isPrimary);
+	void shade(Scene& scene, int numPaths, int maxBounces, int& numNextPaths, int& numShadowRequests);
+	void traceShadows(Scene& scene, int numShadowRequests);
+	void accumulateMoments();
+	void writeFeatures(Scene& scene);
+	void uploadImage();
+};
@@ -0,0 +1,546 @@
+#include "Denoiser.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+static const float kernelWeights[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+static const float varianceBlurWeights[2] = { 1.0f / 2.0f, 1.0f / 4.0f };
+const int varianceRadius = 2;
+const int rowsPerBlock = 4;
+const int normalSharpnessSquarings = 7;
+const float depthEpsilon = 1e-3f;
+const float luminanceEpsilon = 1e-4f;
+
+// The stage uniform of denoiseshader.glsl.
+enum DenoiseStage
+{
+	estimateVarianceStage,
+	filterStage,
+	finalFilterStage,
+	reprojectStage,
+	presentStage
+};
+
+// Structure of arrays copy of the frame, surrounded by a border of misses as wide as the furthest
+// tap so that no tap needs an edge test. Rows are padded to a multiple of four floats. The colour
+// planes hold red, green, blue and variance, one set being read while the other is written.
+struct DenoisePlanes
+{
+	int padding;
+	int stride;
+	float* color[2][4];
+	float* albedo[3];
+	float* normal[3];
+	float* depth;
+	float* depthSlope[2];
+
+	int index(int x, int y) const
+	{
+		return (y + padding) * stride + x + padding;
+	}
+};
+
+static float normalWeight(float cosine)
+{
+	float weight = std::max(cosine, 0.0f);
+	for (int i = 0; i < normalSharpnessSquarings; i++)
+		weight *= weight;
+	return weight;
+}
+
+// Depth change per pixel along one axis, taken from whichever neighbour changes less so that a
+// silhouette on one side does not make the whole surface look steep. Misses have no depth.
+static float depthSlope(float depth, float previous, float next)
+{
+	float backward = previous > 0.0f ? depth - previous : FLT_MAX;
+	float forward = next > 0.0f ? next - depth : FLT_MAX;
+	float slope = abs(backward) < abs(forward) ? backward : forward;
+	return slope == FLT_MAX ? 0.0f : slope;
+}
+
+// The normal, depth and albedo part of a tap's weight, offset being its distance in pixels.
+static float featureWeight(const PixelFeatures& center, vec2 slope, const PixelFeatures& tap, vec2 offset, const DenoiseSettings& settings)
+{
+	float depthTerm = abs(center.depth - tap.depth) / (settings.depthPhi * abs(dot(slope, offset)) + depthEpsilon);
+	vec3 albedoDifference = center.albedo - tap.albedo;
+	float albedoTerm = dot(albedoDifference, albedoDifference) / settings.albedoPhi;
+	return normalWeight(dot(center.normal, tap.normal)) * exp(-(depthTerm + albedoTerm));
+}
+
+// The variance of the pixel's mean from the moments of its own samples or, with too few of them
+// to go on, of the samples of edge-weighted neighbours within varianceRadius.
+static float estimateVariance(const DenoiseSettings& settings, int width, int height, const int* sampleCounts,
+	const vec2* moments, const PixelFeatures* features, int x, int y, vec2 slope)
+{
+	int pixel = y * width + x;
+	int numSamples = std::max(sampleCounts[pixel], 1);
+	vec2 mean = moments[pixel] / float(numSamples);
+	const PixelFeatures& center = features[pixel];
+	if (numSamples < minSamplesForPixelVariance && center.depth > 0.0f)
+	{
+		float sumWeight = 1.0f;
+		for (int tapY = std::max(y - varianceRadius, 0); tapY <= std::min(y + varianceRadius, height - 1); tapY++)
+			for (int tapX = std::max(x - varianceRadius, 0); tapX <= std::min(x + varianceRadius, width - 1); tapX++)
+			{
+				int tap = tapY * width + tapX;
+				if (tap == pixel)
+					continue;
+				float weight = featureWeight(center, slope, features[tap], vec2(tapX - x, tapY - y), settings);
+				mean += weight * moments[tap] / float(std::max(sampleCounts[tap], 1));
+				sumWeight += weight;
+			}
+		mean /= sumWeight;
+	}
+	return std::max(mean.y - mean.x * mean.x, 0.0f) / numSamples;
+}
+
+static void fillPlanes(TileScheduler& scheduler, const DenoisePlanes& planes, const DenoiseSettings& settings, int width, int height,
+	const int* sampleCounts, const vec3* image, const vec2* moments, const PixelFeatures* features)
+{
+	scheduler.parallelForBlocks(height, rowsPerBlock, [&](int first, int last, Arena&)
+	{
+		for (int y = first; y < last; y++)
+			for (int x = 0; x < width; x++)
+			{
+				int pixel = y * width + x;
+				int index = planes.index(x, y);
+				const PixelFeatures& feature = features[pixel];
+				float left = x > 0 ? features[pixel - 1].depth : 0.0f;
+				float right = x < width - 1 ? features[pixel + 1].depth : 0.0f;
+				float below = y > 0 ? features[pixel - width].depth : 0.0f;
+				float above = y < height - 1 ? features[pixel + width].depth : 0.0f;
+				vec2 slope = vec2(depthSlope(feature.depth, left, right), depthSlope(feature.depth, below, above));
+
+				for (int channel = 0; channel < 3; channel++)
+				{
+					planes.color[0][channel][index] = image[pixel][channel];
+					planes.albedo[channel][index] = feature.albedo[channel];
+					planes.normal[channel][index] = feature.normal[channel];
+				}
+				planes.color[0][3][index] = estimateVariance(settings, width, height, sampleCounts, moments, features, x, y, slope);
+				planes.depth[index] = feature.depth;
+				planes.depthSlope[0][index] = slope.x;
+				planes.depthSlope[1][index] = slope.y;
+			}
+	});
+}
+
+// One à-trous tap pattern at index. The centre's own weight is the kernel's alone; every other
+// tap is scaled by how well it matches the centre.
+static void filterPixel(const DenoisePlanes& planes, int source, int index, int stepSize, const DenoiseSettings& settings)
+{
+	float* const* input = planes.color[source];
+	float* const* output = planes.color[1 - source];
+	vec3 color = vec3(input[0][index], input[1][index], input[2][index]);
+	float variance = input[3][index];
+	vec3 albedo = vec3(planes.albedo[0][index], planes.albedo[1][index], planes.albedo[2][index]);
+	vec3 normal = vec3(planes.normal[0][index], planes.normal[1][index], planes.normal[2][index]);
+	float depth = planes.depth[index];
+	vec2 slope = vec2(planes.depthSlope[0][index], planes.depthSlope[1][index]) * float(stepSize);
+
+	float blurredVariance = 0.0f;
+	for (int y = -1; y <= 1; y++)
+		for (int x = -1; x <= 1; x++)
+			blurredVariance += varianceBlurWeights[abs(x)] * varianceBlurWeights[abs(y)] * input[3][index + y * planes.stride + x];
+	float luminanceScale = 1.0f / (settings.colorPhi * sqrt(blurredVariance) + luminanceEpsilon);
+	float centerLuminance = luminance(color);
+
+	float sumWeight = kernelWeights[0] * kernelWeights[0];
+	vec3 sumColor = color * sumWeight;
+	float sumVariance = variance * sumWeight * sumWeight;
+	for (int y = -2; y <= 2; y++)
+		for (int x = -2; x <= 2; x++)
+		{
+			if (x == 0 && y == 0)
+				continue;
+			int tap = index + (y * planes.stride + x) * stepSize;
+			vec3 tapColor = vec3(input[0][tap], input[1][tap], input[2][tap]);
+			vec3 tapNormal = vec3(planes.normal[0][tap], planes.normal[1][tap], planes.normal[2][tap]);
+			vec3 albedoDifference = albedo - vec3(planes.albedo[0][tap], planes.albedo[1][tap], planes.albedo[2][tap]);
+
+			float depthTerm = abs(depth - planes.depth[tap]) / (settings.depthPhi * abs(slope.x * x + slope.y * y) + depthEpsilon);
+			float luminanceTerm = abs(centerLuminance - luminance(tapColor)) * luminanceScale;
+			float albedoTerm = dot(albedoDifference, albedoDifference) / settings.albedoPhi;
+			float weight = kernelWeights[abs(x)] * kernelWeights[abs(y)] * normalWeight(dot(normal, tapNormal)) * exp(-(depthTerm + luminanceTerm + albedoTerm));
+
+			sumWeight += weight;
+			sumColor += tapColor * weight;
+			sumVariance += input[3][tap] * weight * weight;
+		}
+
+	for (int channel = 0; channel < 3; channel++)
+		output[channel][index] = sumColor[channel] / sumWeight;
+	output[3][index] = sumVariance / (sumWeight * sumWeight);
+}
+
+#ifdef DENOISER_SSE
+static __m128 absolute(__m128 value)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), value);
+}
+
+// exp(x) for x <= 0 with a relative error around 1e-6, which is plenty for filter weights:
+// 2^(x log2 e) split into a whole power written into the exponent bits and a polynomial for the
+// fraction. Very negative arguments are clamped to a tiny, but normal, result.
+static __m128 expNegative(__m128 x)
+{
+	__m128 power = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+	__m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(power));
+	whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, power), _mm_set1_ps(1.0f)));
+	__m128 fraction = _mm_sub_ps(power, whole);
+
+	__m128 result = _mm_set1_ps(1.8775767e-3f);
+	result = _mm_add_ps(_mm_mul_ps(result, fraction), _mm_set1_ps(8.9893397e-3f));
+	result = _mm_add_ps(_mm_mul_ps(result, fraction), _mm_set1_ps(5.5826318e-2f));
+	result = _mm_add_ps(_mm_mul_ps(result, fraction), _mm_set1_ps(2.4015361e-1f));
+	result = _mm_add_ps(_mm_mul_ps(result, fraction), _mm_set1_ps(6.9315308e-1f));
+	result = _mm_add_ps(_mm_mul_ps(result, fraction), _mm_set1_ps(9.9999994e-1f));
+	__m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(result, _mm_castsi128_ps(exponent));
+}
+
+static __m128 luminance(__m128 red, __m128 green, __m128 blue)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(red, _mm_set1_ps(0.2126f)), _mm_mul_ps(green, _mm_set1_ps(0.7152f))), _mm_mul_ps(blue, _mm_set1_ps(0.0722f)));
+}
+
+static __m128 load(const float* plane, int index)
+{
+	return _mm_loadu_ps(plane + index);
+}
+
+// filterPixel for the four pixels starting at index.
+static void filterFourPixels(const DenoisePlanes& planes, int source, int index, int stepSize, const DenoiseSettings& settings)
+{
+	float* const* input = planes.color[source];
+	float* const* output = planes.color[1 - source];
+	__m128 red = load(input[0], index);
+	__m128 green = load(input[1], index);
+	__m128 blue = load(input[2], index);
+	__m128 albedoRed = load(planes.albedo[0], index);
+	__m128 albedoGreen = load(planes.albedo[1], index);
+	__m128 albedoBlue = load(planes.albedo[2], index);
+	__m128 normalX = load(planes.normal[0], index);
+	__m128 normalY = load(planes.normal[1], index);
+	__m128 normalZ = load(planes.normal[2], index);
+	__m128 depth = load(planes.depth, index);
+	__m128 slopeX = _mm_mul_ps(load(planes.depthSlope[0], index), _mm_set1_ps(float(stepSize)));
+	__m128 slopeY = _mm_mul_ps(load(planes.depthSlope[1], index), _mm_set1_ps(float(stepSize)));
+
+	__m128 blurredVariance = _mm_setzero_ps();
+	for (int y = -1; y <= 1; y++)
+		for (int x = -1; x <= 1; x++)
+		{
+			__m128 weight = _mm_set1_ps(varianceBlurWeights[abs(x)] * varianceBlurWeights[abs(y)]);
+			blurredVariance = _mm_add_ps(blurredVariance, _mm_mul_ps(weight, load(input[3], index + y * planes.stride + x)));
+		}
+	__m128 luminanceScale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(settings.colorPhi), _mm_sqrt_ps(blurredVariance)), _mm_set1_ps(luminanceEpsilon)));
+	__m128 centerLuminance = luminance(red, green, blue);
+	__m128 inverseAlbedoPhi = _mm_set1_ps(1.0f / settings.albedoPhi);
+	__m128 depthPhi = _mm_set1_ps(settings.depthPhi);
+
+	__m128 sumWeight = _mm_set1_ps(kernelWeights[0] * kernelWeights[0]);
+	__m128 sumRed = _mm_mul_ps(red, sumWeight);
+	__m128 sumGreen = _mm_mul_ps(green, sumWeight);
+	__m128 sumBlue = _mm_mul_ps(blue, sumWeight);
+	__m128 sumVariance = _mm_mul_ps(load(input[3], index), _mm_mul_ps(sumWeight, sumWeight));
+	for (int y = -2; y <= 2; y++)
+		for (int x = -2; x <= 2; x++)
+		{
+			if (x == 0 && y == 0)
+				continue;
+			int tap = index + (y * planes.stride + x) * stepSize;
+			__m128 tapRed = load(input[0], tap);
+			__m128 tapGreen = load(input[1], tap);
+			__m128 tapBlue = load(input[2], tap);
+
+			__m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(normalX, load(planes.normal[0], tap)), _mm_mul_ps(normalY, load(planes.normal[1], tap))),
+				_mm_mul_ps(normalZ, load(planes.normal[2], tap)));
+			__m128 normalWeight = _mm_max_ps(cosine, _mm_setzero_ps());
+			for (int i = 0; i < normalSharpnessSquarings; i++)
+				normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+
+			__m128 expectedDepthChange = absolute(_mm_add_ps(_mm_mul_ps(slopeX, _mm_set1_ps(float(x))), _mm_mul_ps(slopeY, _mm_set1_ps(float(y)))));
+			__m128 depthTerm = _mm_div_ps(absolute(_mm_sub_ps(depth, load(planes.depth, tap))), _mm_add_ps(_mm_mul_ps(depthPhi, expectedDepthChange), _mm_set1_ps(depthEpsilon)));
+			__m128 luminanceTerm = _mm_mul_ps(absolute(_mm_sub_ps(centerLuminance, luminance(tapRed, tapGreen, tapBlue))), luminanceScale);
+			__m128 albedoRedDifference = _mm_sub_ps(albedoRed, load(planes.albedo[0], tap));
+			__m128 albedoGreenDifference = _mm_sub_ps(albedoGreen, load(planes.albedo[1], tap));
+			__m128 albedoBlueDifference = _mm_sub_ps(albedoBlue, load(planes.albedo[2], tap));
+			__m128 albedoTerm = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(albedoRedDifference, albedoRedDifference), _mm_mul_ps(albedoGreenDifference, albedoGreenDifference)),
+				_mm_mul_ps(albedoBlueDifference, albedoBlueDifference)), inverseAlbedoPhi);
+
+			__m128 weight = _mm_mul_ps(_mm_set1_ps(kernelWeights[abs(x)] * kernelWeights[abs(y)]), normalWeight);
+			weight = _mm_mul_ps(weight, expNegative(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(_mm_add_ps(depthTerm, luminanceTerm), albedoTerm))));
+
+			sumWeight = _mm_add_ps(sumWeight, weight);
+			sumRed = _mm_add_ps(sumRed, _mm_mul_ps(tapRed, weight));
+			sumGreen = _mm_add_ps(sumGreen, _mm_mul_ps(tapGreen, weight));
+			sumBlue = _mm_add_ps(sumBlue, _mm_mul_ps(tapBlue, weight));
+			sumVariance = _mm_add_ps(sumVariance, _mm_mul_ps(load(input[3], tap), _mm_mul_ps(weight, weight)));
+		}
+
+	__m128 inverseWeight = _mm_div_ps(_mm_set1_ps(1.0f), sumWeight);
+	_mm_storeu_ps(output[0] + index, _mm_mul_ps(sumRed, inverseWeight));
+	_mm_storeu_ps(output[1] + index, _mm_mul_ps(sumGreen, inverseWeight));
+	_mm_storeu_ps(output[2] + index, _mm_mul_ps(sumBlue, inverseWeight));
+	_mm_storeu_ps(output[3] + index, _mm_mul_ps(sumVariance, _mm_mul_ps(inverseWeight, inverseWeight)));
+}
+#endif
+
+void denoiseImage(TileScheduler& scheduler, Arena& arena, const DenoiseSettings& settings, int width, int height,
+	const int* sampleCounts, vec3* image, const vec2* moments, const PixelFeatures* features)
+{
+	int numIterations = clamp(settings.numIterations, 1, maxDenoiseIterations);
+
+	DenoisePlanes planes;
+	planes.padding = 2 << (numIterations - 1);
+	planes.stride = (width + 2 * planes.padding + 3) / 4 * 4;
+	size_t planeSize = size_t(planes.stride) * (height + 2 * planes.padding);
+	auto allocatePlane = [&]()
+	{
+		float* plane = static_cast<float*>(arena.allocate(planeSize * sizeof(float), 16));
+		fill(plane, plane + planeSize, 0.0f);
+		return plane;
+	};
+	for (int set = 0; set < 2; set++)
+		for (int channel = 0; channel < 4; channel++)
+			planes.color[set][channel] = allocatePlane();
+	for (int channel = 0; channel < 3; channel++)
+	{
+		planes.albedo[channel] = allocatePlane();
+		planes.normal[channel] = allocatePlane();
+	}
+	planes.depth = allocatePlane();
+	planes.depthSlope[0] = allocatePlane();
+	planes.depthSlope[1] = allocatePlane();
+
+	fillPlanes(scheduler, planes, settings, width, height, sampleCounts, image, moments, features);
+
+	int source = 0;
+	for (int iteration = 0; iteration < numIterations; iteration++)
+	{
+		int stepSize = 1 << iteration;
+		scheduler.parallelForBlocks(height, rowsPerBlock, [&](int first, int last, Arena&)
+		{
+			for (int y = first; y < last; y++)
+			{
+				int x = 0;
+#ifdef DENOISER_SSE
+				for (; x + 4 <= width; x += 4)
+					filterFourPixels(planes, source, planes.index(x, y), stepSize, settings);
+#endif
+				for (; x < width; x++)
+					filterPixel(planes, source, planes.index(x, y), stepSize, settings);
+			}
+		});
+		source = 1 - source;
+	}
+
+	scheduler.parallelForBlocks(height, rowsPerBlock, [&](int first, int last, Arena&)
+	{
+		for (int y = first; y < last; y++)
+			for (int x = 0; x < width; x++)
+			{
+				int index = planes.index(x, y);
+				image[y * width + x] = vec3(planes.color[source][0][index], planes.color[source][1][index], planes.color[source][2][index]);
+			}
+	});
+}
+
+static GLuint createTarget(GLenum internalFormat, GLenum format, int width, int height)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+static void checkFramebuffer(const char* name)
+{
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "Denoiser " << name << " framebuffer is incomplete" << endl;
+}
+
+static void setUniform(GLuint program, const char* name, vec3 value)
+{
+	glUniform3f(glGetUniformLocation(program, name), value.x, value.y, value.z);
+}
+
+bool GpuDenoiser::isActive() const
+{
+	return settings.isEnabled || temporalSettings.isEnabled;
+}
+
+void GpuDenoiser::create(GLuint program)
+{
+	this->program = program;
+	glGenFramebuffers(1, &sceneFramebuffer);
+	glGenFramebuffers(2, filterFramebuffers);
+	glGenFramebuffers(2, historyFramebuffers);
+}
+
+void GpuDenoiser::resize(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	hasHistory = false;
+	GLuint textures[] = { radianceTexture, albedoTexture, normalDepthTextures[0], normalDepthTextures[1], momentsTexture, filterTextures[0], filterTextures[1],
+		historyColorTextures[0], historyColorTextures[1], historyMomentsTextures[0], historyMomentsTextures[1] };
+	glDeleteTextures(11, textures);
+
+	radianceTexture = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+	albedoTexture = createTarget(GL_RGBA16F, GL_RGBA, width, height);
+	normalDepthTextures[0] = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+	normalDepthTextures[1] = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+	momentsTexture = createTarget(GL_RG32F, GL_RG, width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, radianceTexture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, albedoTexture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, normalDepthTextures[current], 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, momentsTexture, 0);
+	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3 };
+	glDrawBuffers(4, drawBuffers);
+	checkFramebuffer("scene");
+
+	for (int i = 0; i < 2; i++)
+	{
+		filterTextures[i] = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, filterFramebuffers[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, filterTextures[i], 0);
+		checkFramebuffer("filter");
+
+		historyColorTextures[i] = createTarget(GL_RGBA32F, GL_RGBA, width, height);
+		historyMomentsTextures[i] = createTarget(GL_RG32F, GL_RG, width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, historyFramebuffers[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, historyColorTextures[i], 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, historyMomentsTextures[i], 0);
+		glDrawBuffers(2, drawBuffers);
+		checkFramebuffer("history");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void GpuDenoiser::begin(int width, int height)
+{
+	if (width != this->width || height != this->height)
+		resize(width, height);
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, normalDepthTextures[current], 0);
+}
+
+// The colour input is on texture unit 5 and the features on 6 to 8, clear of the units the
+// scene binds its textures to. Reprojection reads the previous frame from units 9 to 11.
+void GpuDenoiser::apply(GLuint vertexArray, int numSamples, Camera& camera, GLuint outputFramebuffer)
+{
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "numSamples"), std::max(numSamples, 1));
+	glUniform1f(glGetUniformLocation(program, "colorPhi"), settings.colorPhi);
+	glUniform1f(glGetUniformLocation(program, "depthPhi"), settings.depthPhi);
+	glUniform1f(glGetUniformLocation(program, "albedoPhi"), settings.albedoPhi);
+	glUniform1i(glGetUniformLocation(program, "isAccumulated"), temporalSettings.isEnabled);
+	glUniform1f(glGetUniformLocation(program, "historyBlend"), temporalSettings.historyBlend);
+	glUniform1i(glGetUniformLocation(program, "colorTexture"), 5);
+	glUniform1i(glGetUniformLocation(program, "albedoTexture"), 6);
+	glUniform1i(glGetUniformLocation(program, "normalDepthTexture"), 7);
+	glUniform1i(glGetUniformLocation(program, "momentsTexture"), 8);
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, albedoTexture);
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_2D, normalDepthTextures[current]);
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_2D, momentsTexture);
+
+	GLuint color = radianceTexture;
+	if (temporalSettings.isEnabled)
+	{
+		reproject(vertexArray, camera);
+		color = historyColorTextures[current];
+		glActiveTexture(GL_TEXTURE8);
+		glBindTexture(GL_TEXTURE_2D, historyMomentsTextures[current]);
+	}
+	else
+		hasHistory = false;
+
+	if (settings.isEnabled)
+	{
+		drawPass(vertexArray, filterFramebuffers[0], color, estimateVarianceStage, 1);
+		int numIterations = clamp(settings.numIterations, 1, maxDenoiseIterations);
+		int source = 0;
+		for (int iteration = 0; iteration < numIterations; iteration++)
+		{
+			bool isLast = iteration == numIterations - 1;
+			drawPass(vertexArray, isLast ? outputFramebuffer : filterFramebuffers[1 - source], filterTextures[source], isLast ? finalFilterStage : filterStage, 1 << iteration);
+			source = 1 - source;
+		}
+	}
+	else
+		drawPass(vertexArray, outputFramebuffer, color, presentStage, 1);
+	glActiveTexture(GL_TEXTURE0);
+	current = 1 - current;
+}
+
+// Draws this frame's radiance and moments, blended with whatever of the last frame's history
+// survives reprojection, into the current history targets, then remembers the camera it was
+// seen from.
+void GpuDenoiser::reproject(GLuint vertexArray, Camera& camera)
+{
+	int previous = 1 - current;
+	glUniform1i(glGetUniformLocation(program, "hasHistory"), hasHistory);
+	glUniform1f(glGetUniformLocation(program, "depthTolerance"), temporalSettings.depthTolerance);
+	glUniform1f(glGetUniformLocation(program, "normalTolerance"), temporalSettings.normalTolerance);
+	setUniform(program, "cameraOrigin", camera.getOrigin());
+	setUniform(program, "cameraForward", camera.getForward());
+	setUniform(program, "cameraRight", camera.getRight());
+	setUniform(program, "cameraUp", camera.getUp());
+	setUniform(program, "previousOrigin", previousOrigin);
+	setUniform(program, "previousForward", previousForward);
+	setUniform(program, "previousRight", previousRight);
+	setUniform(program, "previousUp", previousUp);
+	glUniform1i(glGetUniformLocation(program, "historyColorTexture"), 9);
+	glUniform1i(glGetUniformLocation(program, "historyMomentsTexture"), 10);
+	glUniform1i(glGetUniformLocation(program, "historyNormalDepthTexture"), 11);
+	glActiveTexture(GL_TEXTURE9);
+	glBindTexture(GL_TEXTURE_2D, historyColorTextures[previous]);
+	glActiveTexture(GL_TEXTURE10);
+	glBindTexture(GL_TEXTURE_2D, historyMomentsTextures[previous]);
+	glActiveTexture(GL_TEXTURE11);
+	glBindTexture(GL_TEXTURE_2D, normalDepthTextures[previous]);
+
+	drawPass(vertexArray, historyFramebuffers[current], radianceTexture, reprojectStage, 1);
+
+	hasHistory = true;
+	previousOrigin = camera.getOrigin();
+	previousForward = camera.getForward();
+	previousRight = camera.getRight();
+	previousUp = camera.getUp();
+}
+void GpuDenoiser::drawPass(GLuint vertexArray, GLuint framebuffer, GLuint input, int stage, int stepSize)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, input);
+	glUniform1i(glGetUniformLocation(program, "stage"), stage);
+	glUniform1i(glGetUniformLocation(program, "stepSize"), stepSize);
+	glBindVertexArray(vertexArray);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+void GpuDenoiser::destroy()
+{
+	GLuint textures[] = { radianceTexture, albedoTexture, normalDepthTextures[0], normalDepthTextures[1], momentsTexture, filterTextures[0], filterTextures[1],
+		historyColorTextures[0], historyColorTextures[1], historyMomentsTextures[0], historyMomentsTextures[1] };
+	glDeleteTextures(11, textures);
+	glDeleteFramebuffers(1, &sceneFramebuffer);
+	glDeleteFramebuffers(2, filterFramebuffers);
+	glDeleteFramebuffers(2, historyFramebuffers);
+	glDeleteProgram(program);
+}
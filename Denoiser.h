@@ -0,0 +1,120 @@
+#pragma once
+#include "TileScheduler.h"
+#include "Camera.h"
+#include <glm.hpp>
+#include <glad/glad.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DENOISER_SSE
+#include <immintrin.h>
+#endif
+
+using namespace glm;
+
+const int maxDenoiseIterations = 5;
+// Below this many samples a pixel's own moments say little about its variance, so it is pooled
+// from the neighbourhood instead.
+const int minSamplesForPixelVariance = 4;
+
+// The first surface seen through a pixel's centre. A miss has zero albedo, normal and depth,
+// which keeps it out of every neighbour's filter and its neighbours out of its own.
+struct PixelFeatures
+{
+	vec3 albedo;
+	vec3 normal;
+	float depth;
+};
+
+// colorPhi scales how far luminance may differ, in standard deviations of the noise, before a
+// neighbour stops counting; depthPhi does the same for depth relative to the local depth slope
+// and albedoPhi for the squared albedo difference. Normals are compared with dot(n, m)^128.
+struct DenoiseSettings
+{
+	bool isEnabled = false;
+	int numIterations = maxDenoiseIterations;
+	float colorPhi = 4.0f;
+	float depthPhi = 1.0f;
+	float albedoPhi = 0.05f;
+};
+
+// The history is blended with the current frame by an exponential moving average that starts as a
+// plain mean and never weights the new frame less than historyBlend. Its steady state averages
+// about (2 - historyBlend) / historyBlend frames, so 0.2 makes each frame count for nine. A history
+// texel is only reused if its depth is within depthTolerance of the expected distance, relative to
+// it, and its normal within acos(normalTolerance) of the current one.
+struct TemporalSettings
+{
+	bool isEnabled = false;
+	float historyBlend = 0.2f;
+	float depthTolerance = 0.05f;
+	float normalTolerance = 0.9f;
+};
+
+inline float luminance(vec3 color)
+{
+	return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Edge-avoiding à-trous wavelet filter guided by variance. The variance of each pixel's mean comes
+// from the luminance moments of its samples, pooled over edge-weighted neighbours when there are
+// fewer than minSamplesForPixelVariance. Each iteration then blends a 5x5 B3 spline footprint
+// whose taps are spread 1, 2, 4... pixels apart, weighting every tap by how well its normal,
+// depth, albedo and luminance match the centre. Luminance is allowed to differ by a multiple of
+// the centre's standard deviation, so noisy pixels are smoothed harder, and the variance is
+// filtered along with the colour so each iteration trusts the last one's result more.
+//
+// moments holds each pixel's sum of luminance and of squared luminance over the number of samples
+// in sampleCounts, which may differ from pixel to pixel. The image is filtered in place. Scratch
+// planes are taken from arena and the rows are split between the scheduler's workers; with SSE
+// four pixels of a row are filtered at once.
+void denoiseImage(TileScheduler& scheduler, Arena& arena, const DenoiseSettings& settings, int width, int height,
+	const int* sampleCounts, vec3* image, const vec2* moments, const PixelFeatures* features);
+
+// The same filter on the GPU. begin() binds a framebuffer whose four targets the path tracing
+// pass fills with radiance, albedo, normal and depth, and luminance moments, and apply() runs the
+// variance estimate and the à-trous iterations with the program built from denoiseshader.glsl,
+// the last iteration drawing straight into outputFramebuffer.
+//
+// With temporal accumulation apply() first reprojects last frame's accumulated colour and moments
+// into this one. Each pixel's surface is found from its depth, projected with the previous
+// camera basis, and the four history texels around it are blended bilinearly, skipping any whose
+// depth or normal shows it saw a different surface. What is left is averaged with the new frame
+// and becomes the next history, which the spatial filter, or a plain copy when it is off, then
+// draws to the output. The normal and depth target alternates between two textures so the
+// previous frame's is still there to compare against.
+class GpuDenoiser
+{
+public:
+	DenoiseSettings settings;
+	TemporalSettings temporalSettings;
+
+	bool isActive() const;
+	void create(GLuint program);
+	void begin(int width, int height);
+	void apply(GLuint vertexArray, int numSamples, Camera& camera, GLuint outputFramebuffer);
+	void destroy();
+private:
+	GLuint program = 0;
+	GLuint sceneFramebuffer = 0;
+	GLuint radianceTexture = 0;
+	GLuint albedoTexture = 0;
+	GLuint normalDepthTextures[2] = {};
+	GLuint momentsTexture = 0;
+	GLuint filterFramebuffers[2] = {};
+	GLuint filterTextures[2] = {};
+	GLuint historyFramebuffers[2] = {};
+	GLuint historyColorTextures[2] = {};
+	GLuint historyMomentsTextures[2] = {};
+	int width = 0;
+	int height = 0;
+	int current = 0;
+	bool hasHistory = false;
+	vec3 previousOrigin;
+	vec3 previousForward;
+	vec3 previousRight;
+	vec3 previousUp;
+
+	void resize(int width, int height);
+	void reproject(GLuint vertexArray, Camera& camera);
+	void drawPass(GLuint vertexArray, GLuint framebuffer, GLuint input, int stage, int stepSize);
+};
@@ -0,0 +1,77 @@
+#include "DynamicBVH.h"
+
+void DynamicBVH::build(const std::vector<AABB>& bounds)
+{
+	bvh.build(bounds);
+	wide.build(bvh);
+	surfaceCost = bvh.surfaceCost();
+	builtCost = currentCost = bvh.sahCost(surfaceCost);
+}
+
+// The cost is carried along by the refit rather than measured over the whole tree again.
+void DynamicBVH::update(int primitive, const AABB& bounds)
+{
+	surfaceCost += bvh.refit(primitive, bounds);
+	wide.refit(bvh, primitive);
+	currentCost = bvh.sahCost(surfaceCost);
+	scheduleRebuildIfDegraded();
+}
+
+// The wide tree is collapsed again from the binary one, which is linear in its size but needs no
+// SAH build.
+void DynamicBVH::insert(const AABB& bounds)
+{
+	surfaceCost += bvh.insert(bounds);
+	wide.build(bvh);
+	currentCost = bvh.sahCost(surfaceCost);
+	scheduleRebuildIfDegraded();
+}
+
+void DynamicBVH::scheduleRebuildIfDegraded()
+{
+	if (isRebuilding() || currentCost <= builtCost * rebuildThreshold)
+		return;
+
+	std::vector<AABB> snapshot = bvh.primitiveBounds;
+	pendingRebuild = std::async(std::launch::async, [snapshot]()
+	{
+		BVH rebuilt;
+		rebuilt.build(snapshot);
+		return rebuilt;
+	});
+}
+
+bool DynamicBVH::poll()
+{
+	if (!isRebuilding() || pendingRebuild.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return false;
+
+	// A primitive was inserted while the rebuild ran, so it is out of date as a whole.
+	BVH rebuilt = pendingRebuild.get();
+	if (rebuilt.primitiveBounds.size() != bvh.primitiveBounds.size())
+	{
+		scheduleRebuildIfDegraded();
+		return false;
+	}
+
+	// Primitives may have kept moving while the rebuild ran, in which case the refitted tree
+	// is measured against its own fresh cost and can schedule the next rebuild straight away.
+	builtCost = rebuilt.sahCost();
+	rebuilt.refitAll(bvh.primitiveBounds);
+	bvh = std::move(rebuilt);
+	wide.build(bvh);
+	surfaceCost = bvh.surfaceCost();
+	currentCost = bvh.sahCost(surfaceCost);
+	scheduleRebuildIfDegraded();
+	return true;
+}
+
+bool DynamicBVH::isRebuilding() const
+{
+	return pendingRebuild.valid();
+}
+
+float DynamicBVH::costRatio() const
+{
+	return builtCost > 0.0f ? currentCost / builtCost : 1.0f;
+}
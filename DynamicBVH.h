@@ -0,0 +1,29 @@
+#pragma once
+#include "BVH.h"
+#include "WideBVH.h"
+#include <future>
+
+// Keeps a BVH valid while primitives move. Edits refit the path from the changed leaf to the
+// root and new primitives are inserted next to an existing leaf, both updating the SAH cost along
+// the same path. Once it drifts past rebuildThreshold times the cost the tree was built with, a
+// full rebuild is started on a background thread and swapped in by poll().
+class DynamicBVH
+{
+public:
+	BVH bvh;
+	CpuBVH wide;
+	float rebuildThreshold = 1.5f;
+
+	void build(const std::vector<AABB>& bounds);
+	void update(int primitive, const AABB& bounds);
+	void insert(const AABB& bounds);
+	bool poll();
+	bool isRebuilding() const;
+	float costRatio() const;
+private:
+	float builtCost = 0.0f;
+	float currentCost = 0.0f;
+	float surfaceCost = 0.0f;
+	std::future<BVH> pendingRebuild;
+	void scheduleRebuildIfDegraded();
+};
@@ -0,0 +1,115 @@
+#include "FrameGovernor.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// The first frames include compiling shaders and uploading the scene, so they say nothing about
+// what later ones will cost.
+const int numWarmUpFrames = 4;
+const int stillFramesBeforeRamp = 4;
+const float rampFactor = 1.5f;
+const float costSmoothing = 0.2f;
+// How far a single measurement may move the estimate, so one stalled frame cannot send the
+// quality to the floor for the next few dozen.
+const float maxCostChange = 4.0f;
+const float resolutionSteps = 8.0f;
+
+static float cost(const GovernedQuality& quality)
+{
+	return quality.resolutionScale * quality.resolutionScale * quality.numSamples * (quality.numLightBounces + 1);
+}
+
+void FrameGovernor::create()
+{
+	glGenQueries(numFrameTimers, queries);
+}
+
+bool FrameGovernor::hasCameraMoved(Camera& camera)
+{
+	bool hasMoved = camera.getOrigin() != lastOrigin || camera.getForward() != lastForward ||
+		camera.getRight() != lastRight || camera.getUp() != lastUp;
+	lastOrigin = camera.getOrigin();
+	lastForward = camera.getForward();
+	lastRight = camera.getRight();
+	lastUp = camera.getUp();
+	return hasMoved;
+}
+
+// Until the first measurement arrives the frame is rendered at full quality, which is what it
+// would have cost without the governor.
+GovernedQuality FrameGovernor::update(Camera& camera, int maxSamples, int maxLightBounces)
+{
+	maxSamples = std::max(maxSamples, 1);
+	maxLightBounces = std::max(maxLightBounces, 1);
+	float fullCost = cost({ 1.0f, maxSamples, maxLightBounces });
+	numStillFrames = hasCameraMoved(camera) ? 0 : numStillFrames + 1;
+
+	if (millisecondsPerCost == 0.0f)
+		budget = fullCost;
+	else if (numStillFrames >= stillFramesBeforeRamp)
+		budget = std::min(std::max(budget, targetMilliseconds / millisecondsPerCost) * rampFactor, fullCost);
+	else
+		budget = targetMilliseconds / millisecondsPerCost;
+
+	quality = fit(budget, maxSamples, maxLightBounces);
+	return quality;
+}
+
+GovernedQuality FrameGovernor::fit(float budget, int maxSamples, int maxLightBounces) const
+{
+	GovernedQuality fitted = { 1.0f, maxSamples, maxLightBounces };
+	if (cost(fitted) <= budget)
+		return fitted;
+
+	fitted.numSamples = clamp(int(budget / (maxLightBounces + 1)), 1, maxSamples);
+	if (cost(fitted) <= budget)
+		return fitted;
+
+	float minScale = clamp(minResolutionScale, 1.0f / resolutionSteps, 1.0f);
+	float scale = sqrt(budget / (fitted.numSamples * (maxLightBounces + 1)));
+	fitted.resolutionScale = std::max(floor(scale * resolutionSteps) / resolutionSteps, minScale);
+	if (cost(fitted) <= budget)
+		return fitted;
+
+	float scaleSquared = fitted.resolutionScale * fitted.resolutionScale;
+	fitted.numLightBounces = clamp(int(budget / scaleSquared) - 1, 1, maxLightBounces);
+	return fitted;
+}
+
+void FrameGovernor::beginFrame()
+{
+	glBeginQuery(GL_TIME_ELAPSED, queries[numFrames % numFrameTimers]);
+	queryCosts[numFrames % numFrameTimers] = cost(quality);
+}
+
+// Reads back the oldest query that is still outstanding, if the GPU has got to it.
+void FrameGovernor::endFrame()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	numFrames++;
+	if (numFrames < numFrameTimers)
+		return;
+
+	int oldest = numFrames % numFrameTimers;
+	GLint isAvailable = 0;
+	glGetQueryObjectiv(queries[oldest], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+	if (!isAvailable)
+		return;
+	GLuint64 nanoseconds = 0;
+	glGetQueryObjectui64v(queries[oldest], GL_QUERY_RESULT, &nanoseconds);
+	lastMilliseconds = float(nanoseconds / 1e6);
+	if (numFrames <= numWarmUpFrames)
+		return;
+
+	float measured = lastMilliseconds / queryCosts[oldest];
+	if (millisecondsPerCost == 0.0f)
+		millisecondsPerCost = measured;
+	else
+		millisecondsPerCost = mix(millisecondsPerCost, clamp(measured, millisecondsPerCost / maxCostChange, millisecondsPerCost * maxCostChange), costSmoothing);
+}
+
+void FrameGovernor::destroy()
+{
+	glDeleteQueries(numFrameTimers, queries);
+}
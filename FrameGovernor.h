@@ -0,0 +1,56 @@
+#pragma once
+#include "Camera.h"
+#include <glad/glad.h>
+#include <glm.hpp>
+
+using namespace glm;
+
+// Timer queries are read this many frames after they were issued, by which time the GPU has
+// finished with them and reading the result does not stall.
+const int numFrameTimers = 3;
+
+struct GovernedQuality
+{
+	float resolutionScale;
+	int numSamples;
+	int numLightBounces;
+};
+
+// Holds the GPU time of a frame near targetMilliseconds. The time of every frame is measured with
+// a timer query around its path tracing and image passes and divided by the frame's cost, taken
+// as resolutionScale^2 * numSamples * (numLightBounces + 1), to keep a running estimate of what a
+// unit of cost takes. While the camera moves each frame gets the cost that fits the target, spent
+// on full quality first and given up in order of how little it shows in motion: samples down to
+// one, then resolution in steps of an eighth down to minResolutionScale, then bounces. Once the
+// camera has been still for a few frames the budget grows by a fixed factor per frame until the
+// frame is back to full quality, whatever that costs, and snaps back to the target as soon as the
+// camera moves again.
+class FrameGovernor
+{
+public:
+	bool isEnabled = false;
+	float targetMilliseconds = 16.6f;
+	float minResolutionScale = 0.25f;
+	GovernedQuality quality = { 1.0f, 1, 1 };
+	float lastMilliseconds = 0.0f;
+
+	void create();
+	GovernedQuality update(Camera& camera, int maxSamples, int maxLightBounces);
+	void beginFrame();
+	void endFrame();
+	void destroy();
+private:
+	GLuint queries[numFrameTimers] = {};
+	float queryCosts[numFrameTimers] = {};
+	int numFrames = 0;
+	float millisecondsPerCost = 0.0f;
+	float budget = 0.0f;
+	int numStillFrames = 0;
+	vec3 lastOrigin;
+	vec3 lastForward;
+	vec3 lastRight;
+	vec3 lastUp;
+
+	bool hasCameraMoved(Camera& camera);
+	GovernedQuality fit(float budget, int maxSamples, int maxLightBounces) const;
+};
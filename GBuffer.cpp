@@ -0,0 +1,185 @@
+#include "GBuffer.h"
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+static GLuint createTarget(GLenum internalFormat, GLenum format, GLenum type, int width, int height)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+static void createBoundsArray(GLuint& vertexArray, GLuint& buffer, int maxCount)
+{
+	glGenVertexArrays(1, &vertexArray);
+	glGenBuffers(1, &buffer);
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, maxCount * sizeof(vec4), nullptr, GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(vec4), (void*)0);
+	glVertexAttribDivisor(0, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+// Sphere and instance bounds are one vec4 per instance: the centre and the radius. The meshes and
+// instances are read from the scene's buffer textures, on the units the scene program reads them
+// from.
+void GBuffer::create(GLuint program, GLuint sceneProgram)
+{
+	this->program = program;
+	glGenFramebuffers(1, &framebuffer);
+	glGenRenderbuffers(1, &depthRenderbuffer);
+	createBoundsArray(vertexArray, sphereBuffer, maxNumSpheres);
+	createBoundsArray(instanceVertexArray, instanceBuffer, maxNumInstances);
+
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "meshVertices"), 1);
+	glUniform1i(glGetUniformLocation(program, "meshTriangles"), 2);
+	glUniform1i(glGetUniformLocation(program, "instanceData"), 17);
+
+	glUseProgram(sceneProgram);
+	glUniform1i(glGetUniformLocation(sceneProgram, "gBufferNormalDepthTexture"), 15);
+	glUniform1i(glGetUniformLocation(sceneProgram, "gBufferSurfaceTexture"), 16);
+}
+
+void GBuffer::resize(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	glDeleteTextures(1, &normalDepthTexture);
+	glDeleteTextures(1, &surfaceTexture);
+	normalDepthTexture = createTarget(GL_RGBA32F, GL_RGBA, GL_FLOAT, width, height);
+	surfaceTexture = createTarget(GL_RGBA32I, GL_RGBA_INTEGER, GL_INT, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthRenderbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, normalDepthTexture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, surfaceTexture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer);
+	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "G-buffer framebuffer is incomplete" << endl;
+}
+
+// Invisible spheres and instances get no area; invisible planes still cover the screen, but every
+// fragment of them is discarded. Invisible meshes and those still being built are not drawn, as
+// the scene program does not trace them either. The textures are unbound while they are rendered
+// to.
+void GBuffer::render(Scene& scene, int width, int height)
+{
+	if (width != this->width || height != this->height)
+		resize(width, height);
+
+	glActiveTexture(GL_TEXTURE15);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE16);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	const GLfloat farDepth = 1.0f;
+	const GLfloat noNormalDepth[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const GLint noSurface[] = { -1, 0, 0, 0 };
+	glClearBufferfv(GL_DEPTH, 0, &farDepth);
+	glClearBufferfv(GL_COLOR, 0, noNormalDepth);
+	glClearBufferiv(GL_COLOR, 1, noSurface);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+
+	Camera& camera = scene.camera;
+	mat3 worldToCamera = inverse(mat3(camera.getRight(), camera.getUp(), camera.getForward()));
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "screenWidth"), width);
+	glUniform1i(glGetUniformLocation(program, "screenHeight"), height);
+	glUniform3f(glGetUniformLocation(program, "cameraOrigin"), camera.getOrigin().x, camera.getOrigin().y, camera.getOrigin().z);
+	glUniform3f(glGetUniformLocation(program, "cameraForward"), camera.getForward().x, camera.getForward().y, camera.getForward().z);
+	glUniform3f(glGetUniformLocation(program, "cameraRight"), camera.getRight().x, camera.getRight().y, camera.getRight().z);
+	glUniform3f(glGetUniformLocation(program, "cameraUp"), camera.getUp().x, camera.getUp().y, camera.getUp().z);
+	glUniformMatrix3fv(glGetUniformLocation(program, "worldToCamera"), 1, GL_FALSE, &worldToCamera[0][0]);
+	scene.primitives.upload(program);
+	scene.uploadGroups(program);
+
+	vec4 sphereBounds[maxNumSpheres];
+	for (int i = 0; i < scene.numSpheres; i++)
+		sphereBounds[i] = vec4(scene.spheres[i].origin, scene.spheres[i].isVisible ? scene.spheres[i].radius : 0.0f);
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, scene.numSpheres * sizeof(vec4), sphereBounds);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glEnableVertexAttribArray(0);
+	glUniform1i(glGetUniformLocation(program, "isSphere"), true);
+	glUniform1i(glGetUniformLocation(program, "isMesh"), false);
+	glUniform1i(glGetUniformLocation(program, "rasterizedHitType"), primitiveTypeId<Sphere>());
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, scene.numSpheres);
+
+	glDisableVertexAttribArray(0);
+	glUniform1i(glGetUniformLocation(program, "isSphere"), false);
+	glUniform1i(glGetUniformLocation(program, "rasterizedHitType"), primitiveTypeId<Plane>());
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, scene.numPlanes);
+
+	glUniform1i(glGetUniformLocation(program, "isMesh"), true);
+	glUniform1i(glGetUniformLocation(program, "rasterizedHitType"), meshHitType);
+	for (int i = 0; i < int(scene.meshes.size()) && i < maxNumMeshes; i++)
+	{
+		const MeshObject& meshObject = scene.meshes[i];
+		if (!meshObject.isVisible || meshObject.gpuBVHRoot < 0)
+			continue;
+		glUniform1i(glGetUniformLocation(program, "meshIndex"), i);
+		glUniform1i(glGetUniformLocation(program, "firstTriangle"), meshObject.gpuFirstTriangle);
+		glDrawArrays(GL_TRIANGLES, 0, 3 * int(meshObject.mesh.triangles.size()));
+	}
+
+	// An instance's bounding sphere is the one around its bounds in world space.
+	int numInstances = int(scene.instances.size());
+	vector<vec4> instanceBounds(numInstances);
+	for (int i = 0; i < numInstances; i++)
+	{
+		AABB bounds = scene.instanceBounds(scene.instances[i]);
+		float radius = scene.instances[i].isVisible ? 0.5f * length(bounds.max - bounds.min) : 0.0f;
+		instanceBounds[i] = vec4(0.5f * (bounds.min + bounds.max), radius);
+	}
+	glBindVertexArray(instanceVertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, numInstances * sizeof(vec4), instanceBounds.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glEnableVertexAttribArray(0);
+	glUniform1i(glGetUniformLocation(program, "isSphere"), true);
+	glUniform1i(glGetUniformLocation(program, "isMesh"), false);
+	glUniform1i(glGetUniformLocation(program, "rasterizedHitType"), instanceHitType);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, numInstances);
+	glBindVertexArray(0);
+	glDisable(GL_DEPTH_TEST);
+
+	glActiveTexture(GL_TEXTURE15);
+	glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+	glActiveTexture(GL_TEXTURE16);
+	glBindTexture(GL_TEXTURE_2D, surfaceTexture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void GBuffer::destroy()
+{
+	glDeleteTextures(1, &normalDepthTexture);
+	glDeleteTextures(1, &surfaceTexture);
+	glDeleteRenderbuffers(1, &depthRenderbuffer);
+	glDeleteBuffers(1, &sphereBuffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	glDeleteBuffers(1, &instanceBuffer);
+	glDeleteVertexArrays(1, &instanceVertexArray);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteProgram(program);
+}
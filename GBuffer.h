@@ -0,0 +1,39 @@
+#pragma once
+#include "Scene.h"
+#include <glad/glad.h>
+#include <glm.hpp>
+
+using namespace glm;
+
+// Rasterized primary visibility for the primitives whose PrimitiveTraits mark them isRasterized,
+// the meshes and the instances: the normal and distance of the surface each pixel's centre ray
+// hits first, and its hitType and index, which the scene program looks its material up by.
+// Spheres and instances are drawn as instanced squares around their bounding sphere's silhouette,
+// planes as quads over the whole screen and meshes as their triangles; each fragment intersects
+// its pixel's ray with what is drawn and the depth test keeps the nearest. The scene has to be
+// updated first, so the meshes and instances drawn are the ones uploaded for this frame.
+// render() leaves the textures on units 15 and 16, clear of everything else the scene program
+// reads.
+class GBuffer
+{
+public:
+	bool isEnabled = false;
+
+	void create(GLuint program, GLuint sceneProgram);
+	void render(Scene& scene, int width, int height);
+	void destroy();
+private:
+	GLuint program = 0;
+	GLuint framebuffer = 0;
+	GLuint normalDepthTexture = 0;
+	GLuint surfaceTexture = 0;
+	GLuint depthRenderbuffer = 0;
+	GLuint vertexArray = 0;
+	GLuint sphereBuffer = 0;
+	GLuint instanceVertexArray = 0;
+	GLuint instanceBuffer = 0;
+	int width = 0;
+	int height = 0;
+
+	void resize(int width, int height);
+};
@@ -0,0 +1,51 @@
+#include "HeapCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _DEBUG
+static std::atomic<long long> numHeapAllocations(0);
+
+void* operator new(size_t size)
+{
+	numHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size ? size : 1))
+		return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
+long long heapAllocationCount()
+{
+	return numHeapAllocations.load(std::memory_order_relaxed);
+}
+#else
+long long heapAllocationCount()
+{
+	return 0;
+}
+#endif
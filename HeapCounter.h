@@ -0,0 +1,12 @@
+#pragma once
+
+// In debug builds every call to the global operator new is counted, so a stretch of code that
+// must not touch the heap can compare the count before and after. Release builds leave the
+// allocator alone and always report zero.
+#ifdef _DEBUG
+const bool isHeapCounting = true;
+#else
+const bool isHeapCounting = false;
+#endif
+
+long long heapAllocationCount();
@@ -0,0 +1,47 @@
+#include "IdleTracker.h"
+#include <GLFW/glfw3.h>
+
+const int framesToSettle = 3;
+const double backgroundPollSeconds = 0.05;
+
+static bool isSame(const FrameInputs& a, const FrameInputs& b)
+{
+	return a.width == b.width && a.height == b.height && a.numSamples == b.numSamples && a.numLightBounces == b.numLightBounces &&
+		a.blurDistance == b.blurDistance && a.blurStrength == b.blurStrength && a.showHdri == b.showHdri;
+}
+
+void IdleTracker::pollEvents(bool isIdle, bool hasBackgroundWork)
+{
+	if (isEnabled && isIdle && numFramesToSettle == 0)
+	{
+		if (hasBackgroundWork)
+			glfwWaitEventsTimeout(backgroundPollSeconds);
+		else
+			glfwWaitEvents();
+		numFramesToSettle = framesToSettle;
+		return;
+	}
+	glfwPollEvents();
+	numFramesToSettle = isIdle ? numFramesToSettle - 1 : framesToSettle;
+	if (numFramesToSettle < 0)
+		numFramesToSettle = 0;
+}
+
+bool IdleTracker::hasCameraMoved(Camera& camera)
+{
+	bool hasMoved = camera.getOrigin() != lastOrigin || camera.getForward() != lastForward ||
+		camera.getRight() != lastRight || camera.getUp() != lastUp;
+	lastOrigin = camera.getOrigin();
+	lastForward = camera.getForward();
+	lastRight = camera.getRight();
+	lastUp = camera.getUp();
+	return hasMoved;
+}
+
+bool IdleTracker::hasChanged(Camera& camera, const FrameInputs& inputs, bool isGuiActive)
+{
+	bool hasChanged = hasCameraMoved(camera) || !isSame(inputs, lastInputs) || isGuiActive || wasGuiActive;
+	lastInputs = inputs;
+	wasGuiActive = isGuiActive;
+	return hasChanged;
+}
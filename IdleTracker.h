@@ -0,0 +1,45 @@
+#pragma once
+#include "Camera.h"
+#include <glm.hpp>
+
+using namespace glm;
+
+// Everything besides the scene and the camera that the path traced image depends on.
+struct FrameInputs
+{
+	int width;
+	int height;
+	int numSamples;
+	int numLightBounces;
+	float blurDistance;
+	float blurStrength;
+	bool showHdri;
+};
+
+// Tells when the GPU image is already what another frame would give, so the path tracer can be
+// skipped and the main loop can sleep in glfwWaitEvents until something happens. Changes are
+// tracked by comparing the camera and the other frame inputs with the last frame's. The scene is
+// edited in place by its widgets, so an edit is recognised by an interface item being active;
+// the frame after one is active counts as well, since a widget's last edit lands after that
+// frame has been drawn. After waking, a few frames run without waiting so the interface can
+// answer the event, a click being a press in one frame and a release in the next. While a
+// background job is running, nothing would wake the loop when it finishes, so the wait is cut
+// short every so often for the job to be polled.
+class IdleTracker
+{
+public:
+	bool isEnabled = true;
+
+	void pollEvents(bool isIdle, bool hasBackgroundWork);
+	bool hasChanged(Camera& camera, const FrameInputs& inputs, bool isGuiActive);
+private:
+	FrameInputs lastInputs = {};
+	vec3 lastOrigin;
+	vec3 lastForward;
+	vec3 lastRight;
+	vec3 lastUp;
+	bool wasGuiActive = false;
+	int numFramesToSettle = 0;
+
+	bool hasCameraMoved(Camera& camera);
+};
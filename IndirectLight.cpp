@@ -0,0 +1,81 @@
+#include "IndirectLight.h"
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+static GLuint createTarget(GLenum internalFormat, int width, int height)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+void IndirectLight::create(GLuint sceneProgram)
+{
+	glGenFramebuffers(1, &framebuffer);
+	glUseProgram(sceneProgram);
+	glUniform1i(glGetUniformLocation(sceneProgram, "indirectTexture"), 13);
+	glUniform1i(glGetUniformLocation(sceneProgram, "indirectNormalDepthTexture"), 14);
+}
+
+// The normal and depth go to the same attachment the denoiser's features use, so the scene
+// program writes them from its features output.
+void IndirectLight::resize(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	glDeleteTextures(1, &lightTexture);
+	glDeleteTextures(1, &normalDepthTexture);
+	lightTexture = createTarget(GL_RGBA16F, width, height);
+	normalDepthTexture = createTarget(GL_RGBA32F, width, height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, lightTexture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, normalDepthTexture, 0);
+	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_NONE, GL_COLOR_ATTACHMENT2 };
+	glDrawBuffers(3, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "Indirect light framebuffer is incomplete" << endl;
+}
+
+// Leaves the textures unbound while they are rendered to, so the pass cannot read what it writes.
+void IndirectLight::begin(int renderWidth, int renderHeight)
+{
+	int factor = std::max(settings.downsampleFactor, 1);
+	int width = std::max(1, (renderWidth + factor - 1) / factor);
+	int height = std::max(1, (renderHeight + factor - 1) / factor);
+	if (width != this->width || height != this->height)
+		resize(width, height);
+
+	glActiveTexture(GL_TEXTURE13);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE14);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+}
+
+void IndirectLight::end()
+{
+	glActiveTexture(GL_TEXTURE13);
+	glBindTexture(GL_TEXTURE_2D, lightTexture);
+	glActiveTexture(GL_TEXTURE14);
+	glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void IndirectLight::destroy()
+{
+	glDeleteTextures(1, &lightTexture);
+	glDeleteTextures(1, &normalDepthTexture);
+	glDeleteFramebuffers(1, &framebuffer);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <glad/glad.h>
+
+// Matches the lighting modes in fragmentshader.glsl.
+enum LightingMode
+{
+	fullLighting,
+	directLighting,
+	indirectLighting
+};
+
+// Indirect light is traced at 1 / downsampleFactor of the resolution on each axis, so a factor of
+// two traces a quarter of the bounces.
+struct IndirectLightSettings
+{
+	bool isReduced = false;
+	int downsampleFactor = 2;
+};
+
+// Target for the reduced resolution indirect lighting pass: the indirect light of each texel and
+// the normal and depth of the surface it was traced from, which the full resolution pass upsamples
+// it by. begin() binds it for the scene program's indirect pass and end() hands its textures to the
+// direct pass on units 13 and 14, clear of the scene's, the denoiser's and the render target's.
+class IndirectLight
+{
+public:
+	IndirectLightSettings settings;
+	int width = 0;
+	int height = 0;
+
+	void create(GLuint sceneProgram);
+	void begin(int renderWidth, int renderHeight);
+	void end();
+	void destroy();
+private:
+	GLuint framebuffer = 0;
+	GLuint lightTexture = 0;
+	GLuint normalDepthTexture = 0;
+
+	void resize(int width, int height);
+};
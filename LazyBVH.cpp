@@ -0,0 +1,158 @@
+#include "LazyBVH.h"
+#include <thread>
+
+LazyBVH::LazyBVH() : nodeCount(0)
+{}
+
+LazyBVH::LazyBVH(LazyBVH&& other) : nodeCount(0)
+{
+	*this = std::move(other);
+}
+
+LazyBVH& LazyBVH::operator=(LazyBVH&& other)
+{
+	nodes = std::move(other.nodes);
+	primitiveIndices = std::move(other.primitiveIndices);
+	depths = std::move(other.depths);
+	states = std::move(other.states);
+	nodeCount.store(other.nodeCount.load());
+	other.nodeCount.store(0);
+	primitiveBounds = std::move(other.primitiveBounds);
+	centroids = std::move(other.centroids);
+	return *this;
+}
+
+// Only the root is created here. A binary tree over n primitives never has more than 2n - 1
+// nodes, so reserving them all up front lets children be claimed without ever reallocating
+// under a concurrent traversal.
+void LazyBVH::build(const std::vector<AABB>& bounds)
+{
+	int numPrimitives = int(bounds.size());
+	primitiveBounds = bounds;
+	primitiveIndices.resize(numPrimitives);
+	centroids.resize(numPrimitives);
+	nodes.clear();
+	depths.clear();
+	states.reset();
+	nodeCount.store(0);
+
+	if (numPrimitives == 0)
+		return;
+
+	for (int i = 0; i < numPrimitives; i++)
+	{
+		primitiveIndices[i] = i;
+		centroids[i] = bounds[i].centroid();
+	}
+
+	int capacity = 2 * numPrimitives - 1;
+	nodes.resize(capacity);
+	depths.resize(capacity);
+	states.reset(new std::atomic<int>[capacity]);
+	for (int i = 0; i < capacity; i++)
+		states[i].store(Unsplit, std::memory_order_relaxed);
+
+	nodes[0].leftChild = 0;
+	nodes[0].firstPrimitive = 0;
+	nodes[0].numPrimitives = numPrimitives;
+	nodes[0].parent = -1;
+	depths[0] = 0;
+	setLeafBounds(0);
+	nodeCount.store(1);
+}
+
+void LazyBVH::expand(int nodeIndex)
+{
+	std::atomic<int>& state = states[nodeIndex];
+	if (state.load(std::memory_order_acquire) == Split)
+		return;
+
+	int expected = Unsplit;
+	if (state.compare_exchange_strong(expected, Splitting, std::memory_order_acquire))
+	{
+		split(nodeIndex);
+		state.store(Split, std::memory_order_release);
+		return;
+	}
+
+	while (state.load(std::memory_order_acquire) != Split)
+		std::this_thread::yield();
+}
+
+// Runs on exactly one thread per node. Its primitive range is disjoint from every other unsplit
+// node's, so partitioning it in place does not race with other splits.
+void LazyBVH::split(int nodeIndex)
+{
+	BVHNode& node = nodes[nodeIndex];
+	int first = node.firstPrimitive;
+	int count = node.numPrimitives;
+	if (count <= maxLeafPrimitives || depths[nodeIndex] >= maxBVHDepth - 1)
+		return;
+
+	int leftCount = partitionSah(&primitiveIndices[first], count, primitiveBounds, centroids, node.bounds.surfaceArea());
+	if (leftCount == 0)
+		return;
+
+	int leftChild = nodeCount.fetch_add(2);
+	BVHNode& left = nodes[leftChild];
+	left.leftChild = 0;
+	left.firstPrimitive = first;
+	left.numPrimitives = leftCount;
+	left.parent = nodeIndex;
+	BVHNode& right = nodes[leftChild + 1];
+	right = left;
+	right.firstPrimitive = first + leftCount;
+	right.numPrimitives = count - leftCount;
+	depths[leftChild] = depths[leftChild + 1] = depths[nodeIndex] + 1;
+	setLeafBounds(leftChild);
+	setLeafBounds(leftChild + 1);
+
+	node.leftChild = leftChild;
+	node.numPrimitives = 0;
+}
+
+void LazyBVH::setLeafBounds(int nodeIndex)
+{
+	BVHNode& node = nodes[nodeIndex];
+	node.bounds = AABB();
+	for (int i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+		node.bounds.grow(primitiveBounds[primitiveIndices[i]]);
+}
+
+// Children are always claimed after their parent, so a single forward sweep reaches every node.
+void LazyBVH::expandAll()
+{
+	for (int i = 0; i < nodeCount.load(); i++)
+		expand(i);
+}
+
+void LazyBVH::expandInto(BVH& bvh)
+{
+	expandAll();
+	int count = nodeCount.load();
+	bvh.nodes.assign(nodes.begin(), nodes.begin() + count);
+	bvh.primitiveIndices = primitiveIndices;
+	bvh.primitiveBounds = primitiveBounds;
+	bvh.primitiveLeaves.assign(primitiveBounds.size(), -1);
+	for (int i = 0; i < count; i++)
+	{
+		const BVHNode& node = bvh.nodes[i];
+		for (int j = node.firstPrimitive; j < node.firstPrimitive + node.numPrimitives; j++)
+			bvh.primitiveLeaves[bvh.primitiveIndices[j]] = i;
+	}
+}
+
+int LazyBVH::numNodes() const
+{
+	return nodeCount.load();
+}
+
+int LazyBVH::maxNodes() const
+{
+	return int(nodes.size());
+}
+
+bool LazyBVH::isEmpty() const
+{
+	return nodes.empty();
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "BVH.h"
+#include <atomic>
+#include <memory>
+
+// A binary BVH whose nodes start out as unsplit leaves covering their whole primitive range and
+// are only partitioned the first time a traversal enters them, so regions no ray reaches never pay
+// for their build. Nodes are preallocated, and splitting is guarded per node by a state that one
+// thread moves from Unsplit to Splitting while others wait for it to publish Split, which makes
+// traversal safe from several threads at once. Traversal builds the tree as it goes, so it is not
+// const.
+class LazyBVH
+{
+public:
+	LazyBVH();
+	LazyBVH(LazyBVH&& other);
+	LazyBVH& operator=(LazyBVH&& other);
+
+	void build(const std::vector<AABB>& bounds);
+	void expandAll();
+	void expandInto(BVH& bvh);
+	int numNodes() const;
+	int maxNodes() const;
+	bool isEmpty() const;
+
+	template <typename Intersect>
+	void traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect);
+private:
+	enum NodeState
+	{
+		Unsplit,
+		Splitting,
+		Split
+	};
+
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitiveIndices;
+	std::vector<int> depths;
+	std::unique_ptr<std::atomic<int>[]> states;
+	std::atomic<int> nodeCount;
+	std::vector<AABB> primitiveBounds;
+	std::vector<vec3> centroids;
+
+	void expand(int nodeIndex);
+	void split(int nodeIndex);
+	void setLeafBounds(int nodeIndex);
+};
+
+template <typename Intersect>
+void LazyBVH::traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect)
+{
+	if (nodes.empty())
+		return;
+
+	vec3 inverseDirection = 1.0f / direction;
+	int stack[maxBVHDepth * 2];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		int nodeIndex = stack[--stackSize];
+		if (intersectAABB(nodes[nodeIndex].bounds, origin, inverseDirection, tMax) == FLT_MAX)
+			continue;
+
+		expand(nodeIndex);
+		const BVHNode& node = nodes[nodeIndex];
+		if (node.isLeaf())
+		{
+			for (int i = node.firstPrimitive; i < node.firstPrimitive + node.numPrimitives; i++)
+				intersect(primitiveIndices[i]);
+			continue;
+		}
+
+		int nearChild = node.leftChild;
+		int farChild = node.leftChild + 1;
+		float tNear = intersectAABB(nodes[nearChild].bounds, origin, inverseDirection, tMax);
+		float tFar = intersectAABB(nodes[farChild].bounds, origin, inverseDirection, tMax);
+		if (tFar < tNear)
+		{
+			std::swap(nearChild, farChild);
+			std::swap(tNear, tFar);
+		}
+		if (tFar != FLT_MAX)
+			stack[stackSize++] = farChild;
+		if (tNear != FLT_MAX)
+			stack[stackSize++] = nearChild;
+	}
+}
@@ -15,6 +15,14 @@
 
 #include "Camera.h"
 #include "Scene.h"
+#include "CpuRenderer.h"
+#include "Denoiser.h"
+#include "FrameGovernor.h"
+#include "RenderTarget.h"
+#include "IndirectLight.h"
+#include "GBuffer.h"
+#include "SampleAccumulator.h"
+#include "IdleTracker.h"
 
 std::string readShaderFromFile(const std::string& filePath);
 static void frameBufferSizeCallback(GLFWwindow* window, int width, int height);
@@ -23,21 +31,30 @@ static void cursorPositionCallback(GLFWwindow* window, double xPos, double yPos)
 static void mouseScrollCallback(GLFWwindow* window, double xOffset, double yOffset);
 static void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);         
 
-GLuint createShaderProgram();
+GLuint createShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource);
 GLuint createHdriTexture(std::string path);
 
 std::string vertexShaderCode = readShaderFromFile("vertexshader.glsl");
-std::string fragmentShaderCode = readShaderFromFile("fragmentshader.glsl");
-
-const char* vertexShaderSource = vertexShaderCode.c_str();
-const char* fragmentShaderSource = fragmentShaderCode.c_str();
+std::string fragmentShaderCode = insertPrimitiveGlsl(readShaderFromFile("fragmentshader.glsl"));
+std::string denoiseShaderCode = readShaderFromFile("denoiseshader.glsl");
+std::string blitShaderCode = readShaderFromFile("blitshader.glsl");
+std::string gBufferVertexShaderCode = readShaderFromFile("gbuffervertexshader.glsl");
+std::string gBufferShaderCode = insertPrimitiveGlsl(readShaderFromFile("gbuffershader.glsl"));
 
 int screenWidth = 1920;
 int screenHeight = 1080;
 
 const float PI = 3.14159265359f;
 float fov = 70.0f;
-Scene scene = Scene(fov * PI / 180.0f, 1920.0f / 1080.0f);
+Scene scene(fov * PI / 180.0f, 1920.0f / 1080.0f);
+CpuRenderer cpuRenderer;
+GpuDenoiser denoiser;
+FrameGovernor governor;
+RenderTarget renderTarget;
+IndirectLight indirectLight;
+GBuffer gBuffer;
+SampleAccumulator accumulator;
+IdleTracker idleTracker;
 float cameraSensitivity = 3.0f;
 bool middleMouseButtonHeld = false;
 float blurDistance = 5.0;
@@ -68,8 +85,15 @@ int main()
     glfwMakeContextCurrent(window);
     gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress));
 
-    GLuint shaderProgram = createShaderProgram();
+    GLuint shaderProgram = createShaderProgram(vertexShaderCode.c_str(), fragmentShaderCode.c_str());
+    denoiser.create(createShaderProgram(vertexShaderCode.c_str(), denoiseShaderCode.c_str()));
+    governor.create();
+    renderTarget.create(createShaderProgram(vertexShaderCode.c_str(), blitShaderCode.c_str()));
+    indirectLight.create(shaderProgram);
+    gBuffer.create(createShaderProgram(gBufferVertexShaderCode.c_str(), gBufferShaderCode.c_str()), shaderProgram);
+    accumulator.create(shaderProgram);
     GLuint hdriTexture = createHdriTexture("Outdoors.jpg");
+    cpuRenderer.loadHdri("Outdoors.jpg");
     bool showHdri = true;
 
     float vertices[] = { 
@@ -134,6 +158,13 @@ int main()
     GLuint numLightBouncesLocation = glGetUniformLocation(shaderProgram, "numLightBounces");
     GLuint blurDistanceLocation = glGetUniformLocation(shaderProgram, "blurDistance");
     GLuint blurStrengthLocation = glGetUniformLocation(shaderProgram, "blurStrength");
+    GLuint writeFeaturesLocation = glGetUniformLocation(shaderProgram, "writeFeatures");
+    GLuint frameIndexLocation = glGetUniformLocation(shaderProgram, "frameIndex");
+    GLuint lightingModeLocation = glGetUniformLocation(shaderProgram, "lightingMode");
+    GLuint useGBufferLocation = glGetUniformLocation(shaderProgram, "useGBuffer");
+    int frameIndex = 0;
+    bool isImageCurrent = false;
+    bool isIdle = false;
 
     scene.bind(shaderProgram);
 
@@ -141,7 +172,7 @@ int main()
 
     while (!glfwWindowShouldClose(window))
     {
-        glfwPollEvents();
+        idleTracker.pollEvents(isIdle, scene.hasBackgroundWork());
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
             glfwSetWindowShouldClose(window, true);
 
@@ -156,30 +187,115 @@ int main()
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        // Time slicing keeps the full quality and spreads it over frames instead of lowering it.
+        bool isGoverned = governor.isEnabled && !accumulator.isEnabled;
+        GovernedQuality quality = { 1.0f, numSamples, numLightBounces };
+        if (isGoverned)
+            quality = governor.update(scene.camera, numSamples, numLightBounces);
+        bool hasTargetChanged = renderTarget.prepare(screenWidth, screenHeight, quality.resolutionScale);
+        int renderWidth = renderTarget.width;
+        int renderHeight = renderTarget.height;
+
+        // The image is only traced again when it would come out different: when something it
+        // depends on has changed, a background BVH job among them, while temporal accumulation
+        // keeps blending in new frames, or until a time-sliced frame has all its samples.
+        // Otherwise the render target still holds it and only the interface is drawn.
+        FrameInputs inputs = { renderWidth, renderHeight, quality.numSamples, quality.numLightBounces, blurDistance, blurStrength, showHdri };
+        bool hasFinishedWork = scene.pollBackgroundWork();
+        bool hasChanged = idleTracker.hasChanged(scene.camera, inputs, ImGui::IsAnyItemActive()) || hasTargetChanged || hasFinishedWork;
+        if (hasChanged)
+            isImageCurrent = false;
+        bool needsTracing = !isImageCurrent || denoiser.temporalSettings.isEnabled || !idleTracker.isEnabled;
+
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
-
-        glUseProgram(shaderProgram);
-
-        if (showHdri)
-            glBindTexture(GL_TEXTURE_2D, hdriTexture);
-        else
-            glBindTexture(GL_TEXTURE_2D, 0);
-
-        glBindVertexArray(VAO);
-
-        glUniform1i(screenWidthLocation, screenWidth);
-        glUniform1i(screenHeightLocation, screenHeight);
-
-        glUniform1f(blurDistanceLocation, blurDistance);
-        glUniform1f(blurStrengthLocation, blurStrength);
-
-        glUniform1i(numSamplesLocation, numSamples);
-        glUniform1i(numLightBouncesLocation, numLightBounces);
-
-        scene.update(shaderProgram);
-
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        if (needsTracing)
+        {
+            glViewport(0, 0, renderWidth, renderHeight);
+            if (isGoverned)
+                governor.beginFrame();
+
+            glUseProgram(shaderProgram);
+
+            if (showHdri)
+                glBindTexture(GL_TEXTURE_2D, hdriTexture);
+            else
+                glBindTexture(GL_TEXTURE_2D, 0);
+
+            glBindVertexArray(VAO);
+
+            glUniform1f(blurDistanceLocation, blurDistance);
+            glUniform1f(blurStrengthLocation, blurStrength);
+
+            glUniform1i(numSamplesLocation, quality.numSamples);
+            glUniform1i(numLightBouncesLocation, quality.numLightBounces);
+            glUniform1i(frameIndexLocation, denoiser.temporalSettings.isEnabled ? ++frameIndex : 0);
+
+            scene.update(shaderProgram);
+
+            if (gBuffer.isEnabled)
+            {
+                gBuffer.render(scene, renderWidth, renderHeight);
+                glUseProgram(shaderProgram);
+                glBindVertexArray(VAO);
+            }
+
+            if (indirectLight.settings.isReduced && !accumulator.isEnabled)
+            {
+                indirectLight.begin(renderWidth, renderHeight);
+                glUniform1i(screenWidthLocation, indirectLight.width);
+                glUniform1i(screenHeightLocation, indirectLight.height);
+                glUniform1i(lightingModeLocation, indirectLighting);
+                glUniform1i(writeFeaturesLocation, true);
+                glUniform1i(useGBufferLocation, false);
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                indirectLight.end();
+                glViewport(0, 0, renderWidth, renderHeight);
+            }
+
+            glUniform1i(screenWidthLocation, renderWidth);
+            glUniform1i(screenHeightLocation, renderHeight);
+            glUniform1i(useGBufferLocation, gBuffer.isEnabled);
+
+            if (accumulator.isEnabled)
+            {
+                accumulator.begin(scene.camera, renderWidth, renderHeight, quality.numSamples, quality.numLightBounces, hasChanged);
+
+                glUniform1i(lightingModeLocation, fullLighting);
+                glUniform1i(writeFeaturesLocation, false);
+                AccumulationSlice slice;
+                while (accumulator.nextSlice(slice))
+                {
+                    glUniform1i(numSamplesLocation, slice.numSamples);
+                    glUniform1i(frameIndexLocation, slice.firstSample);
+                    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                    accumulator.endSlice();
+                }
+                accumulator.end(renderTarget.framebuffer);
+                isImageCurrent = accumulator.isComplete();
+            }
+            else
+            {
+                if (denoiser.isActive())
+                    denoiser.begin(renderWidth, renderHeight);
+                else
+                    glBindFramebuffer(GL_FRAMEBUFFER, renderTarget.framebuffer);
+
+                glUniform1i(lightingModeLocation, indirectLight.settings.isReduced ? directLighting : fullLighting);
+                glUniform1i(writeFeaturesLocation, denoiser.isActive());
+
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+                if (denoiser.isActive())
+                    denoiser.apply(VAO, quality.numSamples, scene.camera, renderTarget.framebuffer);
+                isImageCurrent = true;
+            }
+
+            if (isGoverned)
+                governor.endFrame();
+        }
+        renderTarget.present(VAO, screenWidth, screenHeight);
+        isIdle = !hasChanged && isImageCurrent && !denoiser.temporalSettings.isEnabled;
 
         ImGui::Begin("Ray Tracer");     
         ImGui::Text("Render Settings ");
@@ -188,12 +304,61 @@ int main()
         ImGui::InputInt("Number of Samples", &numSamples, 1, 500); 
         ImGui::InputInt("Number of Light Bounces", &numLightBounces, 1, 50);
         ImGui::Checkbox("Show Hdri", &showHdri);
+        ImGui::Checkbox("Match Window Resolution", &renderTarget.settings.matchWindow);
+        if (!renderTarget.settings.matchWindow)
+            ImGui::SliderInt("Internal Resolution", &renderTarget.settings.internalHeight, 144, 2160);
+        ImGui::Text("Rendering at %d x %d", renderWidth, renderHeight);
+        ImGui::Checkbox("32-bit Float Target", &renderTarget.settings.useFullFloat);
+        ImGui::Checkbox("Bicubic Upscale", &renderTarget.settings.useBicubic);
+        const char* toneMappings[] = { "Clamp", "Reinhard", "ACES" };
+        int toneMapping = int(renderTarget.settings.toneMapping);
+        if (ImGui::Combo("Tone Mapping", &toneMapping, toneMappings, 3))
+            renderTarget.settings.toneMapping = ToneMapping(toneMapping);
+        ImGui::SliderFloat("Exposure", &renderTarget.settings.exposure, 0.1f, 8.0f);
+        ImGui::Checkbox("Rasterized Primary Visibility", &gBuffer.isEnabled);
+        ImGui::Checkbox("Reduced Indirect Lighting", &indirectLight.settings.isReduced);
+        if (indirectLight.settings.isReduced)
+            ImGui::SliderInt("Indirect Downsample Factor", &indirectLight.settings.downsampleFactor, 2, 4);
+        ImGui::Checkbox("Sleep When Converged", &idleTracker.isEnabled);
+        ImGui::Checkbox("Time-Sliced Accumulation", &accumulator.isEnabled);
+        if (accumulator.isEnabled)
+        {
+            ImGui::SliderFloat("Time Budget per Frame (ms)", &accumulator.budgetMilliseconds, 4.0f, 100.0f);
+            ImGui::Checkbox("Adaptive Sampling", &accumulator.adaptiveSettings.isEnabled);
+            if (accumulator.adaptiveSettings.isEnabled)
+            {
+                ImGui::SliderFloat("Target Error", &accumulator.adaptiveSettings.targetError, 0.005f, 0.2f, "%.3f");
+                ImGui::SliderInt("Min Samples", &accumulator.adaptiveSettings.minSamples, 1, 64);
+                ImGui::SliderInt("Max Samples", &accumulator.adaptiveSettings.maxSamples, 1, 4096);
+                ImGui::Text("%.1f samples per pixel, %d tiles still sampling", accumulator.meanSamples(), accumulator.numActiveTiles);
+            }
+            else
+                ImGui::Text("%d of %d samples", accumulator.numSamplesDone, accumulator.numSamples);
+        }
+        ImGui::Checkbox("Frame Time Governor", &governor.isEnabled);
+        if (governor.isEnabled)
+        {
+            ImGui::SliderFloat("Target Frame Time (ms)", &governor.targetMilliseconds, 4.0f, 100.0f);
+            ImGui::SliderFloat("Min Resolution Scale", &governor.minResolutionScale, 0.125f, 1.0f);
+            ImGui::Text("%.1f ms at %d%% resolution, %d samples, %d bounces", governor.lastMilliseconds,
+                int(quality.resolutionScale * 100.0f + 0.5f), quality.numSamples, quality.numLightBounces);
+        }
+        ImGui::Checkbox("Denoise", &denoiser.settings.isEnabled);
+        if (denoiser.settings.isEnabled)
+        {
+            ImGui::SliderInt("Denoise Iterations", &denoiser.settings.numIterations, 1, maxDenoiseIterations);
+            ImGui::SliderFloat("Denoise Color Sensitivity", &denoiser.settings.colorPhi, 0.5f, 16.0f);
+        }
+        ImGui::Checkbox("Temporal Accumulation", &denoiser.temporalSettings.isEnabled);
+        if (denoiser.temporalSettings.isEnabled)
+            ImGui::SliderFloat("History Blend", &denoiser.temporalSettings.historyBlend, 0.02f, 1.0f);
         ImGui::Text("Camera Settings");
         ImGui::SliderFloat("Camera Fov", &fov, 5.0f, 175.0f);
         ImGui::SliderFloat("Camera Sensitivity", &cameraSensitivity, 1.0f, 6.0f);
         ImGui::InputFloat("Camera Depth of Field Strength", &blurStrength, 0.0, 0.1);
         scene.gui();
         ImGui::End();
+        cpuRenderer.gui(scene, { screenWidth, screenHeight, numSamples, numLightBounces, blurDistance, blurStrength, showHdri });
 
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
@@ -220,6 +385,12 @@ int main()
     glDeleteBuffers(1, &EBO);
     glDeleteTextures(1, &hdriTexture);
     glDeleteProgram(shaderProgram);
+    denoiser.destroy();
+    governor.destroy();
+    renderTarget.destroy();
+    indirectLight.destroy();
+    gBuffer.destroy();
+    accumulator.destroy();
 
     glfwDestroyWindow(window);
     glfwTerminate();
@@ -235,7 +406,7 @@ std::string readShaderFromFile(const std::string& filePath)
     return buffer.str();
 }
 
-GLuint createShaderProgram()
+GLuint createShaderProgram(const char* vertexShaderSource, const char* fragmentShaderSource)
 {
     GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
     glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
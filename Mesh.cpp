@@ -0,0 +1,509 @@
+#include "Mesh.h"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+
+const size_t objChunkSize = 1 << 20;
+
+static bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void skipBlanks(const char*& p)
+{
+	while (isBlank(*p))
+		p++;
+}
+
+static bool parseInt(const char*& p, int& value)
+{
+	bool negative = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+	if (*p < '0' || *p > '9')
+		return false;
+
+	value = 0;
+	while (*p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	if (negative)
+		value = -value;
+	return true;
+}
+
+static bool parseFloat(const char*& p, float& value)
+{
+	bool negative = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+
+	double mantissa = 0.0;
+	bool hasDigits = false;
+	while (*p >= '0' && *p <= '9')
+	{
+		mantissa = mantissa * 10.0 + (*p++ - '0');
+		hasDigits = true;
+	}
+	if (*p == '.')
+	{
+		p++;
+		double scale = 0.1;
+		while (*p >= '0' && *p <= '9')
+		{
+			mantissa += (*p++ - '0') * scale;
+			scale *= 0.1;
+			hasDigits = true;
+		}
+	}
+	if (!hasDigits)
+		return false;
+
+	if (*p == 'e' || *p == 'E')
+	{
+		p++;
+		int exponent;
+		if (!parseInt(p, exponent))
+			return false;
+		mantissa *= pow(10.0, exponent);
+	}
+	value = float(negative ? -mantissa : mantissa);
+	return true;
+}
+
+static bool parseFaceVertex(const char*& p, int numVertices, int& vertex)
+{
+	if (!parseInt(p, vertex))
+		return false;
+	while (*p != '\n' && !isBlank(*p))
+		p++;
+
+	vertex = vertex < 0 ? numVertices + vertex : vertex - 1;
+	return vertex >= 0 && vertex < numVertices;
+}
+
+// Reads the file in fixed-size chunks and parses whole lines in place, so the only allocations
+// are the amortized growth of the vertex and triangle arrays. Faces with more than three vertices
+// are fan-triangulated; texture coordinates, normals and groups are ignored.
+bool Mesh::loadObj(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	vertices.clear();
+	triangles.clear();
+
+	std::vector<char> buffer(objChunkSize + 1);
+	size_t carried = 0;
+	bool endOfFile = false;
+
+	while (!endOfFile)
+	{
+		file.read(&buffer[carried], objChunkSize - carried);
+		size_t filled = carried + size_t(file.gcount());
+		endOfFile = !file;
+
+		size_t end = filled;
+		if (endOfFile)
+		{
+			buffer[end++] = '\n';
+		}
+		else
+		{
+			while (end > 0 && buffer[end - 1] != '\n')
+				end--;
+			if (end == 0)
+				return false;
+		}
+
+		const char* p = buffer.data();
+		const char* chunkEnd = buffer.data() + end;
+		while (p < chunkEnd)
+		{
+			skipBlanks(p);
+			if (p[0] == 'v' && isBlank(p[1]))
+			{
+				p++;
+				vec3 vertex;
+				for (int axis = 0; axis < 3; axis++)
+				{
+					skipBlanks(p);
+					if (!parseFloat(p, vertex[axis]))
+						return false;
+				}
+				vertices.push_back(vertex);
+			}
+			else if (p[0] == 'f' && isBlank(p[1]))
+			{
+				p++;
+				int numVertices = int(vertices.size());
+				int first, previous, current;
+				skipBlanks(p);
+				if (!parseFaceVertex(p, numVertices, first))
+					return false;
+				skipBlanks(p);
+				if (!parseFaceVertex(p, numVertices, previous))
+					return false;
+				skipBlanks(p);
+				while (*p != '\n')
+				{
+					if (!parseFaceVertex(p, numVertices, current))
+						return false;
+					triangles.push_back(ivec3(first, previous, current));
+					previous = current;
+					skipBlanks(p);
+				}
+			}
+			p = static_cast<const char*>(memchr(p, '\n', chunkEnd - p)) + 1;
+		}
+
+		carried = filled - std::min(end, filled);
+		memmove(buffer.data(), buffer.data() + end, carried);
+	}
+
+	bvhCachePath = path + ".bvh";
+	buildBVH();
+	return !triangles.empty();
+}
+
+// A valid cache at bvhCachePath replaces the build and is traced straight from its mapping.
+// Otherwise, in lazy mode only the root of lazyBvh is built and rays split it as they go; the
+// binary tree and the traced layouts are derived from it once something needs the whole tree, and
+// the cache is written then. Anything waiting on a background expansion is waited for first.
+void Mesh::buildBVH()
+{
+	std::vector<AABB> primitiveBounds = allTriangleBounds();
+	bounds = AABB();
+	for (const AABB& box : primitiveBounds)
+		bounds.grow(box);
+
+	bvh = BVH();
+	wideBvh = CpuBVH();
+	compressedBvh = CompressedBVH();
+	memory = {};
+	isMemoryMeasured = false;
+	if (pendingExpansion.valid())
+		pendingExpansion.wait();
+	pendingExpansion = std::future<BVH>();
+	lazyBvh.reset();
+	bvhCache.reset();
+	if (!bvhCachePath.empty())
+	{
+		bvhCacheKey = hashBVHInput(primitiveBounds);
+		bvhCache.reset(new BVHCacheFile());
+		if (bvhCache->open(bvhCachePath, bvhCacheKey, primitiveBounds))
+		{
+			setLayout(layout);
+			return;
+		}
+		bvhCache.reset();
+	}
+
+	if (lazy)
+	{
+		lazyBvh.reset(new LazyBVH());
+		lazyBvh->build(primitiveBounds);
+		return;
+	}
+
+	bvh.build(primitiveBounds);
+	setLayout(layout);
+	saveBVH();
+}
+
+std::vector<AABB> Mesh::allTriangleBounds() const
+{
+	std::vector<AABB> primitiveBounds(triangles.size());
+	for (int i = 0; i < int(triangles.size()); i++)
+		primitiveBounds[i] = triangleBounds(i);
+	return primitiveBounds;
+}
+
+// The cache holds the CpuBVH as well, so a mesh traced with another layout builds one to write.
+void Mesh::saveBVH()
+{
+	if (bvhCachePath.empty())
+		return;
+
+	CpuBVH built;
+	const CpuBVH* wide = &wideBvh;
+	if (wideBvh.isEmpty())
+	{
+		built.build(bvh);
+		wide = &built;
+	}
+	if (!saveBVHCache(bvhCachePath, bvhCacheKey, bvh, *wide))
+		std::cout << "Failed to write BVH cache " << bvhCachePath << std::endl;
+}
+
+void Mesh::copyBVHCache()
+{
+	bvhCache->copyInto(bvh, allTriangleBounds());
+	bvhCache.reset();
+}
+
+// Only the layout being traced is kept next to the binary tree it is built from. A mapped cache
+// already holds the wide layout; any other one needs the binary tree copied out of it first.
+void Mesh::setLayout(BVHLayout layout)
+{
+	this->layout = layout;
+	wideBvh = CpuBVH();
+	compressedBvh = CompressedBVH();
+	if (bvhCache)
+	{
+		if (layout == BVHLayout::Wide)
+			return;
+		copyBVHCache();
+	}
+	if (layout == BVHLayout::Compressed)
+	{
+		WideBVH<4> wide;
+		wide.build(bvh);
+		compressedBvh.build(wide);
+	}
+	else
+	{
+		wideBvh.build(bvh);
+	}
+}
+
+void Mesh::requireBVH()
+{
+	if (bvhCache)
+	{
+		copyBVHCache();
+		setLayout(layout);
+		return;
+	}
+	if (!lazyBvh)
+		return;
+
+	if (pendingExpansion.valid())
+		bvh = pendingExpansion.get();
+	else
+		lazyBvh->expandInto(bvh);
+	lazyBvh.reset();
+	setLayout(layout);
+	saveBVH();
+}
+
+// Splits what rays have not reached yet on another thread. Traversals of lazyBvh may go on
+// meanwhile, since splitting a node is already safe against them.
+void Mesh::expandInBackground()
+{
+	if (!lazyBvh || pendingExpansion.valid())
+		return;
+
+	LazyBVH* tree = lazyBvh.get();
+	pendingExpansion = std::async(std::launch::async, [tree]()
+	{
+		BVH expanded;
+		tree->expandInto(expanded);
+		return expanded;
+	});
+}
+
+// Returns true when a background expansion has just been swapped in as the full tree.
+bool Mesh::pollExpansion()
+{
+	if (!isExpanding() || pendingExpansion.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return false;
+	requireBVH();
+	return true;
+}
+
+bool Mesh::isExpanding() const
+{
+	return pendingExpansion.valid();
+}
+
+// Builds every layout once to size it. A lazy tree is not expanded for this, so it returns false
+// until something else has needed the whole tree.
+bool Mesh::measureMemory()
+{
+	if (!isMemoryMeasured && bvhCache)
+	{
+		BVH binary;
+		bvhCache->copyInto(binary, allTriangleBounds());
+		memory = measureBVHMemory(binary);
+		isMemoryMeasured = true;
+	}
+	else if (!isMemoryMeasured && !bvh.isEmpty())
+	{
+		memory = measureBVHMemory(bvh);
+		isMemoryMeasured = true;
+	}
+	return isMemoryMeasured;
+}
+
+int Mesh::appendThreaded(std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset) const
+{
+	if (bvhCache)
+		return appendThreadedBVH(bvhCache->nodes(), bvhCache->numNodes(), bvhCache->primitiveIndices(), nodeData, primitiveData, primitiveOffset);
+	return bvh.appendThreaded(nodeData, primitiveData, primitiveOffset);
+}
+
+// Copies what traversal reads into freshly allocated memory, so a copy made by a thread pinned to
+// another NUMA node lands on that node. Expects requireBVH() to have been called.
+Mesh Mesh::replicate() const
+{
+	Mesh copy;
+	copy.vertices = vertices;
+	copy.triangles = triangles;
+	copy.bounds = bounds;
+	copy.bvh = bvh;
+	copy.wideBvh = wideBvh;
+	copy.compressedBvh = compressedBvh;
+	copy.layout = layout;
+	return copy;
+}
+
+AABB Mesh::triangleBounds(int triangle) const
+{
+	AABB box;
+	box.grow(vertices[triangles[triangle].x]);
+	box.grow(vertices[triangles[triangle].y]);
+	box.grow(vertices[triangles[triangle].z]);
+	return box;
+}
+
+vec3 Mesh::triangleNormal(int triangle) const
+{
+	vec3 a = vertices[triangles[triangle].x];
+	vec3 b = vertices[triangles[triangle].y];
+	vec3 c = vertices[triangles[triangle].z];
+	return normalize(cross(b - a, c - a));
+}
+
+WatertightRay::WatertightRay(vec3 origin, vec3 direction) : origin(origin)
+{
+	vec3 absDirection = abs(direction);
+	if (absDirection.x > absDirection.y)
+		kz = absDirection.x > absDirection.z ? 0 : 2;
+	else
+		kz = absDirection.y > absDirection.z ? 1 : 2;
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	if (direction[kz] < 0.0f)
+		std::swap(kx, ky);
+
+	shearX = direction[kx] / direction[kz];
+	shearY = direction[ky] / direction[kz];
+	shearZ = 1.0f / direction[kz];
+}
+
+float Mesh::intersectTriangle(const WatertightRay& ray, int triangle, float tMax) const
+{
+	vec3 a = vertices[triangles[triangle].x] - ray.origin;
+	vec3 b = vertices[triangles[triangle].y] - ray.origin;
+	vec3 c = vertices[triangles[triangle].z] - ray.origin;
+
+	float ax = a[ray.kx] - ray.shearX * a[ray.kz];
+	float ay = a[ray.ky] - ray.shearY * a[ray.kz];
+	float bx = b[ray.kx] - ray.shearX * b[ray.kz];
+	float by = b[ray.ky] - ray.shearY * b[ray.kz];
+	float cx = c[ray.kx] - ray.shearX * c[ray.kz];
+	float cy = c[ray.ky] - ray.shearY * c[ray.kz];
+
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+
+	// Edge functions that land exactly on zero are recomputed in double precision so that rays
+	// through a shared edge or vertex are never missed by both neighbouring triangles.
+	if (u == 0.0f || v == 0.0f || w == 0.0f)
+	{
+		u = float(double(cx) * double(by) - double(cy) * double(bx));
+		v = float(double(ax) * double(cy) - double(ay) * double(cx));
+		w = float(double(bx) * double(ay) - double(by) * double(ax));
+	}
+
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+		return FLT_MAX;
+
+	float determinant = u + v + w;
+	if (determinant == 0.0f)
+		return FLT_MAX;
+
+	float az = ray.shearZ * a[ray.kz];
+	float bz = ray.shearZ * b[ray.kz];
+	float cz = ray.shearZ * c[ray.kz];
+	float t = (u * az + v * bz + w * cz) / determinant;
+
+	if (t < 0.001f || t >= tMax)
+		return FLT_MAX;
+	return t;
+}
+
+// With anyHit the first triangle found closer than tMax is returned. The traversal's own tMax
+// is dropped below zero at that point, which no box or triangle can pass, so it ends right away.
+int Mesh::intersect(vec3 origin, vec3 direction, float& tMax, bool anyHit) const
+{
+	WatertightRay ray = WatertightRay(origin, direction);
+	int closestTriangle = -1;
+	float traversalT = tMax;
+	auto intersectClosest = [&](int triangle)
+	{
+		float t = intersectTriangle(ray, triangle, traversalT);
+		if (t == FLT_MAX)
+			return;
+		tMax = t;
+		traversalT = anyHit ? -1.0f : t;
+		closestTriangle = triangle;
+	};
+
+	if (lazyBvh)
+		lazyBvh->traverse(origin, direction, traversalT, intersectClosest);
+	else if (bvhCache)
+		bvhCache->traverse(origin, direction, traversalT, intersectClosest);
+	else if (layout == BVHLayout::Compressed)
+		compressedBvh.traverse(origin, direction, traversalT, intersectClosest);
+	else
+		wideBvh.traverse(origin, direction, traversalT, intersectClosest);
+	return closestTriangle;
+}
+
+// Packets traverse the wide tree, from the mapped cache when there is one, and fall back to
+// single rays while a lazy mesh has not been expanded yet or the compressed layout is in use.
+void Mesh::intersectPacket(RayPacket& packet, int* closestTriangles) const
+{
+	for (int i = 0; i < packet.count; i++)
+		closestTriangles[i] = -1;
+
+	const WideBVHNode<defaultBVHWidth>* nodes = nullptr;
+	const int* primitiveIndices = nullptr;
+	if (!lazyBvh && bvhCache)
+	{
+		nodes = bvhCache->wideNodes();
+		primitiveIndices = bvhCache->primitiveIndices();
+	}
+	else if (!lazyBvh && layout == BVHLayout::Wide && !wideBvh.isEmpty())
+	{
+		nodes = wideBvh.nodes.data();
+		primitiveIndices = wideBvh.primitiveIndices.data();
+	}
+
+	if (!nodes || !packet.isCoherent)
+	{
+		for (int i = 0; i < packet.count; i++)
+			closestTriangles[i] = intersect(packet.origins[i], packet.directions[i], packet.tMax[i]);
+		return;
+	}
+
+	WatertightRay rays[packetSize];
+	for (int i = 0; i < packet.count; i++)
+		rays[i] = WatertightRay(packet.origins[i], packet.directions[i]);
+
+	traversePacket(nodes, primitiveIndices, packet, [&](int ray, int triangle)
+	{
+		float t = intersectTriangle(rays[ray], triangle, packet.tMax[ray]);
+		if (t == FLT_MAX)
+			return;
+		packet.tMax[ray] = t;
+		closestTriangles[ray] = triangle;
+	});
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <glm.hpp>
+#include <vector>
+#include <string>
+#include "CompressedBVH.h"
+#include "LazyBVH.h"
+#include "BVHCache.h"
+#include "RayPacket.h"
+#include <future>
+#include <memory>
+
+using namespace glm;
+
+// Per-ray setup for the watertight ray/triangle test of Woop, Benthin and Wald: the ray is
+// sheared so it points down +z, which makes shared edges produce identical edge functions.
+struct WatertightRay
+{
+	vec3 origin;
+	int kx, ky, kz;
+	float shearX, shearY, shearZ;
+	WatertightRay() {}
+	WatertightRay(vec3 origin, vec3 direction);
+};
+
+enum class BVHLayout
+{
+	Wide,
+	Compressed
+};
+
+class Mesh
+{
+public:
+	std::vector<vec3> vertices;
+	std::vector<ivec3> triangles;
+	AABB bounds;
+	BVH bvh;
+	CpuBVH wideBvh;
+	CompressedBVH compressedBvh;
+	BVHLayout layout = BVHLayout::Wide;
+	// Sizing the other layouts means building them, so this stays empty until measureMemory().
+	BVHMemory memory = {};
+	bool isMemoryMeasured = false;
+	// Held by pointer so a background expansion keeps working on the same tree when the mesh is
+	// moved, and because tracing even a const mesh builds more of it.
+	std::unique_ptr<LazyBVH> lazyBvh;
+	// A valid cache stays mapped and is traced in place, leaving bvh and wideBvh empty, until a
+	// layout switch or a replica needs trees of their own.
+	std::unique_ptr<BVHCacheFile> bvhCache;
+	bool lazy = false;
+	std::string bvhCachePath;
+
+	bool loadObj(const std::string& path);
+	void buildBVH();
+	void setLayout(BVHLayout layout);
+	void requireBVH();
+	void expandInBackground();
+	bool pollExpansion();
+	bool isExpanding() const;
+	bool measureMemory();
+	int appendThreaded(std::vector<vec4>& nodeData, std::vector<int>& primitiveData, int primitiveOffset) const;
+	Mesh replicate() const;
+	AABB triangleBounds(int triangle) const;
+	vec3 triangleNormal(int triangle) const;
+	float intersectTriangle(const WatertightRay& ray, int triangle, float tMax) const;
+	int intersect(vec3 origin, vec3 direction, float& tMax, bool anyHit = false) const;
+	void intersectPacket(RayPacket& packet, int* closestTriangles) const;
+private:
+	uint64_t bvhCacheKey = 0;
+	std::future<BVH> pendingExpansion;
+	std::vector<AABB> allTriangleBounds() const;
+	void saveBVH();
+	void copyBVHCache();
+};
@@ -0,0 +1,105 @@
+#include "Numa.h"
+#include <algorithm>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <string>
+#endif
+
+static thread_local int pinnedNode = 0;
+
+#ifndef _WIN32
+// Parses a sysfs cpu list such as "0-7,16-23".
+static std::vector<int> parseCpuList(const std::string& list)
+{
+	std::vector<int> cpus;
+	size_t start = 0;
+	while (start < list.size())
+	{
+		size_t end = list.find(',', start);
+		std::string range = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		size_t dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+		start = end == std::string::npos ? list.size() : end + 1;
+	}
+	return cpus;
+}
+#endif
+
+NumaTopology detectNumaTopology()
+{
+	NumaTopology topology;
+	topology.numNodes = 0;
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode))
+	{
+		for (USHORT node = 0; node <= highestNode && topology.numNodes < maxNumaNodes; node++)
+		{
+			GROUP_AFFINITY affinity;
+			if (!GetNumaNodeProcessorMaskEx(node, &affinity) || affinity.Mask == 0)
+				continue;
+			for (int bit = 0; bit < int(sizeof(KAFFINITY) * 8); bit++)
+				if (affinity.Mask & (KAFFINITY(1) << bit))
+					topology.processors.push_back({ int(affinity.Group), bit, topology.numNodes });
+			topology.numNodes++;
+		}
+	}
+#else
+	for (int node = 0; topology.numNodes < maxNumaNodes; node++)
+	{
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string list;
+		if (!file || !std::getline(file, list))
+			break;
+		if (list.empty())
+			continue;
+		for (int cpu : parseCpuList(list))
+			topology.processors.push_back({ 0, cpu, topology.numNodes });
+		topology.numNodes++;
+	}
+#endif
+
+	if (topology.processors.empty())
+	{
+		int numProcessors = std::max(1, int(std::thread::hardware_concurrency()));
+		for (int i = 0; i < numProcessors; i++)
+			topology.processors.push_back({ 0, i, 0 });
+		topology.numNodes = 1;
+	}
+	return topology;
+}
+
+bool pinCurrentThread(const Processor& processor)
+{
+#ifdef _WIN32
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(processor.group);
+	affinity.Mask = KAFFINITY(1) << processor.index;
+	if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr))
+		return false;
+#else
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(processor.index, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		return false;
+#endif
+	pinnedNode = processor.node;
+	return true;
+}
+
+int currentNumaNode()
+{
+	return pinnedNode;
+}
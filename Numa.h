@@ -0,0 +1,24 @@
+#pragma once
+#include <vector>
+
+const int maxNumaNodes = 8;
+
+struct Processor
+{
+	int group;
+	int index;
+	int node;
+};
+
+// The logical processors of the machine listed node by node. Machines or platforms that do not
+// report their NUMA layout appear as a single node holding every processor.
+struct NumaTopology
+{
+	std::vector<Processor> processors;
+	int numNodes;
+};
+
+NumaTopology detectNumaTopology();
+bool pinCurrentThread(const Processor& processor);
+// The node the calling thread was pinned to, 0 for threads that never were.
+int currentNumaNode();
@@ -0,0 +1,98 @@
+#include "PrimitiveRegistry.h"
+#include <iostream>
+
+using namespace std;
+
+template <typename T>
+static string maxCountName()
+{
+	return "maxN" + primitiveCountName<T>().substr(1);
+}
+
+template <typename T>
+static void appendDeclarations(string& glsl)
+{
+	string name = PrimitiveTraits<T>::name();
+	glsl += "const int " + maxCountName<T>() + " = " + to_string(PrimitiveTraits<T>::maxCount) + ";\n";
+	glsl += "struct " + name + "\n{\n" + PrimitiveTraits<T>::glslFields() + "};\n";
+	glsl += "uniform " + name + " " + PrimitiveTraits<T>::arrayName() + "[" + maxCountName<T>() + "];\n";
+	glsl += "uniform int " + primitiveCountName<T>() + ";\n";
+}
+
+struct GlslFunctions
+{
+	string intersections;
+	string loops;
+	string tracedLoops;
+	string hitByType;
+	string materialByType;
+};
+
+template <typename T>
+static void appendFunction(GlslFunctions& functions)
+{
+	string name = PrimitiveTraits<T>::name();
+	string arrayName = PrimitiveTraits<T>::arrayName();
+	string variable = name;
+	variable[0] = char(tolower(variable[0]));
+	functions.intersections += "HitInfo hit" + name + "(Ray ray, " + name + " " + variable + ")\n{\n" + PrimitiveTraits<T>::glslBody() + "}\n\n";
+
+	string loop = "    for (int i = 0; i < " + primitiveCountName<T>() + "; i++)\n    {\n";
+	loop += "        HitInfo hitInfo = hit" + name + "(ray, " + arrayName + "[i]);\n";
+	loop += "        if (hitInfo.hasHit && hitInfo.t < closestHit.t) closestHit = hitInfo;\n    }\n";
+	functions.loops += loop;
+	if (!PrimitiveTraits<T>::isRasterized)
+		functions.tracedLoops += loop;
+
+	string type = to_string(primitiveTypeId<T>());
+	functions.hitByType += "    if (hitType == " + type + ") return hit" + name + "(ray, " + arrayName + "[index]);\n";
+	functions.materialByType += "    if (hitType == " + type + ") return " + arrayName + "[index].material;\n";
+}
+
+// The hitTypes after the primitives' are the instances' and the meshes', which the G-buffer stores
+// as well.
+template <typename... Types>
+static string glslDeclarations(TypeList<Types...>)
+{
+	string glsl;
+	(void)std::initializer_list<int>{ (appendDeclarations<Types>(glsl), 0)... };
+	glsl += "const int instanceHitType = " + to_string(instanceHitType) + ";\n";
+	glsl += "const int meshHitType = " + to_string(meshHitType) + ";\n";
+	return glsl;
+}
+
+// The shader has no sphere BVH, so unlike the CPU it loops over every type. hitTracedPrimitives
+// loops over the types the G-buffer pass does not rasterize, and hitPrimitive and
+// primitiveMaterial look a primitive up by the hitType and index the G-buffer stores.
+template <typename... Types>
+static string glslFunctions(TypeList<Types...>)
+{
+	GlslFunctions functions;
+	(void)std::initializer_list<int>{ (appendFunction<Types>(functions), 0)... };
+	return functions.intersections +
+		"HitInfo hitPrimitives(Ray ray, HitInfo closestHit)\n{\n" + functions.loops + "    return closestHit;\n}\n\n" +
+		"HitInfo hitTracedPrimitives(Ray ray, HitInfo closestHit)\n{\n" + functions.tracedLoops + "    return closestHit;\n}\n\n" +
+		"HitInfo hitPrimitive(Ray ray, int hitType, int index)\n{\n" + functions.hitByType + "    return nullHitInfo;\n}\n\n" +
+		"Material primitiveMaterial(int hitType, int index)\n{\n" + functions.materialByType + "    return nullMaterial;\n}\n";
+}
+
+static bool replaceLine(string& source, const string& marker, const string& replacement)
+{
+	size_t position = source.find(marker);
+	if (position == string::npos)
+	{
+		cout << "Shader has no " << marker << " line" << endl;
+		return false;
+	}
+	source.replace(position, marker.size(), replacement);
+	return true;
+}
+
+// Fills in the marker lines of the fragment shader with the structs, uniform arrays, intersection
+// functions and hitPrimitives loop generated from ScenePrimitives.
+string insertPrimitiveGlsl(string source)
+{
+	replaceLine(source, primitiveDeclarationsMarker, glslDeclarations(ScenePrimitives()));
+	replaceLine(source, primitiveFunctionsMarker, glslFunctions(ScenePrimitives()));
+	return source;
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include "Primitives.h"
+#include <cctype>
+#include <initializer_list>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+template <typename... Types>
+struct TypeList
+{
+	static const int size = sizeof...(Types);
+};
+
+template <typename T, typename List>
+struct TypeIndex;
+
+template <typename T, typename... Types>
+struct TypeIndex<T, TypeList<T, Types...>> : std::integral_constant<int, 0>
+{};
+
+template <typename T, typename First, typename... Types>
+struct TypeIndex<T, TypeList<First, Types...>> : std::integral_constant<int, 1 + TypeIndex<T, TypeList<Types...>>::value>
+{};
+
+// Every analytic primitive the scene can hold. A primitive's position in this list is the hitType
+// it is picked by, so adding one is a matter of defining the struct and its PrimitiveTraits and
+// appending it here; storage, CPU intersection loops, uniforms, the GLSL and the editor follow
+// from the list.
+typedef TypeList<Sphere, Plane, Disc, Box, Triangle> ScenePrimitives;
+
+const int numPrimitiveTypes = ScenePrimitives::size;
+const int instanceHitType = numPrimitiveTypes;
+const int meshHitType = numPrimitiveTypes + 1;
+
+template <typename T>
+constexpr int primitiveTypeId()
+{
+	return TypeIndex<T, ScenePrimitives>::value;
+}
+
+// The CPU kernel of T, with the result tagged for picking.
+template <typename T>
+HitInfo hitPrimitive(const Ray& ray, const T& primitive)
+{
+	HitInfo hitInfo = PrimitiveTraits<T>::intersect(ray, primitive);
+	hitInfo.hitIndex = primitive.index;
+	hitInfo.hitType = primitiveTypeId<T>();
+	return hitInfo;
+}
+
+// numSpheres for spheres, and so on.
+template <typename T>
+std::string primitiveCountName()
+{
+	std::string arrayName = PrimitiveTraits<T>::arrayName();
+	arrayName[0] = char(toupper(arrayName[0]));
+	return "num" + arrayName;
+}
+
+template <typename T>
+struct PrimitiveArray
+{
+	T items[PrimitiveTraits<T>::maxCount];
+	int count = 0;
+};
+
+// One fixed size array per primitive type, the same layout as the shader's uniform arrays. All
+// loops over the types are expanded at compile time, so tracing a type costs its own loop and
+// nothing else: there is no virtual call or switch on the type per ray.
+//
+// Each array holds whole structs rather than one array per field. The arrays are at most a few
+// dozen entries long, spheres are reached through their BVH one index at a time, and the editor
+// and the G-buffer pass read and write primitives in place, all of which want the struct.
+template <typename List>
+class PrimitiveStore;
+
+template <typename... Types>
+class PrimitiveStore<TypeList<Types...>>
+{
+public:
+	template <typename T>
+	PrimitiveArray<T>& get()
+	{
+		return std::get<PrimitiveArray<T>>(arrays);
+	}
+
+	template <typename T>
+	const PrimitiveArray<T>& get() const
+	{
+		return std::get<PrimitiveArray<T>>(arrays);
+	}
+
+	// Returns the new primitive's index, or -1 when its array is full.
+	template <typename T>
+	int add(T primitive)
+	{
+		PrimitiveArray<T>& array = get<T>();
+		if (array.count == PrimitiveTraits<T>::maxCount)
+			return -1;
+		primitive.index = array.count;
+		array.items[array.count] = primitive;
+		return array.count++;
+	}
+
+	// Replaces closestHit with any nearer hit among the types traced by a plain loop. With anyHit
+	// it stops at the first hit nearer than closestHit.
+	void hitClosest(const Ray& ray, HitInfo& closestHit, bool anyHit) const
+	{
+		(void)std::initializer_list<int>{ (hitArray<Types>(ray, closestHit, anyHit, std::integral_constant<bool, PrimitiveTraits<Types>::hasOwnTraversal>()), 0)... };
+	}
+
+	void upload(GLuint program) const
+	{
+		(void)std::initializer_list<int>{ (uploadArray<Types>(program), 0)... };
+	}
+private:
+	std::tuple<PrimitiveArray<Types>...> arrays;
+
+	template <typename T>
+	void hitArray(const Ray&, HitInfo&, bool, std::true_type) const
+	{}
+
+	template <typename T>
+	void hitArray(const Ray& ray, HitInfo& closestHit, bool anyHit, std::false_type) const
+	{
+		const PrimitiveArray<T>& array = get<T>();
+		for (int i = 0; i < array.count && !(anyHit && closestHit.hasHit); i++)
+		{
+			HitInfo hitInfo = hitPrimitive(ray, array.items[i]);
+			if (hitInfo.hasHit && hitInfo.t < closestHit.t)
+				closestHit = hitInfo;
+		}
+	}
+
+	template <typename T>
+	void uploadArray(GLuint program) const
+	{
+		const PrimitiveArray<T>& array = get<T>();
+		glUniform1i(glGetUniformLocation(program, primitiveCountName<T>().c_str()), array.count);
+		for (int i = 0; i < array.count; i++)
+			PrimitiveTraits<T>::setUniforms(program, std::string(PrimitiveTraits<T>::arrayName()) + "[" + std::to_string(i) + "]", array.items[i]);
+	}
+};
+
+// The shader marks where the generated code goes with a line holding only one of these. The
+// declarations need Ray, Material and HitInfo above them; the functions need nullMaterial and
+// nullHitInfo.
+const char* const primitiveDeclarationsMarker = "// <primitive declarations>";
+const char* const primitiveFunctionsMarker = "// <primitive functions>";
+
+std::string insertPrimitiveGlsl(std::string source);
@@ -0,0 +1,277 @@
+#include "Primitives.h"
+#include "imgui.h"
+#include <algorithm>
+
+using namespace std;
+
+HitInfo nullHitInfo = HitInfo(false, FLT_MAX, Material(vec3(0.0, 0.0, 0.0), 0.5, 0.0), vec3(0.0, 0.0, 0.0), 0, 0);
+
+vec3 rayPoint(Ray ray, float t)
+{
+	return ray.origin + ray.direction * t;
+}
+
+static void setMaterialUniforms(GLuint program, const string& prefix, const Material& material)
+{
+	glUniform3f(glGetUniformLocation(program, (prefix + ".material.color").c_str()), material.color.x, material.color.y, material.color.z);
+	glUniform1f(glGetUniformLocation(program, (prefix + ".material.roughness").c_str()), material.roughness);
+	glUniform1f(glGetUniformLocation(program, (prefix + ".material.transmission").c_str()), material.transmission);
+	glUniform1f(glGetUniformLocation(program, (prefix + ".material.emission").c_str()), material.emission);
+}
+
+static void setVectorUniform(GLuint program, const string& name, vec3 value)
+{
+	glUniform3f(glGetUniformLocation(program, name.c_str()), value.x, value.y, value.z);
+}
+
+// Each intersection is written once and expanded both as the C++ intersect() and, stringized, as
+// the GLSL body, so the CPU and GPU renderers cannot drift apart. The body must therefore stay in
+// the common subset of the two languages: f suffixed literals, glm/GLSL functions and no comments.
+#define PRIMITIVE_INTERSECTION(T, variable, ...) \
+	HitInfo PrimitiveTraits<T>::intersect(const Ray& ray, const T& variable) \
+	{ \
+		using glm::min; using glm::max; using glm::abs; \
+		__VA_ARGS__ \
+	} \
+	const char* PrimitiveTraits<T>::glslBody() \
+	{ \
+		return "    " #__VA_ARGS__ "\n"; \
+	}
+
+const char* PrimitiveTraits<Sphere>::glslFields()
+{
+	return
+		"    vec3 origin;\n"
+		"    float radius;\n"
+		"    Material material;\n"
+		"    bool isVisible;\n";
+}
+
+PRIMITIVE_INTERSECTION(Sphere, sphere,
+	if (!sphere.isVisible)
+		return nullHitInfo;
+
+	vec3 rayOrigin = ray.origin - sphere.origin;
+	vec3 rayDirection = ray.direction;
+
+	float rayDirectionLength = length(rayDirection);
+	float rayOriginLength = length(rayOrigin);
+
+	float a = rayDirectionLength * rayDirectionLength;
+	float b = 2.0f * dot(rayDirection, rayOrigin);
+	float c = rayOriginLength * rayOriginLength - sphere.radius * sphere.radius;
+
+	float d = b * b - 4.0f * a * c;
+
+	if (d < 0.0f)
+		return nullHitInfo;
+
+	float t1 = (-b + sqrt(d)) / (2.0f * a);
+	float t2 = (-b - sqrt(d)) / (2.0f * a);
+
+	float t = t2 > 0.001f ? t2 : t1;
+	if (t <= 0.001f)
+		return nullHitInfo;
+
+	return HitInfo(true, t, sphere.material, rayPoint(ray, t) - sphere.origin);
+)
+
+void PrimitiveTraits<Sphere>::setUniforms(GLuint program, const string& prefix, const Sphere& sphere)
+{
+	setVectorUniform(program, prefix + ".origin", sphere.origin);
+	glUniform1f(glGetUniformLocation(program, (prefix + ".radius").c_str()), sphere.radius);
+	setMaterialUniforms(program, prefix, sphere.material);
+	glUniform1i(glGetUniformLocation(program, (prefix + ".isVisible").c_str()), sphere.isVisible);
+}
+
+bool PrimitiveTraits<Sphere>::gui(Sphere& sphere, const string& index)
+{
+	bool changed = ImGui::InputFloat3(string("Origin ").append(index).c_str(), &sphere.origin.x, 0);
+	changed |= ImGui::InputFloat(string("Radius ").append(index).c_str(), &sphere.radius, 0);
+	return changed;
+}
+
+const char* PrimitiveTraits<Plane>::glslFields()
+{
+	return
+		"    vec3 origin;\n"
+		"    vec3 normal;\n"
+		"    Material material;\n"
+		"    bool isVisible;\n";
+}
+
+PRIMITIVE_INTERSECTION(Plane, plane,
+	if (!plane.isVisible)
+		return nullHitInfo;
+
+	float dn = dot(ray.direction, plane.normal);
+	if (dn == 0.0f) return nullHitInfo;
+
+	float t = dot(plane.origin - ray.origin, plane.normal) / dn;
+	if (t < 0.001f)
+		return nullHitInfo;
+
+	return HitInfo(true, t, plane.material, plane.normal);
+)
+
+void PrimitiveTraits<Plane>::setUniforms(GLuint program, const string& prefix, const Plane& plane)
+{
+	setVectorUniform(program, prefix + ".origin", plane.origin);
+	setVectorUniform(program, prefix + ".normal", plane.normal);
+	setMaterialUniforms(program, prefix, plane.material);
+	glUniform1i(glGetUniformLocation(program, (prefix + ".isVisible").c_str()), plane.isVisible);
+}
+
+bool PrimitiveTraits<Plane>::gui(Plane& plane, const string& index)
+{
+	bool changed = ImGui::InputFloat3(string("Origin ").append(index).c_str(), &plane.origin.x, 0);
+	changed |= ImGui::InputFloat3(string("Normal ").append(index).c_str(), &plane.normal.x, 0);
+	return changed;
+}
+
+const char* PrimitiveTraits<Disc>::glslFields()
+{
+	return
+		"    vec3 origin;\n"
+		"    vec3 normal;\n"
+		"    float radius;\n"
+		"    Material material;\n"
+		"    bool isVisible;\n";
+}
+
+// A plane hit that is also within radius of the centre.
+PRIMITIVE_INTERSECTION(Disc, disc,
+	if (!disc.isVisible)
+		return nullHitInfo;
+
+	float dn = dot(ray.direction, disc.normal);
+	if (dn == 0.0f) return nullHitInfo;
+
+	float t = dot(disc.origin - ray.origin, disc.normal) / dn;
+	vec3 offset = rayPoint(ray, t) - disc.origin;
+	if (t < 0.001f || dot(offset, offset) > disc.radius * disc.radius)
+		return nullHitInfo;
+
+	return HitInfo(true, t, disc.material, disc.normal);
+)
+
+void PrimitiveTraits<Disc>::setUniforms(GLuint program, const string& prefix, const Disc& disc)
+{
+	setVectorUniform(program, prefix + ".origin", disc.origin);
+	setVectorUniform(program, prefix + ".normal", disc.normal);
+	glUniform1f(glGetUniformLocation(program, (prefix + ".radius").c_str()), disc.radius);
+	setMaterialUniforms(program, prefix, disc.material);
+	glUniform1i(glGetUniformLocation(program, (prefix + ".isVisible").c_str()), disc.isVisible);
+}
+
+bool PrimitiveTraits<Disc>::gui(Disc& disc, const string& index)
+{
+	bool changed = ImGui::InputFloat3(string("Origin ").append(index).c_str(), &disc.origin.x, 0);
+	changed |= ImGui::InputFloat3(string("Normal ").append(index).c_str(), &disc.normal.x, 0);
+	changed |= ImGui::InputFloat(string("Radius ").append(index).c_str(), &disc.radius, 0);
+	return changed;
+}
+
+const char* PrimitiveTraits<Box>::glslFields()
+{
+	return
+		"    vec3 boundsMin;\n"
+		"    vec3 boundsMax;\n"
+		"    Material material;\n"
+		"    bool isVisible;\n";
+}
+
+// Slab test against the axis aligned box. A ray starting inside hits the exit face. The normal is
+// the axis along which the hit point lies furthest out, relative to the box's extent.
+PRIMITIVE_INTERSECTION(Box, box,
+	if (!box.isVisible)
+		return nullHitInfo;
+
+	vec3 t1 = (box.boundsMin - ray.origin) / ray.direction;
+	vec3 t2 = (box.boundsMax - ray.origin) / ray.direction;
+	vec3 tNear = min(t1, t2);
+	vec3 tFar = max(t1, t2);
+	float tEnter = max(max(tNear.x, tNear.y), tNear.z);
+	float tExit = min(min(tFar.x, tFar.y), tFar.z);
+	if (tEnter > tExit || tExit < 0.001f)
+		return nullHitInfo;
+
+	float t = tEnter > 0.001f ? tEnter : tExit;
+	vec3 local = (rayPoint(ray, t) - (box.boundsMin + box.boundsMax) * 0.5f) / max(box.boundsMax - box.boundsMin, vec3(0.000001f));
+	vec3 absLocal = abs(local);
+	vec3 normal = vec3(0.0f, 0.0f, sign(local.z));
+	if (absLocal.x > absLocal.y && absLocal.x > absLocal.z)
+		normal = vec3(sign(local.x), 0.0f, 0.0f);
+	else if (absLocal.y > absLocal.z)
+		normal = vec3(0.0f, sign(local.y), 0.0f);
+	return HitInfo(true, t, box.material, normal);
+)
+
+void PrimitiveTraits<Box>::setUniforms(GLuint program, const string& prefix, const Box& box)
+{
+	setVectorUniform(program, prefix + ".boundsMin", box.boundsMin);
+	setVectorUniform(program, prefix + ".boundsMax", box.boundsMax);
+	setMaterialUniforms(program, prefix, box.material);
+	glUniform1i(glGetUniformLocation(program, (prefix + ".isVisible").c_str()), box.isVisible);
+}
+
+bool PrimitiveTraits<Box>::gui(Box& box, const string& index)
+{
+	bool changed = ImGui::InputFloat3(string("Bounds Min ").append(index).c_str(), &box.boundsMin.x, 0);
+	changed |= ImGui::InputFloat3(string("Bounds Max ").append(index).c_str(), &box.boundsMax.x, 0);
+	return changed;
+}
+
+const char* PrimitiveTraits<Triangle>::glslFields()
+{
+	return
+		"    vec3 a;\n"
+		"    vec3 b;\n"
+		"    vec3 c;\n"
+		"    Material material;\n"
+		"    bool isVisible;\n";
+}
+
+// Möller-Trumbore, two sided, with the normal turned towards the ray the way mesh hits are.
+PRIMITIVE_INTERSECTION(Triangle, triangle,
+	if (!triangle.isVisible)
+		return nullHitInfo;
+
+	vec3 edge1 = triangle.b - triangle.a;
+	vec3 edge2 = triangle.c - triangle.a;
+	vec3 p = cross(ray.direction, edge2);
+	float determinant = dot(edge1, p);
+	if (abs(determinant) < 0.0000001f)
+		return nullHitInfo;
+
+	float inverseDeterminant = 1.0f / determinant;
+	vec3 s = ray.origin - triangle.a;
+	float u = dot(s, p) * inverseDeterminant;
+	vec3 q = cross(s, edge1);
+	float v = dot(ray.direction, q) * inverseDeterminant;
+	float t = dot(edge2, q) * inverseDeterminant;
+	if (u < 0.0f || v < 0.0f || u + v > 1.0f || t < 0.001f)
+		return nullHitInfo;
+
+	vec3 normal = normalize(cross(edge1, edge2));
+	if (dot(normal, ray.direction) > 0.0f)
+		normal = -normal;
+	return HitInfo(true, t, triangle.material, normal);
+)
+
+void PrimitiveTraits<Triangle>::setUniforms(GLuint program, const string& prefix, const Triangle& triangle)
+{
+	setVectorUniform(program, prefix + ".a", triangle.a);
+	setVectorUniform(program, prefix + ".b", triangle.b);
+	setVectorUniform(program, prefix + ".c", triangle.c);
+	setMaterialUniforms(program, prefix, triangle.material);
+	glUniform1i(glGetUniformLocation(program, (prefix + ".isVisible").c_str()), triangle.isVisible);
+}
+
+bool PrimitiveTraits<Triangle>::gui(Triangle& triangle, const string& index)
+{
+	bool changed = ImGui::InputFloat3(string("Vertex A ").append(index).c_str(), &triangle.a.x, 0);
+	changed |= ImGui::InputFloat3(string("Vertex B ").append(index).c_str(), &triangle.b.x, 0);
+	changed |= ImGui::InputFloat3(string("Vertex C ").append(index).c_str(), &triangle.c.x, 0);
+	return changed;
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <glm.hpp>
+#include <glad/glad.h>
+#include <string>
+#include <climits>
+#include <cfloat>
+
+using namespace glm;
+
+const int maxNumSpheres = 64;
+const int maxNumPlanes = 64;
+const int maxNumDiscs = 16;
+const int maxNumBoxes = 16;
+const int maxNumTriangles = 64;
+
+struct Ray
+{
+    vec3 origin;
+    vec3 direction;
+    Ray(vec3 origin, vec3 direction) : origin(origin), direction(direction) {};
+};
+
+struct Material
+{
+    vec3 color;
+    float roughness;
+    float transmission;
+    float emission;
+    Material(vec3 color = vec3(0.0), float roughness = 0.0, float transmission = 0.0, float emission = 0.0) : color(color), roughness(roughness), transmission(transmission), emission(emission)
+    {}
+};
+
+struct Plane
+{
+    vec3 origin;
+    vec3 normal;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    Plane(vec3 origin = vec3(0.0), vec3 normal = vec3(0.0), Material material = Material(), bool isVisible = false) : origin(origin), normal(normal), material(material), isVisible(isVisible)
+    {}
+};
+struct Sphere
+{
+    vec3 origin;
+    float radius;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    Sphere(vec3 origin = vec3(0.0), float radius = 0.0, Material material = Material(), bool isVisible = false) : origin(origin), radius(radius), material(material), isVisible(isVisible)
+    {}
+};
+struct Disc
+{
+    vec3 origin;
+    vec3 normal;
+    float radius;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    Disc(vec3 origin = vec3(0.0), vec3 normal = vec3(0.0, 1.0, 0.0), float radius = 0.0, Material material = Material(), bool isVisible = false) : origin(origin), normal(normal), radius(radius), material(material), isVisible(isVisible)
+    {}
+};
+struct Box
+{
+    vec3 boundsMin;
+    vec3 boundsMax;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    Box(vec3 boundsMin = vec3(0.0), vec3 boundsMax = vec3(0.0), Material material = Material(), bool isVisible = false) : boundsMin(boundsMin), boundsMax(boundsMax), material(material), isVisible(isVisible)
+    {}
+};
+struct Triangle
+{
+    vec3 a;
+    vec3 b;
+    vec3 c;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    Triangle(vec3 a = vec3(0.0), vec3 b = vec3(0.0), vec3 c = vec3(0.0), Material material = Material(), bool isVisible = false) : a(a), b(b), c(c), material(material), isVisible(isVisible)
+    {}
+};
+
+struct HitInfo
+{
+    bool hasHit;
+    float t;
+    Material material;
+    vec3 hitNormal;
+    int hitIndex;
+    int hitType;
+    HitInfo(bool hasHit = false, float t = FLT_MAX, Material material = Material(), vec3 hitNormal = vec3(0.0), int hitIndex = 0, int hitType = 0) : hasHit(hasHit), t(t), material(material), hitNormal(hitNormal), hitIndex(hitIndex), hitType(hitType) 
+    {};
+};
+
+extern HitInfo nullHitInfo;
+vec3 rayPoint(Ray ray, float t);
+
+// Everything the registry in PrimitiveRegistry.h needs to know about one primitive type: the
+// names and capacity of its uniform array, whether the CPU traces it through a traversal of its
+// own rather than a loop over the array, whether the G-buffer pass rasterizes it for the GPU's
+// primary rays, the GLSL struct fields and intersection function body, the CPU intersection
+// kernel, the uniform upload and the editor fields for its shape, which return whether the shape
+// changed. The GLSL body sees ray and the primitive as a variable named after the type in lower
+// case, like the CPU kernel.
+template <typename T>
+struct PrimitiveTraits;
+
+template <>
+struct PrimitiveTraits<Sphere>
+{
+    static const int maxCount = maxNumSpheres;
+    static const bool hasOwnTraversal = true;
+    static const bool isRasterized = true;
+    static const char* name() { return "Sphere"; }
+    static const char* arrayName() { return "spheres"; }
+    static const char* glslFields();
+    static const char* glslBody();
+    static HitInfo intersect(const Ray& ray, const Sphere& sphere);
+    static void setUniforms(GLuint program, const std::string& prefix, const Sphere& sphere);
+    static bool gui(Sphere& sphere, const std::string& index);
+};
+
+template <>
+struct PrimitiveTraits<Plane>
+{
+    static const int maxCount = maxNumPlanes;
+    static const bool hasOwnTraversal = false;
+    static const bool isRasterized = true;
+    static const char* name() { return "Plane"; }
+    static const char* arrayName() { return "planes"; }
+    static const char* glslFields();
+    static const char* glslBody();
+    static HitInfo intersect(const Ray& ray, const Plane& plane);
+    static void setUniforms(GLuint program, const std::string& prefix, const Plane& plane);
+    static bool gui(Plane& plane, const std::string& index);
+};
+
+template <>
+struct PrimitiveTraits<Disc>
+{
+    static const int maxCount = maxNumDiscs;
+    static const bool hasOwnTraversal = false;
+    static const bool isRasterized = false;
+    static const char* name() { return "Disc"; }
+    static const char* arrayName() { return "discs"; }
+    static const char* glslFields();
+    static const char* glslBody();
+    static HitInfo intersect(const Ray& ray, const Disc& disc);
+    static void setUniforms(GLuint program, const std::string& prefix, const Disc& disc);
+    static bool gui(Disc& disc, const std::string& index);
+};
+
+template <>
+struct PrimitiveTraits<Box>
+{
+    static const int maxCount = maxNumBoxes;
+    static const bool hasOwnTraversal = false;
+    static const bool isRasterized = false;
+    static const char* name() { return "Box"; }
+    static const char* arrayName() { return "boxes"; }
+    static const char* glslFields();
+    static const char* glslBody();
+    static HitInfo intersect(const Ray& ray, const Box& box);
+    static void setUniforms(GLuint program, const std::string& prefix, const Box& box);
+    static bool gui(Box& box, const std::string& index);
+};
+
+template <>
+struct PrimitiveTraits<Triangle>
+{
+    static const int maxCount = maxNumTriangles;
+    static const bool hasOwnTraversal = false;
+    static const bool isRasterized = false;
+    static const char* name() { return "Triangle"; }
+    static const char* arrayName() { return "triangles"; }
+    static const char* glslFields();
+    static const char* glslBody();
+    static HitInfo intersect(const Ray& ray, const Triangle& triangle);
+    static void setUniforms(GLuint program, const std::string& prefix, const Triangle& triangle);
+    static bool gui(Triangle& triangle, const std::string& index);
+};
@@ -0,0 +1,118 @@
+#include "RayPacket.h"
+#include <algorithm>
+
+static const float minDirectionCosine = 0.95f;
+static const float maxOriginSpread = 0.1f;
+
+void RayPacket::add(vec3 origin, vec3 direction, float tMax)
+{
+	origins[count] = origin;
+	directions[count] = direction;
+	this->tMax[count] = tMax;
+	count++;
+}
+
+// Rays that all point into one octant are what the culling test needs, but that alone lets a
+// packet with widely spread origins or directions through, and its bounds then overlap most of
+// the tree. Such packets are marked incoherent so that they are traced one ray at a time, and are
+// rejected at the first ray that gives them away, before any of the traversal state is set up.
+void RayPacket::finalize()
+{
+	isCoherent = false;
+	if (count == 0)
+		return;
+
+	originMin = vec3(FLT_MAX);
+	originMax = vec3(-FLT_MAX);
+	meanDirection = vec3(0.0);
+	float minT = FLT_MAX;
+	for (int i = 0; i < count; i++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+			if (directions[i][axis] == 0.0f || (directions[i][axis] > 0.0f) != (directions[0][axis] > 0.0f))
+				return;
+		originMin = min(originMin, origins[i]);
+		originMax = max(originMax, origins[i]);
+		meanDirection += directions[i];
+		minT = std::min(minT, tMax[i]);
+	}
+	if (length(originMax - originMin) > maxOriginSpread * minT)
+		return;
+	meanDirection = normalize(meanDirection);
+	for (int i = 0; i < count; i++)
+		if (dot(directions[i], meanDirection) < minDirectionCosine)
+			return;
+	isCoherent = true;
+
+	// The unused lanes of the last group of four get rays that miss everything.
+	inverseMin = vec3(FLT_MAX);
+	inverseMax = vec3(-FLT_MAX);
+	for (int i = 0; i < count; i++)
+	{
+		rays[i] = WideRay(origins[i], directions[i]);
+		inverseMin = min(inverseMin, rays[i].inverseDirection);
+		inverseMax = max(inverseMax, rays[i].inverseDirection);
+		originX[i] = origins[i].x;
+		originY[i] = origins[i].y;
+		originZ[i] = origins[i].z;
+		inverseX[i] = rays[i].inverseDirection.x;
+		inverseY[i] = rays[i].inverseDirection.y;
+		inverseZ[i] = rays[i].inverseDirection.z;
+	}
+	for (int i = count; i < (count + 3) / 4 * 4; i++)
+	{
+		originX[i] = originY[i] = originZ[i] = 0.0f;
+		inverseX[i] = inverseY[i] = inverseZ[i] = 0.0f;
+		tMax[i] = -1.0f;
+	}
+}
+
+float RayPacket::maxT(uint32_t rays) const
+{
+	float t = 0.0f;
+	for (; rays != 0; rays &= rays - 1)
+		t = std::max(t, tMax[lowestBit(rays)]);
+	return t;
+}
+
+// The candidates among the rays whose interval up to their tMax overlaps the box, tested four
+// rays at a time.
+uint32_t RayPacket::hitRays(vec3 boxMin, vec3 boxMax, uint32_t candidates) const
+{
+	uint32_t mask = 0;
+#ifdef WIDE_BVH_SSE
+	__m128 minX = _mm_set1_ps(boxMin.x), minY = _mm_set1_ps(boxMin.y), minZ = _mm_set1_ps(boxMin.z);
+	__m128 maxX = _mm_set1_ps(boxMax.x), maxY = _mm_set1_ps(boxMax.y), maxZ = _mm_set1_ps(boxMax.z);
+	for (int i = 0; i < count; i += 4)
+	{
+		if (((candidates >> i) & 0xf) == 0)
+			continue;
+		__m128 oX = _mm_load_ps(originX + i), oY = _mm_load_ps(originY + i), oZ = _mm_load_ps(originZ + i);
+		__m128 iX = _mm_load_ps(inverseX + i), iY = _mm_load_ps(inverseY + i), iZ = _mm_load_ps(inverseZ + i);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(minX, oX), iX);
+		__m128 tx2 = _mm_mul_ps(_mm_sub_ps(maxX, oX), iX);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(minY, oY), iY);
+		__m128 ty2 = _mm_mul_ps(_mm_sub_ps(maxY, oY), iY);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(minZ, oZ), iZ);
+		__m128 tz2 = _mm_mul_ps(_mm_sub_ps(maxZ, oZ), iZ);
+		__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_max_ps(_mm_min_ps(tz1, tz2), _mm_setzero_ps()));
+		__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_min_ps(_mm_max_ps(tz1, tz2), _mm_load_ps(tMax + i)));
+		mask |= uint32_t(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar))) << i;
+	}
+#else
+	for (int i = 0; i < count; i++)
+	{
+		float tx1 = (boxMin.x - originX[i]) * inverseX[i];
+		float tx2 = (boxMax.x - originX[i]) * inverseX[i];
+		float ty1 = (boxMin.y - originY[i]) * inverseY[i];
+		float ty2 = (boxMax.y - originY[i]) * inverseY[i];
+		float tz1 = (boxMin.z - originZ[i]) * inverseZ[i];
+		float tz2 = (boxMax.z - originZ[i]) * inverseZ[i];
+		float tNear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0f));
+		float tFar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), tMax[i]));
+		if (tNear <= tFar)
+			mask |= 1u << i;
+	}
+#endif
+	return mask & candidates;
+}
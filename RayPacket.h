@@ -0,0 +1,203 @@
+#pragma once
+#include "WideBVH.h"
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+const int packetWidth = 4;
+const int packetSize = packetWidth * packetWidth;
+
+// Index of the lowest set bit of a non-zero mask.
+inline int lowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return int(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Up to packetSize rays traced together. Next to the rays themselves the packet keeps them as
+// structure of arrays, so one box is tested against four rays at a time, and the bounds of their
+// origins and inverse directions for culling. finalize() decides whether the packet is coherent
+// enough to trace together; the others have to be traced one ray at a time.
+struct RayPacket
+{
+	vec3 origins[packetSize];
+	vec3 directions[packetSize];
+	WideRay rays[packetSize];
+	alignas(16) float tMax[packetSize];
+	alignas(16) float originX[packetSize];
+	alignas(16) float originY[packetSize];
+	alignas(16) float originZ[packetSize];
+	alignas(16) float inverseX[packetSize];
+	alignas(16) float inverseY[packetSize];
+	alignas(16) float inverseZ[packetSize];
+	int count = 0;
+	vec3 originMin, originMax;
+	vec3 inverseMin, inverseMax;
+	vec3 meanDirection;
+	bool isCoherent = false;
+
+	void add(vec3 origin, vec3 direction, float tMax);
+	void finalize();
+	float maxT(uint32_t rays) const;
+	uint32_t hitRays(vec3 boxMin, vec3 boxMax, uint32_t candidates) const;
+};
+
+// With every inverse direction on one side of zero, each slab distance (plane - origin) * inverse
+// is monotonic in the origin, and linear in the inverse direction, so its extremes over the packet
+// lie at the corners of their bounds: the entry distance is smallest from the origin bound furthest
+// along the ray and the exit distance largest from the nearest one. Those give an interval that
+// contains the slab interval of every ray in the packet. Returns the children that some ray of the
+// packet may hit before tMax.
+template <int Width>
+int packetMayHitChildren(const WideBVHNode<Width>& node, const RayPacket& packet, float tMax)
+{
+	float tEnter[Width];
+	float tExit[Width];
+	for (int i = 0; i < Width; i++)
+	{
+		tEnter[i] = 0.0f;
+		tExit[i] = tMax;
+	}
+	for (int axis = 0; axis < 3; axis++)
+	{
+		bool positive = packet.inverseMin[axis] > 0.0f;
+		const float* mins = axis == 0 ? node.minX : axis == 1 ? node.minY : node.minZ;
+		const float* maxs = axis == 0 ? node.maxX : axis == 1 ? node.maxY : node.maxZ;
+		const float* nearPlanes = positive ? mins : maxs;
+		const float* farPlanes = positive ? maxs : mins;
+		float nearOrigin = positive ? packet.originMax[axis] : packet.originMin[axis];
+		float farOrigin = positive ? packet.originMin[axis] : packet.originMax[axis];
+		for (int i = 0; i < Width; i++)
+		{
+			float nearDistance = nearPlanes[i] - nearOrigin;
+			float farDistance = farPlanes[i] - farOrigin;
+			tEnter[i] = std::max(tEnter[i], std::min(nearDistance * packet.inverseMin[axis], nearDistance * packet.inverseMax[axis]));
+			tExit[i] = std::min(tExit[i], std::max(farDistance * packet.inverseMin[axis], farDistance * packet.inverseMax[axis]));
+		}
+	}
+
+	int mask = 0;
+	for (int i = 0; i < Width; i++)
+		if (tEnter[i] <= tExit[i])
+			mask |= 1 << i;
+	return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+template <>
+inline int packetMayHitChildren<4>(const WideBVHNode<4>& node, const RayPacket& packet, float tMax)
+{
+	__m128 tEnter = _mm_setzero_ps();
+	__m128 tExit = _mm_set1_ps(tMax);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		bool positive = packet.inverseMin[axis] > 0.0f;
+		const float* mins = axis == 0 ? node.minX : axis == 1 ? node.minY : node.minZ;
+		const float* maxs = axis == 0 ? node.maxX : axis == 1 ? node.maxY : node.maxZ;
+		__m128 nearOrigin = _mm_set1_ps(positive ? packet.originMax[axis] : packet.originMin[axis]);
+		__m128 farOrigin = _mm_set1_ps(positive ? packet.originMin[axis] : packet.originMax[axis]);
+		__m128 inverseMin = _mm_set1_ps(packet.inverseMin[axis]);
+		__m128 inverseMax = _mm_set1_ps(packet.inverseMax[axis]);
+		__m128 nearDistance = _mm_sub_ps(_mm_loadu_ps(positive ? mins : maxs), nearOrigin);
+		__m128 farDistance = _mm_sub_ps(_mm_loadu_ps(positive ? maxs : mins), farOrigin);
+		tEnter = _mm_max_ps(tEnter, _mm_min_ps(_mm_mul_ps(nearDistance, inverseMin), _mm_mul_ps(nearDistance, inverseMax)));
+		tExit = _mm_min_ps(tExit, _mm_max_ps(_mm_mul_ps(farDistance, inverseMin), _mm_mul_ps(farDistance, inverseMax)));
+	}
+	return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+}
+#endif
+
+// Walks a wide BVH once for the whole packet, over raw arrays so a mapped cache can be traced too.
+// Each stack entry carries the rays that may still hit it. A node is tested first against the
+// lowest of them with the same vectorized test a single ray uses, and its children that ray
+// reaches are visited near to far and inherit the whole set. A child it misses is only followed
+// when the packet's frustum may reach it, and then with exactly the rays that hit its box, so
+// culling is decided once per wide node rather than once per ray. Leaves test each primitive
+// against the rays that hit their box. intersect(ray, primitive) is expected to shorten
+// packet.tMax[ray] when it finds a closer hit.
+template <int Width, typename Intersect>
+void traversePacket(const WideBVHNode<Width>* nodes, const int* primitiveIndices, RayPacket& packet, Intersect intersect)
+{
+	struct StackEntry
+	{
+		int child;
+		int count;
+		uint32_t rays;
+		float tEnter;
+	};
+
+	StackEntry stack[maxBVHDepth * Width];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, (1u << packet.count) - 1u, 0.0f };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		uint32_t rays = entry.rays;
+
+		if (entry.count > 0)
+		{
+			for (int i = entry.child; i < entry.child + entry.count; i++)
+				for (uint32_t remaining = rays; remaining != 0; remaining &= remaining - 1)
+					intersect(lowestBit(remaining), primitiveIndices[i]);
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = nodes[entry.child];
+		int first = lowestBit(rays);
+		float tEnter[Width];
+		int hitMask = intersectChildren<Width>(node, packet.rays[first], packet.tMax[first], tEnter);
+		int childMask = 0;
+		for (int i = 0; i < Width; i++)
+			if (node.counts[i] >= 0)
+				childMask |= 1 << i;
+		hitMask &= childMask;
+
+		int missedMask = childMask & ~hitMask;
+		if (missedMask != 0 && (rays & (rays - 1)) != 0)
+			missedMask &= packetMayHitChildren<Width>(node, packet, packet.maxT(rays));
+		else
+			missedMask = 0;
+		for (; missedMask != 0; missedMask &= missedMask - 1)
+		{
+			int i = lowestBit(uint32_t(missedMask));
+			uint32_t childRays = packet.hitRays(vec3(node.minX[i], node.minY[i], node.minZ[i]), vec3(node.maxX[i], node.maxY[i], node.maxZ[i]), rays);
+			if (childRays != 0)
+				stack[stackSize++] = { node.children[i], node.counts[i], childRays, 0.0f };
+		}
+
+		// Sort the children the first ray hits far to near with an insertion sort, so the nearest is
+		// popped first.
+		int sorted = stackSize;
+		for (; hitMask != 0; hitMask &= hitMask - 1)
+		{
+			int i = lowestBit(uint32_t(hitMask));
+			uint32_t childRays = rays;
+			if (node.counts[i] > 0)
+				childRays = packet.hitRays(vec3(node.minX[i], node.minY[i], node.minZ[i]), vec3(node.maxX[i], node.maxY[i], node.maxZ[i]), rays);
+			if (childRays == 0)
+				continue;
+			StackEntry child = { node.children[i], node.counts[i], childRays, tEnter[i] };
+			int j = stackSize++;
+			while (j > sorted && stack[j - 1].tEnter < child.tEnter)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+}
+
+template <int Width, typename Intersect>
+void traversePacket(const WideBVH<Width>& bvh, RayPacket& packet, Intersect intersect)
+{
+	if (!bvh.isEmpty())
+		traversePacket(bvh.nodes.data(), bvh.primitiveIndices.data(), packet, intersect);
+}
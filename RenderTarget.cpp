@@ -0,0 +1,78 @@
+#include "RenderTarget.h"
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+void RenderTarget::create(GLuint program)
+{
+	this->program = program;
+	glGenFramebuffers(1, &framebuffer);
+}
+
+// Sizes the target for a frame: the internal resolution for this window, scaled down further by
+// resolutionScale. Returns whether the texture was reallocated, which loses the frame it held.
+bool RenderTarget::prepare(int screenWidth, int screenHeight, float resolutionScale)
+{
+	int internalWidth = screenWidth;
+	int internalHeight = screenHeight;
+	if (!settings.matchWindow)
+	{
+		internalHeight = std::max(settings.internalHeight, 1);
+		internalWidth = int(float(internalHeight) * screenWidth / std::max(screenHeight, 1) + 0.5f);
+	}
+	int width = std::max(1, int(internalWidth * resolutionScale));
+	int height = std::max(1, int(internalHeight * resolutionScale));
+	return resize(width, height, settings.useFullFloat ? GL_RGBA32F : GL_RGBA16F);
+}
+
+bool RenderTarget::resize(int width, int height, GLenum internalFormat)
+{
+	if (width == this->width && height == this->height && internalFormat == this->internalFormat)
+		return false;
+	this->width = width;
+	this->height = height;
+	this->internalFormat = internalFormat;
+
+	glDeleteTextures(1, &texture);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "Render target framebuffer is incomplete" << endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return true;
+}
+
+// Reads the frame from texture unit 12, clear of the scene's and the denoiser's.
+void RenderTarget::present(GLuint vertexArray, int screenWidth, int screenHeight)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, screenWidth, screenHeight);
+	glUseProgram(program);
+	glActiveTexture(GL_TEXTURE12);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glUniform1i(glGetUniformLocation(program, "sourceTexture"), 12);
+	glUniform2f(glGetUniformLocation(program, "outputSize"), float(screenWidth), float(screenHeight));
+	glUniform1i(glGetUniformLocation(program, "useBicubic"), settings.useBicubic);
+	glUniform1i(glGetUniformLocation(program, "toneMapping"), int(settings.toneMapping));
+	glUniform1f(glGetUniformLocation(program, "exposure"), settings.exposure);
+	glBindVertexArray(vertexArray);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void RenderTarget::destroy()
+{
+	glDeleteTextures(1, &texture);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteProgram(program);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <glad/glad.h>
+
+enum class ToneMapping
+{
+	Clamp,
+	Reinhard,
+	Aces
+};
+
+// internalHeight sets how many rows are path traced, with the width following the window's
+// aspect ratio, unless matchWindow is set. useFullFloat stores the frame as RGBA32F instead of
+// RGBA16F. Clamp tone mapping shows the image the way the window always has, cutting everything
+// above one.
+struct RenderTargetSettings
+{
+	bool matchWindow = false;
+	int internalHeight = 1080;
+	bool useFullFloat = false;
+	bool useBicubic = true;
+	ToneMapping toneMapping = ToneMapping::Clamp;
+	float exposure = 1.0f;
+};
+
+// Offscreen floating point colour target the frame is path traced into at an internal
+// resolution of its own, so the cost of a frame does not follow the size of the window. present()
+// resolves it to the default framebuffer with the program built from blitshader.glsl, which
+// scales it to the window, with a Catmull-Rom filter or plain bilinear filtering, and tone maps it.
+class RenderTarget
+{
+public:
+	RenderTargetSettings settings;
+	int width = 0;
+	int height = 0;
+	GLuint framebuffer = 0;
+
+	void create(GLuint program);
+	bool prepare(int screenWidth, int screenHeight, float resolutionScale);
+	void present(GLuint vertexArray, int screenWidth, int screenHeight);
+	void destroy();
+private:
+	GLuint program = 0;
+	GLuint texture = 0;
+	GLenum internalFormat = 0;
+
+	bool resize(int width, int height, GLenum internalFormat);
+};
@@ -0,0 +1,307 @@
+#include "SampleAccumulator.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+// The share of the budget a single slice aims for, which leaves room to misjudge it by half.
+const float sliceShare = 0.5f;
+// Until a slice has been timed the first pass is split this many ways, in case one sample of the
+// whole image is already too much.
+const int initialNumBands = 8;
+const float costSmoothing = 0.5f;
+const int accumulationTileSize = 16;
+
+static double milliseconds()
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SampleAccumulator::create(GLuint sceneProgram)
+{
+	glGenFramebuffers(1, &framebuffer);
+	glGenTextures(1, &tileTexture);
+	glBindTexture(GL_TEXTURE_2D, tileTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glUseProgram(sceneProgram);
+	glUniform1i(glGetUniformLocation(sceneProgram, "tileSampleTexture"), 20);
+	glUniform1i(glGetUniformLocation(sceneProgram, "tileSize"), accumulationTileSize);
+	useTileSamplesLocation = glGetUniformLocation(sceneProgram, "useTileSamples");
+}
+
+void SampleAccumulator::resize(int width, int height)
+{
+	this->width = width;
+	this->height = height;
+	glDeleteTextures(1, &texture);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+
+	glDeleteTextures(1, &momentsTexture);
+	glGenTextures(1, &momentsTexture);
+	glBindTexture(GL_TEXTURE_2D, momentsTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, width, height, 0, GL_RG, GL_FLOAT, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// The scene program writes the image at location 0 and the moments at location 4.
+	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_NONE, GL_NONE, GL_NONE, GL_COLOR_ATTACHMENT1 };
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, momentsTexture, 0);
+	glDrawBuffers(5, drawBuffers);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cout << "Accumulation framebuffer is incomplete" << endl;
+
+	tilesWide = (width + accumulationTileSize - 1) / accumulationTileSize;
+	tilesHigh = (height + accumulationTileSize - 1) / accumulationTileSize;
+	moments.resize(size_t(width) * height);
+}
+
+bool SampleAccumulator::hasCameraMoved(Camera& camera)
+{
+	bool hasMoved = camera.getOrigin() != lastOrigin || camera.getForward() != lastForward ||
+		camera.getRight() != lastRight || camera.getUp() != lastUp;
+	lastOrigin = camera.getOrigin();
+	lastForward = camera.getForward();
+	lastRight = camera.getRight();
+	lastUp = camera.getUp();
+	return hasMoved;
+}
+
+bool SampleAccumulator::haveAdaptiveSettingsChanged()
+{
+	bool hasChanged = adaptiveSettings.isEnabled != lastAdaptiveSettings.isEnabled || (adaptiveSettings.isEnabled &&
+		(adaptiveSettings.targetError != lastAdaptiveSettings.targetError || adaptiveSettings.minSamples != lastAdaptiveSettings.minSamples));
+	lastAdaptiveSettings = adaptiveSettings;
+	return hasChanged;
+}
+
+void SampleAccumulator::begin(Camera& camera, int width, int height, int numSamples, int numLightBounces, bool hasSceneChanged)
+{
+	numSamples = std::max(adaptiveSettings.isEnabled ? adaptiveSettings.maxSamples : numSamples, 1);
+	numLightBounces = std::max(numLightBounces, 0);
+	bool hasMoved = hasCameraMoved(camera);
+	bool haveSettingsChanged = haveAdaptiveSettingsChanged();
+	if (width != this->width || height != this->height)
+		resize(width, height);
+	else if (!hasMoved && !hasSceneChanged && !haveSettingsChanged && numSamples == this->numSamples && numLightBounces == this->numLightBounces)
+	{
+		frameStart = milliseconds();
+		numSlicesThisFrame = 0;
+		return;
+	}
+
+	this->numSamples = numSamples;
+	this->numLightBounces = numLightBounces;
+	numSamplesDone = 0;
+	band = 0;
+	numBands = 0;
+	resetTiles();
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	frameStart = milliseconds();
+	numSlicesThisFrame = 0;
+}
+
+void SampleAccumulator::resetTiles()
+{
+	int firstSamples = adaptiveSettings.isEnabled ? clamp(adaptiveSettings.minSamples, 1, numSamples) : numSamples;
+	tiles.assign(size_t(tilesWide) * tilesHigh, ivec2(0, firstSamples));
+	uploadTiles();
+}
+
+void SampleAccumulator::uploadTiles()
+{
+	numActiveTiles = 0;
+	maxWantedSamples = 0;
+	for (ivec2 tile : tiles)
+	{
+		numActiveTiles += tile.y > 0;
+		maxWantedSamples = std::max(maxWantedSamples, tile.y);
+	}
+	glBindTexture(GL_TEXTURE_2D, tileTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32I, tilesWide, tilesHigh, 0, GL_RG_INTEGER, GL_INT, tiles.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Gives each tile that has all the samples it wanted as many more as its error asks for. The
+// moments are the running mean of each pixel's clamped luminance and its square, so times the
+// tile's sample count they are the sums the CPU megakernel keeps.
+void SampleAccumulator::judgeFinishedTiles()
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT1);
+	glReadPixels(0, 0, width, height, GL_RG, GL_FLOAT, moments.data());
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+	for (int index : finishedTiles)
+	{
+		ivec2& tile = tiles[index];
+		int firstX = index % tilesWide * accumulationTileSize;
+		int firstY = index / tilesWide * accumulationTileSize;
+		int endX = std::min(firstX + accumulationTileSize, width);
+		int endY = std::min(firstY + accumulationTileSize, height);
+		float sum = 0.0f;
+		for (int y = firstY; y < endY; y++)
+			for (int x = firstX; x < endX; x++)
+				sum += meanVariance(moments[size_t(y) * width + x] * float(tile.x), tile.x);
+		float error = sqrt(sum / ((endX - firstX) * (endY - firstY)));
+		tile.y = additionalTileSamples(adaptiveSettings, tile.x, numSamples, error);
+	}
+	finishedTiles.clear();
+}
+
+bool SampleAccumulator::isComplete() const
+{
+	return numActiveTiles == 0;
+}
+
+// The samples per pixel of the image so far.
+float SampleAccumulator::meanSamples() const
+{
+	double total = 0.0;
+	for (int index = 0; index < int(tiles.size()); index++)
+	{
+		int tileWidth = std::min(accumulationTileSize, width - index % tilesWide * accumulationTileSize);
+		int tileHeight = std::min(accumulationTileSize, height - index / tilesWide * accumulationTileSize);
+		total += double(tiles[index].x) * tileWidth * tileHeight;
+	}
+	return float(total / std::max(double(width) * height, 1.0));
+}
+
+// What one sample of every pixel that still wants samples costs, in the units millisecondsPerCost
+// is kept in.
+float SampleAccumulator::sampleCost() const
+{
+	float activeShare = tiles.empty() ? 1.0f : float(numActiveTiles) / tiles.size();
+	return float(width) * height * (numLightBounces + 1) * activeShare;
+}
+
+// Plans the next pass over the image: how many samples it takes and how many bands it is drawn in.
+// Every band of a pass has the same weight in the mean, whichever frame it is drawn in.
+void SampleAccumulator::planPass()
+{
+	float sliceMilliseconds = budgetMilliseconds * sliceShare;
+	float sampleMilliseconds = millisecondsPerCost * sampleCost();
+	slice.firstSample = numSamplesDone;
+	if (millisecondsPerCost == 0.0f)
+	{
+		slice.numSamples = 1;
+		numBands = initialNumBands;
+	}
+	else if (sampleMilliseconds > sliceMilliseconds)
+	{
+		slice.numSamples = 1;
+		numBands = int(ceil(sampleMilliseconds / sliceMilliseconds));
+	}
+	else
+	{
+		slice.numSamples = clamp(int(sliceMilliseconds / sampleMilliseconds), 1, maxWantedSamples);
+		numBands = 1;
+	}
+	numBands = clamp(numBands, 1, height);
+	band = 0;
+}
+
+// Returns false once the frame is complete or this frame's budget is spent. At least one slice is
+// drawn every frame, so the image keeps converging however small the budget.
+bool SampleAccumulator::nextSlice(AccumulationSlice& slice)
+{
+	if (isComplete())
+		return false;
+	if (band == 0)
+		planPass();
+
+	float bandMilliseconds = millisecondsPerCost * sampleCost() * this->slice.numSamples / numBands;
+	if (numSlicesThisFrame > 0 && milliseconds() - frameStart + bandMilliseconds > budgetMilliseconds)
+		return false;
+
+	this->slice.firstRow = band * height / numBands;
+	this->slice.endRow = (band + 1) * height / numBands;
+	slice = this->slice;
+
+	// Each tile has a sample count of its own, so the scene program gives each pixel its weight in
+	// the mean as its alpha. The alpha of the image stays 1.
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(0, slice.firstRow, width, slice.endRow - slice.firstRow);
+	glEnable(GL_BLEND);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+	glActiveTexture(GL_TEXTURE20);
+	glBindTexture(GL_TEXTURE_2D, tileTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(useTileSamplesLocation, true);
+	sliceStart = milliseconds();
+	return true;
+}
+
+// Waits for the slice so its time is known before the next one is sized. The slices are long
+// enough that the wait costs little next to them. The first slice also pays for compiling the
+// shader, so it is not timed. A slower slice is believed at once, since that is the direction
+// that could stall, and a faster one only in part.
+void SampleAccumulator::endSlice()
+{
+	glFinish();
+	float elapsed = float(milliseconds() - sliceStart);
+	float cost = sampleCost() * slice.numSamples * (slice.endRow - slice.firstRow) / height;
+	float measured = elapsed / std::max(cost, 1.0f);
+	if (!hasTimedFirstSlice)
+		hasTimedFirstSlice = true;
+	else if (measured > millisecondsPerCost)
+		millisecondsPerCost = measured;
+	else
+		millisecondsPerCost = mix(millisecondsPerCost, measured, costSmoothing);
+
+	numSlicesThisFrame++;
+	band++;
+	if (band == numBands)
+	{
+		band = 0;
+		numSamplesDone += slice.numSamples;
+		for (int index = 0; index < int(tiles.size()); index++)
+		{
+			ivec2& tile = tiles[index];
+			if (tile.y == 0)
+				continue;
+			int taken = std::min(slice.numSamples, tile.y);
+			tile.x += taken;
+			tile.y -= taken;
+			if (tile.y == 0 && adaptiveSettings.isEnabled)
+				finishedTiles.push_back(index);
+		}
+		if (!finishedTiles.empty())
+			judgeFinishedTiles();
+		uploadTiles();
+	}
+	glDisable(GL_BLEND);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+void SampleAccumulator::end(GLuint outputFramebuffer)
+{
+	glUniform1i(useTileSamplesLocation, false);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, outputFramebuffer);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void SampleAccumulator::destroy()
+{
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &momentsTexture);
+	glDeleteTextures(1, &tileTexture);
+	glDeleteFramebuffers(1, &framebuffer);
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include "Camera.h"
+#include "AdaptiveSampling.h"
+#include <glad/glad.h>
+#include <glm.hpp>
+#include <vector>
+
+using namespace glm;
+
+// One draw of the scene program: numSamples samples per pixel, seeded from firstSample, over the
+// rows from firstRow up to endRow.
+struct AccumulationSlice
+{
+	int numSamples;
+	int firstSample;
+	int firstRow;
+	int endRow;
+};
+
+// Spreads a frame's samples over as many short draws, and as many frames, as it takes, so no
+// single draw runs long enough to stall the interface or trip the driver's watchdog. Each slice
+// is sized from the time the previous ones took, per pixel, sample and bounce, to fill about half
+// of budgetMilliseconds; when even one sample of the whole image is more than that, a pass of one
+// sample is split into bands of rows. Slices are blended into an RGBA32F running mean, weighted
+// by their share of the samples so far, so the image can be shown at any point and sharpens as
+// the frame completes. The mean starts over whenever the camera, the size, the sample count, the
+// bounce count or the adaptive settings change, or the caller says something else has.
+//
+// The share is kept per tile of 16 by 16 pixels: a texture on unit 20 holds how many
+// samples each tile has and how many more it wants, and the scene program gives a tile no more
+// than that. Without adaptive sampling every tile wants numSamples. With it, every tile wants
+// minSamples at first, and whenever a tile has what it wanted the clamped luminance moments
+// blended alongside the image are read back and it is judged the way the CPU megakernel judges
+// its tiles, see AdaptiveSamplingSettings. The frame is complete once no tile wants more.
+class SampleAccumulator
+{
+public:
+	bool isEnabled = false;
+	float budgetMilliseconds = 25.0f;
+	AdaptiveSamplingSettings adaptiveSettings;
+	// Samples of the passes so far, which a tile that stopped early has fewer of, and the most
+	// the frame can take.
+	int numSamplesDone = 0;
+	int numSamples = 0;
+	int numActiveTiles = 0;
+
+	void create(GLuint sceneProgram);
+	void begin(Camera& camera, int width, int height, int numSamples, int numLightBounces, bool hasSceneChanged);
+	bool nextSlice(AccumulationSlice& slice);
+	void endSlice();
+	void end(GLuint outputFramebuffer);
+	bool isComplete() const;
+	float meanSamples() const;
+	void destroy();
+private:
+	GLuint framebuffer = 0;
+	GLuint texture = 0;
+	GLuint momentsTexture = 0;
+	GLuint tileTexture = 0;
+	GLint useTileSamplesLocation = -1;
+	int width = 0;
+	int height = 0;
+	int numLightBounces = 0;
+	AdaptiveSamplingSettings lastAdaptiveSettings;
+	int tilesWide = 0;
+	int tilesHigh = 0;
+	// Per tile the samples it has and the samples it still wants.
+	std::vector<ivec2> tiles;
+	std::vector<int> finishedTiles;
+	std::vector<vec2> moments;
+	int maxWantedSamples = 0;
+	vec3 lastOrigin;
+	vec3 lastForward;
+	vec3 lastRight;
+	vec3 lastUp;
+	float millisecondsPerCost = 0.0f;
+	bool hasTimedFirstSlice = false;
+	double frameStart = 0.0;
+	double sliceStart = 0.0;
+	int numSlicesThisFrame = 0;
+	AccumulationSlice slice = {};
+	int numBands = 0;
+	int band = 0;
+
+	bool hasCameraMoved(Camera& camera);
+	bool haveAdaptiveSettingsChanged();
+	float sampleCost() const;
+	void planPass();
+	void resize(int width, int height);
+	void resetTiles();
+	void judgeFinishedTiles();
+	void uploadTiles();
+};
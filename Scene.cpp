@@ -1,87 +1,210 @@
 #include "Scene.h"
+#include "Numa.h"
 #include <string>
 #include <iostream>
+#include <gtc/matrix_transform.hpp>
+#include <gtc/type_ptr.hpp>
 
 using namespace std;
 
 Material nullMaterial = Material();
 Sphere nullSphere;
 Plane nullPlane;
-HitInfo nullHitInfo = HitInfo(false, FLT_MAX, Material(vec3(0.0, 0.0, 0.0), 0.5, 0.0), vec3(0.0, 0.0, 0.0), 0, 0);
 
 Material defaultMaterial = Material(vec3(1.0, 1.0, 1.0), 1.0, 0.0, 0.0);
 Sphere defaultSphere = Sphere(vec3(0.0, 0.0, 0.0), 2.0, defaultMaterial, true);
 Plane defaultPlane = Plane(vec3(0.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), defaultMaterial, true);
+Disc defaultDisc = Disc(vec3(0.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0), 2.0, defaultMaterial, true);
+Box defaultBox = Box(vec3(-1.0, 0.0, -1.0), vec3(1.0, 2.0, 1.0), defaultMaterial, true);
+Triangle defaultTriangle = Triangle(vec3(-1.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(0.0, 2.0, 0.0), defaultMaterial, true);
+const int minParallelQueries = 1024;
+const int queryBlockSize = 64;
+
 Light defaultLight = Light(vec3(0.0, 4.0, 0.0), 1.0, vec3(1.0, 1.0, 1.0), 2.0, true);
 
-vec3 rayPoint(Ray ray, float t)
+// The closest hit nearer than tMax. With anyHit the first hit found nearer than tMax is returned
+// instead, which is all an occlusion test needs; BVH traversals are cut short by dropping their
+// tMax below zero once it is found.
+HitInfo Scene::hitScene(Ray ray, float tMax, bool anyHit)
 {
-	return ray.origin + ray.direction * t;
+	HitInfo closestHit = nullHitInfo;
+	closestHit.t = tMax;
+	float traversalT = tMax;
+	sphereBVH.wide.traverse(ray.origin, ray.direction, traversalT, [&](int i)
+	{
+		HitInfo hitInfo = hitPrimitive(ray, spheres[i]);
+		if (!hitInfo.hasHit || hitInfo.t >= closestHit.t) return;
+		closestHit = hitInfo;
+		traversalT = anyHit ? -1.0f : hitInfo.t;
+	});
+	if (anyHit && closestHit.hasHit)
+		return closestHit;
+	primitives.hitClosest(ray, closestHit, anyHit);
+	if (anyHit && closestHit.hasHit)
+		return closestHit;
+	for (const MeshObject& meshObject : meshes)
+	{
+		HitInfo hitInfo = hitMesh(ray, meshObject, closestHit.t, anyHit);
+		if (!hitInfo.hasHit) continue;
+		closestHit = hitInfo;
+		if (anyHit) return closestHit;
+	}
+	if (instanceBVHDirty)
+		buildInstanceBVH();
+	traversalT = closestHit.t;
+	instanceBVH.wide.traverse(ray.origin, ray.direction, traversalT, [&](int i)
+	{
+		HitInfo hitInfo = hitInstance(ray, instances[i], closestHit.t);
+		if (!hitInfo.hasHit) return;
+		closestHit = hitInfo;
+		traversalT = anyHit ? -1.0f : hitInfo.t;
+	});
+	return closestHit.hasHit ? closestHit : nullHitInfo;
 }
 
-HitInfo Scene::hitScene(Ray ray)
+// Finds the closest hit closer than packet.tMax for every ray of the packet, leaving hasHit false
+// for the others. Incoherent packets are traced one ray at a time.
+void Scene::hitScenePacket(RayPacket& packet, HitInfo* hits)
 {
-	HitInfo closestHit = nullHitInfo;
-	for (int i = 0; i < numSpheres; i++)
+	packet.finalize();
+	if (!packet.isCoherent)
 	{
-		HitInfo hitInfo = hitSphere(ray, spheres[i]);
-		if (!hitInfo.hasHit) continue;
-		if (hitInfo.t < closestHit.t) closestHit = hitInfo;
+		for (int i = 0; i < packet.count; i++)
+		{
+			hits[i] = hitScene(Ray(packet.origins[i], packet.directions[i]), packet.tMax[i]);
+		}
+		return;
 	}
-	for (int i = 0; i < numPlanes; i++)
+
+	for (int i = 0; i < packet.count; i++)
 	{
-		HitInfo hitInfo = hitPlane(ray, planes[i]);
-		if (!hitInfo.hasHit) continue;
-		if (hitInfo.t < closestHit.t) closestHit = hitInfo;
+		hits[i] = nullHitInfo;
+		hits[i].t = packet.tMax[i];
 	}
-	return closestHit;
+
+	traversePacket(sphereBVH.wide, packet, [&](int ray, int i)
+	{
+		HitInfo hitInfo = hitPrimitive(Ray(packet.origins[ray], packet.directions[ray]), spheres[i]);
+		if (!hitInfo.hasHit || hitInfo.t >= hits[ray].t) return;
+		hits[ray] = hitInfo;
+		packet.tMax[ray] = hitInfo.t;
+	});
+	for (int ray = 0; ray < packet.count; ray++)
+	{
+		primitives.hitClosest(Ray(packet.origins[ray], packet.directions[ray]), hits[ray], false);
+		packet.tMax[ray] = hits[ray].t;
+	}
+	for (const MeshObject& meshObject : meshes)
+	{
+		if (!meshObject.isVisible)
+			continue;
+		const Mesh& mesh = localMesh(meshObject);
+		int triangles[packetSize];
+		mesh.intersectPacket(packet, triangles);
+		for (int ray = 0; ray < packet.count; ray++)
+		{
+			if (triangles[ray] == -1)
+				continue;
+			vec3 normal = mesh.triangleNormal(triangles[ray]);
+			if (dot(normal, packet.directions[ray]) > 0.0f)
+				normal = -normal;
+			hits[ray] = HitInfo(true, packet.tMax[ray], meshObject.material, normal, meshObject.index, meshHitType);
+		}
+	}
+	if (instanceBVHDirty)
+		buildInstanceBVH();
+	traversePacket(instanceBVH.wide, packet, [&](int ray, int i)
+	{
+		HitInfo hitInfo = hitInstance(Ray(packet.origins[ray], packet.directions[ray]), instances[i], hits[ray].t);
+		if (!hitInfo.hasHit) return;
+		hits[ray] = hitInfo;
+		packet.tMax[ray] = hitInfo.t;
+	});
 }
 
-HitInfo Scene::hitSphere(Ray ray, Sphere sphere)
+HitInfo Scene::hitMesh(Ray ray, const MeshObject& meshObject, float tMax, bool anyHit)
 {
-	if (!sphere.isVisible)
+	if (!meshObject.isVisible)
 		return nullHitInfo;
 
-	vec3 rayOrigin = ray.origin - sphere.origin;
-	vec3 rayDirection = ray.direction;
-
-	float rayDirectionLength = length(rayDirection);
-	float rayOriginLength = length(rayOrigin);
+	const Mesh& mesh = localMesh(meshObject);
+	float t = tMax;
+	int triangle = mesh.intersect(ray.origin, ray.direction, t, anyHit);
+	if (triangle == -1)
+		return nullHitInfo;
 
-	float a = rayDirectionLength * rayDirectionLength;
-	float b = 2 * dot(rayDirection, rayOrigin);
-	float c = rayOriginLength * rayOriginLength - sphere.radius * sphere.radius;
+	vec3 normal = mesh.triangleNormal(triangle);
+	if (dot(normal, ray.direction) > 0.0f)
+		normal = -normal;
+	return HitInfo(true, t, meshObject.material, normal, meshObject.index, meshHitType);
+}
 
-	float d = b * b - 4.0 * a * c;
+// The copy of the mesh on the calling thread's NUMA node when the CPU renderer has made them.
+const Mesh& Scene::localMesh(const MeshObject& meshObject) const
+{
+	int node = currentNumaNode();
+	return node < int(meshObject.nodeReplicas.size()) ? meshObject.nodeReplicas[node] : meshObject.mesh;
+}
 
-	if (d < 0.0f)
+HitInfo Scene::hitInstance(Ray ray, const Instance& instance, float tMax)
+{
+	if (!instance.isVisible)
 		return nullHitInfo;
 
-	float t1 = (-b + sqrt(d)) / (2 * a);
-	float t2 = (-b - sqrt(d)) / (2 * a);
+	const ObjectGroup& group = groups[instance.group];
+	Ray localRay = Ray(vec3(instance.inverseTransform * vec4(ray.origin, 1.0)), mat3(instance.inverseTransform) * ray.direction);
 
-	float t = std::min(t1, t2);
-
-	if (t <= -0.001)
+	HitInfo closestHit = nullHitInfo;
+	closestHit.t = tMax;
+	group.wideBvh.traverse(localRay.origin, localRay.direction, closestHit.t, [&](int i)
+	{
+		HitInfo hitInfo = hitPrimitive(localRay, group.spheres[i]);
+		if (!hitInfo.hasHit) return;
+		if (hitInfo.t < closestHit.t) closestHit = hitInfo;
+	});
+	if (!closestHit.hasHit)
 		return nullHitInfo;
 
+	closestHit.hitNormal = transpose(mat3(instance.inverseTransform)) * closestHit.hitNormal;
+	if (instance.overrideMaterial)
+		closestHit.material = instance.material;
+	closestHit.hitIndex = instance.index;
+	closestHit.hitType = instanceHitType;
+	return closestHit;
+}
 
-	return HitInfo(true, t, sphere.material, rayPoint(ray, t) - sphere.origin, sphere.index, 0);
+AABB Scene::sphereBounds(Sphere sphere)
+{
+	return AABB(sphere.origin - vec3(abs(sphere.radius)), sphere.origin + vec3(abs(sphere.radius)));
 }
 
-HitInfo Scene::hitPlane(Ray ray, Plane plane)
+void Scene::refitSphere(int index)
 {
-	if (!plane.isVisible)
-		return nullHitInfo;
+	sphereBVH.update(index, sphereBounds(spheres[index]));
+}
 
-	float dn = dot(ray.direction, plane.normal);
-	if (dn == 0.0) return nullHitInfo;
+AABB Scene::instanceBounds(const Instance& instance)
+{
+	return transformBounds(groups[instance.group].bounds, instance.transform);
+}
 
-	float t = dot(plane.origin - ray.origin, plane.normal) / dn;
-	if (t < 0.001)
-		return nullHitInfo;
+void Scene::buildInstanceBVH()
+{
+	std::vector<AABB> bounds(instances.size());
+	for (int i = 0; i < int(instances.size()); i++)
+		bounds[i] = instanceBounds(instances[i]);
+	instanceBVH.build(bounds);
+	instanceBVHDirty = false;
+	instancesDirty = true;
+}
 
-	return HitInfo(true, t, plane.material, plane.normal, plane.index, 1);
+void Scene::setInstanceTransform(int index, mat4 transform)
+{
+	instances[index].transform = transform;
+	instances[index].inverseTransform = inverse(transform);
+	if (!instanceBVHDirty)
+		instanceBVH.update(index, instanceBounds(instances[index]));
+	instancesDirty = true;
 }
 
 Scene::Scene(float cameraFov = 50.0f, float cameraAspectRatio = 1920.0/1080.0) : camera(Camera(cameraFov, cameraAspectRatio))
@@ -91,7 +214,7 @@ Scene::Scene(float cameraFov = 50.0f, float cameraAspectRatio = 1920.0/1080.0) :
 	nullMaterial.transmission = 0.0;
 	nullMaterial.emission = 0.0;
 
-	selectedType = 1;
+	selectedType = primitiveTypeId<Plane>();
 	selectedIndex = 0;
 
 	nullSphere.isVisible = false;
@@ -120,6 +243,13 @@ Scene::Scene(float cameraFov = 50.0f, float cameraAspectRatio = 1920.0/1080.0) :
 		lights[i] = nullLight;
 
 	numSpheres = numPlanes = numLights = 0;
+	instanceBVHDirty = false;
+	instancesDirty = false;
+	meshesDirty = false;
+	meshVertexBuffer = meshVertexTexture = meshTriangleBuffer = meshTriangleTexture = 0;
+	bvhNodeBuffer = bvhNodeTexture = bvhPrimitiveBuffer = bvhPrimitiveTexture = 0;
+	instanceDataBuffer = instanceDataTexture = instanceNodeBuffer = instanceNodeTexture = instancePrimitiveBuffer = instancePrimitiveTexture = 0;
+	instanceBVHRoot = -1;
 
 	Sphere sphere1 = Sphere(vec3(0.0, 0.0, 0.0), 1.5, Material(vec3(1.0, 0.3, 0.3), 1.0, 1.0, 0.0), true);
 	Sphere sphere2 = Sphere(vec3(-4.0, 0.0, 0.0), 1.5, Material(vec3(0.3, 1.0, 0.3), 1.0, 0.0, 0.0), true);
@@ -151,13 +281,12 @@ void Scene::addSphere(Sphere sphere)
 	sphere.index = numSpheres;
 	spheres[numSpheres] = sphere;
 	numSpheres++;
+	sphereBVH.insert(sphereBounds(sphere));
 }
 
 void Scene::addPlane(Plane plane)
 {
-	plane.index = numPlanes;
-	planes[numPlanes] = plane;
-	numPlanes++;
+	primitives.add(plane);
 }
 
 void Scene::addLight(Light light)
@@ -166,14 +295,216 @@ void Scene::addLight(Light light)
 	numLights++;
 }
 
+// The shader holds every group's spheres in one uniform array, so a group that would not fit is
+// refused rather than traced by the CPU alone.
+int Scene::addGroup(std::vector<Sphere> spheres)
+{
+	int numGroupSpheres = 0;
+	for (const ObjectGroup& group : groups)
+		numGroupSpheres += int(group.spheres.size());
+	if (int(groups.size()) == maxNumGroups || numGroupSpheres + int(spheres.size()) > maxNumGroupSpheres)
+	{
+		cout << "Cannot add a group of " << spheres.size() << " spheres: groups are limited to " << maxNumGroups << " with " << maxNumGroupSpheres << " spheres between them" << endl;
+		return -1;
+	}
+
+	ObjectGroup group;
+	group.spheres = spheres;
+
+	std::vector<AABB> bounds(spheres.size());
+	for (int i = 0; i < int(spheres.size()); i++)
+	{
+		group.spheres[i].index = i;
+		bounds[i] = sphereBounds(spheres[i]);
+		group.bounds.grow(bounds[i]);
+	}
+	group.bvh.build(bounds);
+	group.wideBvh.build(group.bvh);
+
+	groups.push_back(group);
+	return int(groups.size()) - 1;
+}
+
+int Scene::addInstance(Instance instance)
+{
+	if (instance.group < 0 || instance.group >= int(groups.size()))
+		return -1;
+	if (int(instances.size()) == maxNumInstances)
+	{
+		cout << "Cannot add more than " << maxNumInstances << " instances" << endl;
+		return -1;
+	}
+	instance.index = int(instances.size());
+	instances.push_back(instance);
+	instanceBVHDirty = true;
+	return instance.index;
+}
+
+// A size by size grid of copies of a small cluster of spheres on the floor, all sharing one group.
+void Scene::addInstanceGrid(int size)
+{
+	if (gridGroup == -1)
+	{
+		Material clusterMaterial = Material(vec3(1.0, 1.0, 1.0), 1.0, 0.0, 0.0);
+		gridGroup = addGroup({
+			Sphere(vec3(-0.6, 0.0, 0.0), 0.5, clusterMaterial, true),
+			Sphere(vec3(0.6, 0.0, 0.0), 0.5, clusterMaterial, true),
+			Sphere(vec3(0.0, 0.8, 0.0), 0.5, clusterMaterial, true)
+		});
+		if (gridGroup == -1)
+			return;
+	}
+
+	int firstInstance = int(instances.size());
+	for (int i = 0; i < size * size; i++)
+	{
+		vec3 position = vec3((i % size - (size - 1) * 0.5f) * instanceGridSpacing, -1.0f, -4.0f - (i / size) * instanceGridSpacing);
+		if (addInstance(Instance(gridGroup, translate(mat4(1.0), position), defaultMaterial, false, true)) == -1)
+			break;
+	}
+	if (int(instances.size()) > firstInstance)
+	{
+		selectedType = instanceHitType;
+		selectedIndex = firstInstance;
+	}
+}
+
+bool Scene::addMesh(const std::string& path, Material material)
+{
+	MeshObject meshObject;
+	meshObject.mesh.lazy = lazyMeshBuild;
+	if (!meshObject.mesh.loadObj(path))
+	{
+		cout << "Failed to load mesh " << path << endl;
+		return false;
+	}
+	meshObject.material = material;
+	meshObject.isVisible = true;
+	meshObject.index = int(meshes.size());
+	meshes.push_back(std::move(meshObject));
+	meshesDirty = true;
+	return true;
+}
+
+void Scene::uploadMeshes()
+{
+	std::vector<vec4> vertexData;
+	std::vector<ivec4> triangleData;
+	std::vector<vec4> bvhNodeData;
+	std::vector<int> bvhPrimitiveData;
+	for (MeshObject& meshObject : meshes)
+	{
+		// A lazy tree is expanded on another thread rather than stalling the frame, and the mesh
+		// is left out of the GPU scene until pollBackgroundWork() sees it finish and it is
+		// uploaded again.
+		if (meshObject.mesh.lazyBvh)
+		{
+			meshObject.mesh.expandInBackground();
+			meshObject.gpuBVHRoot = -1;
+			continue;
+		}
+		int firstVertex = int(vertexData.size());
+		int firstTriangle = int(triangleData.size());
+		for (vec3 vertex : meshObject.mesh.vertices)
+			vertexData.push_back(vec4(vertex, 1.0));
+		for (ivec3 triangle : meshObject.mesh.triangles)
+			triangleData.push_back(ivec4(triangle + firstVertex, 0));
+		meshObject.gpuBVHRoot = meshObject.mesh.appendThreaded(bvhNodeData, bvhPrimitiveData, firstTriangle);
+		meshObject.gpuFirstTriangle = firstTriangle;
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, meshVertexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, vertexData.size() * sizeof(vec4), vertexData.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, meshTriangleBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, triangleData.size() * sizeof(ivec4), triangleData.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, bvhNodeBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, bvhNodeData.size() * sizeof(vec4), bvhNodeData.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, bvhPrimitiveBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, bvhPrimitiveData.size() * sizeof(int), bvhPrimitiveData.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	meshesDirty = false;
+}
+
+// Five texels per instance: the top three rows of its inverse transform, its material's colour
+// and roughness, and then its transmission, emission, group and flags, with 1 for overriding the
+// material and 2 for being visible. The instance BVH follows the threaded layout of the meshes'
+// in buffers of its own, so moving an instance does not upload the meshes again.
+void Scene::uploadInstances()
+{
+	std::vector<vec4> instanceData;
+	instanceData.reserve(instances.size() * 5);
+	for (const Instance& instance : instances)
+	{
+		mat4 rows = transpose(instance.inverseTransform);
+		instanceData.push_back(rows[0]);
+		instanceData.push_back(rows[1]);
+		instanceData.push_back(rows[2]);
+		instanceData.push_back(vec4(instance.material.color, instance.material.roughness));
+		instanceData.push_back(vec4(instance.material.transmission, instance.material.emission, float(instance.group), float(instance.overrideMaterial + 2 * instance.isVisible)));
+	}
+
+	std::vector<vec4> nodeData;
+	std::vector<int> primitiveData;
+	instanceBVHRoot = instanceBVH.bvh.appendThreaded(nodeData, primitiveData, 0);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceDataBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, instanceData.size() * sizeof(vec4), instanceData.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceNodeBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, nodeData.size() * sizeof(vec4), nodeData.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, instancePrimitiveBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, primitiveData.size() * sizeof(int), primitiveData.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	instancesDirty = false;
+}
+
+// The spheres of every group one after the other, and where each group starts. The G-buffer
+// program needs them as well as the scene program.
+void Scene::uploadGroups(GLuint shaderProgram)
+{
+	int numGroupSpheres = 0;
+	for (int i = 0; i < int(groups.size()) && i < maxNumGroups; i++)
+	{
+		string i_str = to_string(i);
+		GLuint groupFirstSphereLocation = glGetUniformLocation(shaderProgram, string("groupFirstSphere[").append(i_str).append("]").c_str());
+		GLuint groupNumSpheresLocation = glGetUniformLocation(shaderProgram, string("groupNumSpheres[").append(i_str).append("]").c_str());
+
+		int numSpheresInGroup = std::min(int(groups[i].spheres.size()), maxNumGroupSpheres - numGroupSpheres);
+		glUniform1i(groupFirstSphereLocation, numGroupSpheres);
+		glUniform1i(groupNumSpheresLocation, numSpheresInGroup);
+
+		for (int j = 0; j < numSpheresInGroup; j++, numGroupSpheres++)
+		{
+			const Sphere& sphere = groups[i].spheres[j];
+			string j_str = to_string(numGroupSpheres);
+			GLuint sphereOriginLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].origin").c_str());
+			GLuint sphereRadiusLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].radius").c_str());
+			GLuint sphereMaterialColorLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].material.color").c_str());
+			GLuint sphereMaterialRoughnessLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].material.roughness").c_str());
+			GLuint sphereMaterialTransmissionLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].material.transmission").c_str());
+			GLuint sphereMaterialEmissionStrengthLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].material.emission").c_str());
+			GLuint sphereIsVisibleLocation = glGetUniformLocation(shaderProgram, string("groupSpheres[").append(j_str).append("].isVisible").c_str());
+
+			glUniform3f(sphereOriginLocation, sphere.origin.x, sphere.origin.y, sphere.origin.z);
+			glUniform1f(sphereRadiusLocation, sphere.radius);
+			glUniform3f(sphereMaterialColorLocation, sphere.material.color.x, sphere.material.color.y, sphere.material.color.z);
+			glUniform1f(sphereMaterialRoughnessLocation, sphere.material.roughness);
+			glUniform1f(sphereMaterialTransmissionLocation, sphere.material.transmission);
+			glUniform1f(sphereMaterialEmissionStrengthLocation, sphere.material.emission);
+			glUniform1i(sphereIsVisibleLocation, sphere.isVisible);
+		}
+	}
+}
+
 GLuint cameraOriginLocation;
 GLint cameraForwardLocation;
 GLint cameraRightLocation;
 GLint cameraUpLocation;
 
-GLint numSpheresLocation;
-GLint numPlanesLocation;
 GLint numLightsLocation;
+GLint instanceBVHRootLocation;
+GLint numMeshesLocation;
 
 void Scene::bind(GLuint shaderProgram)
 {
@@ -182,62 +513,114 @@ void Scene::bind(GLuint shaderProgram)
 	cameraRightLocation = glGetUniformLocation(shaderProgram, "cameraRight");
 	cameraUpLocation = glGetUniformLocation(shaderProgram, "cameraUp");
 
-	numSpheresLocation = glGetUniformLocation(shaderProgram, "numSpheres");
-	numPlanesLocation = glGetUniformLocation(shaderProgram, "numPlanes");
 	numLightsLocation = glGetUniformLocation(shaderProgram, "numLights");
+	instanceBVHRootLocation = glGetUniformLocation(shaderProgram, "instanceBVHRoot");
+	numMeshesLocation = glGetUniformLocation(shaderProgram, "numMeshes");
+
+	glGenBuffers(1, &meshVertexBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, meshVertexBuffer);
+	glGenTextures(1, &meshVertexTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, meshVertexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, meshVertexBuffer);
+
+	glGenBuffers(1, &meshTriangleBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, meshTriangleBuffer);
+	glGenTextures(1, &meshTriangleTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, meshTriangleTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, meshTriangleBuffer);
+
+	glGenBuffers(1, &bvhNodeBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, bvhNodeBuffer);
+	glGenTextures(1, &bvhNodeTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, bvhNodeTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, bvhNodeBuffer);
+
+	glGenBuffers(1, &bvhPrimitiveBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, bvhPrimitiveBuffer);
+	glGenTextures(1, &bvhPrimitiveTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, bvhPrimitiveTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, bvhPrimitiveBuffer);
+
+	glGenBuffers(1, &instanceDataBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceDataBuffer);
+	glGenTextures(1, &instanceDataTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, instanceDataTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instanceDataBuffer);
+
+	glGenBuffers(1, &instanceNodeBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceNodeBuffer);
+	glGenTextures(1, &instanceNodeTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, instanceNodeTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instanceNodeBuffer);
+
+	glGenBuffers(1, &instancePrimitiveBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, instancePrimitiveBuffer);
+	glGenTextures(1, &instancePrimitiveTexture);
+	glBindTexture(GL_TEXTURE_BUFFER, instancePrimitiveTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, instancePrimitiveBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glUseProgram(shaderProgram);
+	glUniform1i(glGetUniformLocation(shaderProgram, "meshVertices"), 1);
+	glUniform1i(glGetUniformLocation(shaderProgram, "meshTriangles"), 2);
+	glUniform1i(glGetUniformLocation(shaderProgram, "bvhNodes"), 3);
+	glUniform1i(glGetUniformLocation(shaderProgram, "bvhPrimitives"), 4);
+	// Units 17 to 19, clear of the denoiser's, the blit's, the indirect light's and the G-buffer's.
+	glUniform1i(glGetUniformLocation(shaderProgram, "instanceData"), 17);
+	glUniform1i(glGetUniformLocation(shaderProgram, "instanceNodes"), 18);
+	glUniform1i(glGetUniformLocation(shaderProgram, "instancePrimitives"), 19);
+	uploadMeshes();
 
 	update(shaderProgram);
 }
 
+// Swaps in whatever the background rebuilds and expansions have finished, and marks what has to
+// be uploaded again. This has to run every iteration of the main loop, not only when a frame is
+// traced, since a finished job is itself a reason to trace one. Returns true when one finished.
+bool Scene::pollBackgroundWork()
+{
+	bool hasFinished = sphereBVH.poll();
+	if (instanceBVH.poll())
+	{
+		instancesDirty = true;
+		hasFinished = true;
+	}
+	for (MeshObject& meshObject : meshes)
+	{
+		if (meshObject.mesh.pollExpansion())
+		{
+			meshesDirty = true;
+			hasFinished = true;
+		}
+	}
+	return hasFinished;
+}
+
+bool Scene::hasBackgroundWork() const
+{
+	if (sphereBVH.isRebuilding() || instanceBVH.isRebuilding())
+		return true;
+	for (const MeshObject& meshObject : meshes)
+		if (meshObject.mesh.isExpanding())
+			return true;
+	return false;
+}
+
 void Scene::update(GLuint shaderProgram)
 {
+	if (instanceBVHDirty)
+		buildInstanceBVH();
+
 	glUniform3f(cameraOriginLocation, camera.getOrigin().x, camera.getOrigin().y, camera.getOrigin().z);
 	glUniform3f(cameraForwardLocation, camera.getForward().x, camera.getForward().y, camera.getForward().z);
 	glUniform3f(cameraRightLocation, camera.getRight().x, camera.getRight().y, camera.getRight().z);
 	glUniform3f(cameraUpLocation, camera.getUp().x, camera.getUp().y, camera.getUp().z);
 
-	glUniform1i(numSpheresLocation, numSpheres);
-	glUniform1i(numPlanesLocation, numPlanes);
 	glUniform1i(numLightsLocation, numLights);
 
-	for (int i = 0; i < numSpheres; i++)
-	{
-		string i_str = to_string(i);
-		GLuint sphereOriginLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].origin").c_str());
-		GLuint sphereRadius = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].radius").c_str());
-		GLuint sphereMaterialColorLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].material.color").c_str());
-		GLuint sphereMaterialRoughnessLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].material.roughness").c_str());
-		GLuint sphereMaterialTransmissionLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].material.transmission").c_str());
-		GLuint sphereMaterialEmissionStrengthLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].material.emission").c_str());
-		GLuint sphereIsVisibleLocation = glGetUniformLocation(shaderProgram, string("spheres[").append(i_str).append("].isVisible").c_str());
-
-		glUniform3f(sphereOriginLocation, spheres[i].origin.x, spheres[i].origin.y, spheres[i].origin.z);
-		glUniform1f(sphereRadius, spheres[i].radius);
-		glUniform3f(sphereMaterialColorLocation, spheres[i].material.color.x, spheres[i].material.color.y, spheres[i].material.color.z);
-		glUniform1f(sphereMaterialRoughnessLocation, spheres[i].material.roughness);
-		glUniform1f(sphereMaterialTransmissionLocation, spheres[i].material.transmission);
-		glUniform1f(sphereMaterialEmissionStrengthLocation, spheres[i].material.emission);
-		glUniform1i(sphereIsVisibleLocation, spheres[i].isVisible);
-	}
-	for (int i = 0; i < numPlanes; i++)
-	{
-		string i_str = to_string(i);
-		GLuint planeOriginLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].origin").c_str());
-		GLuint planeNormalLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].normal").c_str());
-		GLuint planeMaterialColorLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].material.color").c_str());
-		GLuint planeMaterialRoughnessLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].material.roughness").c_str());
-		GLuint planeMaterialTransmissionLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].material.transmission").c_str());
-		GLuint planeMaterialEmissionStrengthLocation = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].material.emission").c_str());
-		GLuint sphereIsVisible = glGetUniformLocation(shaderProgram, string("planes[").append(i_str).append("].isVisible").c_str());
-
-		glUniform3f(planeOriginLocation, planes[i].origin.x, planes[i].origin.y, planes[i].origin.z);
-		glUniform3f(planeNormalLocation, planes[i].normal.x, planes[i].normal.y, planes[i].normal.z);
-		glUniform3f(planeMaterialColorLocation, planes[i].material.color.x, planes[i].material.color.y, planes[i].material.color.z);
-		glUniform1f(planeMaterialRoughnessLocation, planes[i].material.roughness);
-		glUniform1f(planeMaterialTransmissionLocation, planes[i].material.transmission);
-		glUniform1f(planeMaterialEmissionStrengthLocation, planes[i].material.emission);
-		glUniform1i(sphereIsVisible, planes[i].isVisible);
-	}
+	primitives.upload(shaderProgram);
+
 	for (int i = 0; i < numLights; i++)
 	{
 		string i_str = to_string(i);
@@ -253,54 +636,194 @@ void Scene::update(GLuint shaderProgram)
 		glUniform1f(lightStrengthLocation, lights[i].strength);
 		glUniform1f(lightIsVisibleLocation, lights[i].isVisible);
 	}
+
+	uploadGroups(shaderProgram);
+
+	if (meshesDirty)
+		uploadMeshes();
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, meshVertexTexture);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_BUFFER, meshTriangleTexture);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_BUFFER, bvhNodeTexture);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_BUFFER, bvhPrimitiveTexture);
+
+	if (instancesDirty)
+		uploadInstances();
+	glActiveTexture(GL_TEXTURE17);
+	glBindTexture(GL_TEXTURE_BUFFER, instanceDataTexture);
+	glActiveTexture(GL_TEXTURE18);
+	glBindTexture(GL_TEXTURE_BUFFER, instanceNodeTexture);
+	glActiveTexture(GL_TEXTURE19);
+	glBindTexture(GL_TEXTURE_BUFFER, instancePrimitiveTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(instanceBVHRootLocation, instanceBVHRoot);
+
+	int numUploadedMeshes = std::min(int(meshes.size()), maxNumMeshes);
+	glUniform1i(numMeshesLocation, numUploadedMeshes);
+	for (int i = 0; i < numUploadedMeshes; i++)
+	{
+		const MeshObject& meshObject = meshes[i];
+		string i_str = to_string(i);
+		GLuint meshBVHRootLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].bvhRoot").c_str());
+		GLuint meshMaterialColorLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].material.color").c_str());
+		GLuint meshMaterialRoughnessLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].material.roughness").c_str());
+		GLuint meshMaterialTransmissionLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].material.transmission").c_str());
+		GLuint meshMaterialEmissionStrengthLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].material.emission").c_str());
+		GLuint meshIsVisibleLocation = glGetUniformLocation(shaderProgram, string("meshes[").append(i_str).append("].isVisible").c_str());
+
+		glUniform1i(meshBVHRootLocation, meshObject.gpuBVHRoot);
+		glUniform3f(meshMaterialColorLocation, meshObject.material.color.x, meshObject.material.color.y, meshObject.material.color.z);
+		glUniform1f(meshMaterialRoughnessLocation, meshObject.material.roughness);
+		glUniform1f(meshMaterialTransmissionLocation, meshObject.material.transmission);
+		glUniform1f(meshMaterialEmissionStrengthLocation, meshObject.material.emission);
+		glUniform1i(meshIsVisibleLocation, meshObject.isVisible);
+	}
 }
 
-void Scene::gui()
+// Spheres also have to be inserted into their BVH.
+template <>
+int Scene::addDefaultPrimitive<Sphere>()
 {
-	Begin("Object Settings ", nullptr, 0);
-	Spacing();
+	if (numSpheres == maxNumSpheres)
+		return -1;
+	addSphere(defaultSphere);
+	return numSpheres - 1;
+}
 
-	if (selectedType == 0)
+template <typename T>
+int Scene::addDefaultPrimitive()
+{
+	const tuple<Plane, Disc, Box, Triangle> defaults(defaultPlane, defaultDisc, defaultBox, defaultTriangle);
+	return addPrimitive(get<T>(defaults));
+}
+
+template <typename T>
+void Scene::primitiveGui()
+{
+	PrimitiveArray<T>& array = primitives.get<T>();
+	string name = PrimitiveTraits<T>::name();
+	if (selectedType == primitiveTypeId<T>() && selectedIndex < array.count)
 	{
 		string index = to_string(selectedIndex);
-		Text(string("Sphere ").append(index).append(" is selected").c_str());
-		InputFloat3(string("Origin ").append(index).c_str(), &spheres[selectedIndex].origin.x, 0);
-		InputFloat(string("Radius ").append(index).c_str(), &spheres[selectedIndex].radius, 0);
+		T& primitive = array.items[selectedIndex];
+		Text(string(name).append(" ").append(index).append(" is selected").c_str());
+		if (PrimitiveTraits<T>::gui(primitive, index) && primitiveTypeId<T>() == primitiveTypeId<Sphere>())
+			refitSphere(selectedIndex);
 		Spacing();
-		ColorPicker3(string("Color ").append(index).c_str(), (float*)&spheres[selectedIndex].material.color.x, ImGuiColorEditFlags_Float);
-		SliderFloat(string("Roughness ").append(index).c_str(), &spheres[selectedIndex].material.roughness, 0, 1);
-		SliderFloat(string("Transmission ").append(index).c_str(), &spheres[selectedIndex].material.transmission, 0, 1);
-		InputFloat(string("Emission ").append(index).c_str(), &spheres[selectedIndex].material.emission, 0);
-		Checkbox(string("Visibility ").append(index).c_str(), &spheres[selectedIndex].isVisible);
+		ColorPicker3(string("Color ").append(index).c_str(), (float*)&primitive.material.color.x, ImGuiColorEditFlags_Float);
+		SliderFloat(string("Roughness ").append(index).c_str(), &primitive.material.roughness, 0, 1);
+		SliderFloat(string("Transmission ").append(index).c_str(), &primitive.material.transmission, 0, 1);
+		InputFloat(string("Emission ").append(index).c_str(), &primitive.material.emission, 0);
+		Checkbox(string("Visibility ").append(index).c_str(), &primitive.isVisible);
 		Spacing();
-		if (ImGui::Button("Add new sphere"))
+		if (primitiveTypeId<T>() == primitiveTypeId<Sphere>())
 		{
-			Sphere sphere = defaultSphere;
-			addSphere(sphere);
-			selectedIndex = numSpheres - 1;
+			string bvhStatus = sphereBVH.isRebuilding() ? string("Rebuilding BVH") : string("BVH cost ratio ").append(to_string(sphereBVH.costRatio()));
+			Text(bvhStatus.c_str());
 		}
 	}
+	name[0] = char(tolower(name[0]));
+	if (ImGui::Button(string("Add new ").append(name).c_str()))
+	{
+		int index = addDefaultPrimitive<T>();
+		if (index == -1)
+		{
+			cout << "Cannot add another " << name << ": the scene holds at most " << PrimitiveTraits<T>::maxCount << endl;
+		}
+		else
+		{
+			selectedType = primitiveTypeId<T>();
+			selectedIndex = index;
+		}
+	}
+}
+
+template <typename... Types>
+void Scene::primitivesGui(TypeList<Types...>)
+{
+	(void)std::initializer_list<int>{ (primitiveGui<Types>(), 0)... };
+}
+
+void Scene::gui()
+{
+	Begin("Object Settings ", nullptr, 0);
+	Spacing();
 
-	if (selectedType == 1)
+	primitivesGui(ScenePrimitives());
+	Spacing();
+	if (selectedType == instanceHitType)
 	{
 		string index = to_string(selectedIndex);
-		Text(string("Plane ").append(index).append(" is selected").c_str());
-		InputFloat3(string("Origin ").append(index).c_str(), &planes[selectedIndex].origin.x, 0);
-		InputFloat3(string("Normal ").append(index).c_str(), &planes[selectedIndex].normal.x, 0);
+		Instance& instance = instances[selectedIndex];
+		Text(string("Instance ").append(index).append(" of group ").append(to_string(instance.group)).append(" is selected").c_str());
+		mat4 transform = instance.transform;
+		if (InputFloat3(string("Position ").append(index).c_str(), &transform[3].x, 0))
+			setInstanceTransform(selectedIndex, transform);
 		Spacing();
-		ColorPicker3(string("Color ").append(index).c_str(), (float*)&planes[selectedIndex].material.color.x, ImGuiColorEditFlags_Float);
-		SliderFloat(string("Roughness ").append(index).c_str(), &planes[selectedIndex].material.roughness, 0, 1);
-		SliderFloat(string("Transmission ").append(index).c_str(), &planes[selectedIndex].material.transmission, 0, 1);
-		InputFloat(string("Emission ").append(index).c_str(), &planes[selectedIndex].material.emission, 0);
-		Checkbox(string("Visibility ").append(index).c_str(), &planes[selectedIndex].isVisible);
+		bool edited = Checkbox(string("Override Material ").append(index).c_str(), &instance.overrideMaterial);
+		edited |= ColorPicker3(string("Color ").append(index).c_str(), (float*)&instance.material.color.x, ImGuiColorEditFlags_Float);
+		edited |= SliderFloat(string("Roughness ").append(index).c_str(), &instance.material.roughness, 0, 1);
+		edited |= SliderFloat(string("Transmission ").append(index).c_str(), &instance.material.transmission, 0, 1);
+		edited |= InputFloat(string("Emission ").append(index).c_str(), &instance.material.emission, 0);
+		edited |= Checkbox(string("Visibility ").append(index).c_str(), &instance.isVisible);
+		if (edited)
+			instancesDirty = true;
 		Spacing();
-		if (ImGui::Button("Add new plane"))
+		Text(string(to_string(instances.size())).append(" instances of ").append(to_string(groups.size())).append(" groups").c_str());
+		if (ImGui::Button("Add new instance"))
 		{
-			Plane plane = defaultPlane;
-			addPlane(plane);
-			selectedIndex = numPlanes - 1;
+			Instance copy = instance;
+			copy.transform = translate(copy.transform, vec3(2.0, 0.0, 0.0));
+			copy.inverseTransform = inverse(copy.transform);
+			if (addInstance(copy) != -1)
+				selectedIndex = int(instances.size()) - 1;
 		}
 	}
+	if (selectedType == meshHitType)
+	{
+		string index = to_string(selectedIndex);
+		MeshObject& meshObject = meshes[selectedIndex];
+		Text(string("Mesh ").append(index).append(" is selected").c_str());
+		Text(string(to_string(meshObject.mesh.triangles.size())).append(" triangles").c_str());
+		if (meshObject.mesh.isMemoryMeasured)
+		{
+			const BVHMemory& memory = meshObject.mesh.memory;
+			Text("BVH bytes per triangle: binary %.1f, 4-wide %.1f, 8-wide %.1f, compressed %.1f", memory.binary, memory.wide4, memory.wide8, memory.compressed);
+		}
+		else if (ImGui::Button(string("Measure BVH Memory ").append(index).c_str()) && !meshObject.mesh.measureMemory())
+		{
+			cout << "The lazy BVH of mesh " << index << " is measured once it has been fully built" << endl;
+		}
+		bool compressed = meshObject.mesh.layout == BVHLayout::Compressed;
+		if (Checkbox(string("Compressed BVH ").append(index).c_str(), &compressed))
+		{
+			meshObject.mesh.setLayout(compressed ? BVHLayout::Compressed : BVHLayout::Wide);
+			meshObject.nodeReplicas.clear();
+		}
+		if (meshObject.mesh.lazyBvh)
+			Text("Lazy BVH: %d of %d nodes built, drawn on the GPU once all are", meshObject.mesh.lazyBvh->numNodes(), meshObject.mesh.lazyBvh->maxNodes());
+		Spacing();
+		ColorPicker3(string("Color ").append(index).c_str(), (float*)&meshObject.material.color.x, ImGuiColorEditFlags_Float);
+		SliderFloat(string("Roughness ").append(index).c_str(), &meshObject.material.roughness, 0, 1);
+		SliderFloat(string("Transmission ").append(index).c_str(), &meshObject.material.transmission, 0, 1);
+		InputFloat(string("Emission ").append(index).c_str(), &meshObject.material.emission, 0);
+		Checkbox(string("Visibility ").append(index).c_str(), &meshObject.isVisible);
+	}
+	Spacing();
+	InputText("OBJ Path", objPath, sizeof(objPath));
+	Checkbox("Lazy BVH", &lazyMeshBuild);
+	if (ImGui::Button("Load OBJ") && addMesh(objPath, defaultMaterial))
+	{
+		selectedType = meshHitType;
+		selectedIndex = int(meshes.size()) - 1;
+	}
+	Spacing();
+	InputInt("Instance Grid Size", &instanceGridSize);
+	if (ImGui::Button("Add Instance Grid"))
+		addInstanceGrid(std::max(instanceGridSize, 1));
 	End();
 
 	Begin("Light Settings ", nullptr, 0);
@@ -323,11 +846,45 @@ void Scene::select(int windowWidth, int windowHeight, double mouseXPosition, dou
 	float y = -(mouseYPosition - windowHeight / 2.0) / windowHeight;
 
 	vec3 rayDirection = normalize(camera.getForward() + x * camera.getRight() + y * camera.getUp());
-	Ray ray = Ray(camera.getOrigin(), rayDirection);
+	RayQuery ray = { camera.getOrigin(), rayDirection, FLT_MAX };
 
-	HitInfo closestHit = hitScene(ray);
+	RayHit closestHit;
+	intersect(Span<const RayQuery>(&ray, 1), Span<RayHit>(&closestHit, 1), HitMode::Closest, false);
 	
-	selectedType = closestHit.hitType;
+	// A miss selects the first sphere, as it did before misses had a type of their own.
+	selectedType = std::max(closestHit.hitType, 0);
 	selectedIndex = closestHit.hitIndex;
 }
 
+// Answers a batch of queries with the same traversal the CPU renderer uses. Parallel batches are
+// split over queryScheduler's workers in blocks, small ones are not worth waking them for. Any
+// hit mode stops each ray at the first hit found, so its t need not be the closest.
+void Scene::intersect(Span<const RayQuery> rays, Span<RayHit> hits, HitMode mode, bool parallel)
+{
+	if (instanceBVHDirty)
+		buildInstanceBVH();
+
+	bool anyHit = mode == HitMode::Any;
+	auto intersectRange = [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			HitInfo hitInfo = hitScene(Ray(rays[i].origin, rays[i].direction), rays[i].tMax, anyHit);
+			hits[i].t = hitInfo.hasHit ? hitInfo.t : FLT_MAX;
+			hits[i].hitType = hitInfo.hasHit ? hitInfo.hitType : -1;
+			hits[i].hitIndex = hitInfo.hasHit ? hitInfo.hitIndex : 0;
+		}
+	};
+
+	int count = int(std::min(rays.size(), hits.size()));
+	if (!parallel || count < minParallelQueries)
+	{
+		intersectRange(0, count);
+		return;
+	}
+	queryScheduler.parallelForBlocks(count, queryBlockSize, [&](int first, int last, Arena&)
+	{
+		intersectRange(first, last);
+	});
+}
+
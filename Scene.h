@@ -1,6 +1,12 @@
 #pragma once
 #include <glm.hpp>
+#include <vector>
 #include "Camera.h"
+#include "DynamicBVH.h"
+#include "Mesh.h"
+#include "PrimitiveRegistry.h"
+#include "Span.h"
+#include "TileScheduler.h"
 #include <glad/glad.h>
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
@@ -9,47 +15,38 @@
 using namespace glm;
 using namespace ImGui;
 
-const int maxNumSpheres = 64;
-const int maxNumPlanes = 64;
 const int maxNumLights = 64;
+const int maxNumGroups = 16;
+const int maxNumGroupSpheres = 64;
+// Instances and their BVH reach the shader through buffer textures, which GL 3.3 only has to make
+// 65536 texels long: five texels per instance and up to four per instance for the tree.
+const int maxNumInstances = 8192;
+const float instanceGridSpacing = 2.0f;
+const int maxNumMeshes = 16;
 
-struct Ray
+// A ray for Scene::intersect, which only reports hits closer than tMax.
+struct RayQuery
 {
     vec3 origin;
     vec3 direction;
-    Ray(vec3 origin, vec3 direction) : origin(origin), direction(direction) {};
+    float tMax;
 };
 
-struct Material
+// The compact result of a RayQuery. hitType and hitIndex follow HitInfo, with hitType -1 and t
+// FLT_MAX for a miss.
+struct RayHit
 {
-    vec3 color;
-    float roughness;
-    float transmission;
-    float emission;
-    Material(vec3 color = vec3(0.0), float roughness = 0.0, float transmission = 0.0, float emission = 0.0) : color(color), roughness(roughness), transmission(transmission), emission(emission)
-    {}
+    float t;
+    int hitType;
+    int hitIndex;
 };
 
-struct Plane
+enum class HitMode
 {
-    vec3 origin;
-    vec3 normal;
-    Material material;
-    bool isVisible;
-    int index = INT_MAX;
-    Plane(vec3 origin = vec3(0.0), vec3 normal = vec3(0.0), Material material = Material(), bool isVisible = false) : origin(origin), normal(normal), material(material), isVisible(isVisible)
-    {}
-};
-struct Sphere
-{
-    vec3 origin;
-    float radius;
-    Material material;
-    bool isVisible;
-    int index = INT_MAX;
-    Sphere(vec3 origin = vec3(0.0), float radius = 0.0, Material material = Material(), bool isVisible = false) : origin(origin), radius(radius), material(material), isVisible(isVisible)
-    {}
+    Closest,
+    Any
 };
+
 struct Light
 {
     vec3 origin;
@@ -61,40 +58,117 @@ struct Light
     {}
 };
 
-struct HitInfo
+struct ObjectGroup
 {
-    bool hasHit;
-    float t;
+    std::vector<Sphere> spheres;
+    BVH bvh;
+    CpuBVH wideBvh;
+    AABB bounds;
+};
+struct Instance
+{
+    mat4 transform;
+    mat4 inverseTransform;
+    int group;
     Material material;
-    vec3 hitNormal;
-    int hitIndex;
-    int hitType;
-    HitInfo(bool hasHit, float t, Material material, vec3 hitNormal, int hitIndex, int hitType) : hasHit(hasHit), t(t), material(material), hitNormal(hitNormal), hitIndex(hitIndex), hitType(hitType) 
-    {};
+    bool overrideMaterial;
+    bool isVisible;
+    int index = INT_MAX;
+    Instance(int group = 0, mat4 transform = mat4(1.0), Material material = Material(), bool overrideMaterial = false, bool isVisible = false) : transform(transform), inverseTransform(inverse(transform)), group(group), material(material), overrideMaterial(overrideMaterial), isVisible(isVisible)
+    {}
+};
+
+struct MeshObject
+{
+    Mesh mesh;
+    std::vector<Mesh> nodeReplicas;
+    Material material;
+    bool isVisible;
+    int index = INT_MAX;
+    int gpuBVHRoot = -1;
+    int gpuFirstTriangle = 0;
 };
 
 class Scene
 {
+    friend class CpuRenderer;
+    friend class GBuffer;
 private:
-	Sphere spheres[maxNumSpheres];
-    Plane planes[maxNumPlanes];
+    PrimitiveStore<ScenePrimitives> primitives;
+    Sphere (&spheres)[maxNumSpheres] = primitives.get<Sphere>().items;
+    Plane (&planes)[maxNumPlanes] = primitives.get<Plane>().items;
     Light lights[maxNumLights];
-    int numSpheres;
-    int numPlanes;
+    int& numSpheres = primitives.get<Sphere>().count;
+    int& numPlanes = primitives.get<Plane>().count;
     int numLights;
     int selectedIndex;
     int selectedType;
-    HitInfo hitScene(Ray ray);
-    HitInfo hitSphere(Ray ray, Sphere sphere);
-    HitInfo hitPlane(Ray ray, Plane plane);
+    DynamicBVH sphereBVH;
+    std::vector<ObjectGroup> groups;
+    std::vector<Instance> instances;
+    DynamicBVH instanceBVH;
+    bool instanceBVHDirty;
+    bool instancesDirty;
+    int instanceBVHRoot;
+    int gridGroup = -1;
+    int instanceGridSize = 8;
+    std::vector<MeshObject> meshes;
+    bool meshesDirty;
+    GLuint meshVertexBuffer, meshVertexTexture;
+    GLuint meshTriangleBuffer, meshTriangleTexture;
+    GLuint bvhNodeBuffer, bvhNodeTexture;
+    GLuint bvhPrimitiveBuffer, bvhPrimitiveTexture;
+    GLuint instanceDataBuffer, instanceDataTexture;
+    GLuint instanceNodeBuffer, instanceNodeTexture;
+    GLuint instancePrimitiveBuffer, instancePrimitiveTexture;
+    char objPath[256] = "model.obj";
+    bool lazyMeshBuild = false;
+    TileScheduler queryScheduler;
+    HitInfo hitScene(Ray ray, float tMax = FLT_MAX, bool anyHit = false);
+    void hitScenePacket(RayPacket& packet, HitInfo* hits);
+    HitInfo hitInstance(Ray ray, const Instance& instance, float tMax);
+    HitInfo hitMesh(Ray ray, const MeshObject& meshObject, float tMax, bool anyHit = false);
+    const Mesh& localMesh(const MeshObject& meshObject) const;
+    AABB sphereBounds(Sphere sphere);
+    void refitSphere(int index);
+    AABB instanceBounds(const Instance& instance);
+    void buildInstanceBVH();
+    void setInstanceTransform(int index, mat4 transform);
+    void uploadMeshes();
+    void uploadInstances();
+    void uploadGroups(GLuint shaderProgram);
+    void addInstanceGrid(int size);
+    // Adds a copy of T's default primitive and returns its index, or -1 when T's array is full.
+    template <typename T>
+    int addDefaultPrimitive();
+    // The editor of the selected primitive if it is a T, and the button adding a new T.
+    template <typename T>
+    void primitiveGui();
+    template <typename... Types>
+    void primitivesGui(TypeList<Types...>);
 public:
     Camera camera;
 	Scene(float cameraFov, float cameraAspectRatio);
     void addSphere(Sphere sphere);
     void addPlane(Plane plane);
+    // Any primitive traced by a plain loop; returns its index, or -1 when its array is full.
+    // Spheres have to go through addSphere, which keeps their BVH up to date.
+    template <typename T>
+    int addPrimitive(T primitive)
+    {
+        static_assert(!PrimitiveTraits<T>::hasOwnTraversal, "primitive needs its own add function");
+        return primitives.add(primitive);
+    }
     void addLight(Light light);
+    // Both return the new index, or -1 when the group or instance would not fit on the GPU.
+    int addGroup(std::vector<Sphere> spheres);
+    int addInstance(Instance instance);
+    bool addMesh(const std::string& objPath, Material material);
     void bind(GLuint shaderProgram);
     void update(GLuint shaderProgram);
+    bool pollBackgroundWork();
+    bool hasBackgroundWork() const;
     void gui();
     void select(int windowWidth, int windowHeight, double mouseXPosition, double mouseYPosition);
+    void intersect(Span<const RayQuery> rays, Span<RayHit> hits, HitMode mode = HitMode::Closest, bool parallel = true);
 };
\ No newline at end of file
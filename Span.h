@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// A view of count contiguous items owned by someone else, for passing batches across an API
+// without committing the caller to a container.
+template <typename T>
+struct Span
+{
+	T* data;
+	size_t count;
+
+	Span() : data(nullptr), count(0)
+	{}
+	Span(T* data, size_t count) : data(data), count(count)
+	{}
+	template <typename U>
+	Span(std::vector<U>& items) : data(items.data()), count(items.size())
+	{}
+	template <typename U>
+	Span(const std::vector<U>& items) : data(items.data()), count(items.size())
+	{}
+
+	T& operator[](size_t index) const
+	{
+		return data[index];
+	}
+	T* begin() const
+	{
+		return data;
+	}
+	T* end() const
+	{
+		return data + count;
+	}
+	size_t size() const
+	{
+		return count;
+	}
+};
@@ -0,0 +1,244 @@
+#include "TileScheduler.h"
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+static uint32_t interleaveBits(uint32_t value)
+{
+	value &= 0x0000FFFFu;
+	value = (value | (value << 8)) & 0x00FF00FFu;
+	value = (value | (value << 4)) & 0x0F0F0F0Fu;
+	value = (value | (value << 2)) & 0x33333333u;
+	value = (value | (value << 1)) & 0x55555555u;
+	return value;
+}
+
+static double millisecondsBetween(chrono::steady_clock::time_point start, chrono::steady_clock::time_point end)
+{
+	return chrono::duration<double, milli>(end - start).count();
+}
+
+TileScheduler::~TileScheduler()
+{
+	stopWorkers();
+}
+
+// The tile list only changes with the frame size or tile size, so repeated runs over the same
+// frame reuse it.
+void TileScheduler::buildTiles(int width, int height)
+{
+	tileSize = std::max(tileSize, 1);
+	if (width == tilesWidth && height == tilesHeight && tileSize == tilesSize)
+		return;
+	tilesWidth = width;
+	tilesHeight = height;
+	tilesSize = tileSize;
+
+	vector<Tile> unorderedTiles;
+	tileOrder.clear();
+	for (int y = 0; y < height; y += tileSize)
+		for (int x = 0; x < width; x += tileSize)
+		{
+			uint32_t code = interleaveBits(uint32_t(x / tileSize)) | (interleaveBits(uint32_t(y / tileSize)) << 1);
+			tileOrder.push_back((uint64_t(code) << 32) | unorderedTiles.size());
+			unorderedTiles.push_back({ x, y, std::min(tileSize, width - x), std::min(tileSize, height - y) });
+		}
+	sort(tileOrder.begin(), tileOrder.end());
+
+	tiles.clear();
+	for (uint64_t entry : tileOrder)
+		tiles.push_back(unorderedTiles[uint32_t(entry)]);
+}
+
+// Workers are assigned evenly spaced processors from the node by node list, which keeps the
+// workers of one node consecutive.
+void TileScheduler::startWorkers()
+{
+	if (topology.processors.empty())
+		topology = detectNumaTopology();
+	int numProcessors = int(topology.processors.size());
+	int threadCount = std::max(1, numThreads > 0 ? numThreads : numProcessors);
+	if (threadCount == numWorkers && pinThreads == isPinned)
+		return;
+
+	stopWorkers();
+	numWorkers = threadCount;
+	isPinned = pinThreads;
+	workers.reset(new Worker[numWorkers]);
+	for (int i = 0; i < numWorkers; i++)
+	{
+		Worker& worker = workers[i];
+		worker.processor = topology.processors[int64_t(i) * numProcessors / numWorkers % numProcessors];
+		if (!isPinned)
+			worker.processor.node = 0;
+		worker.isNodeLeader = i == 0 || worker.processor.node != workers[i - 1].processor.node;
+	}
+	// A restarted worker must not take the last job of the workers it replaces for a new one, so
+	// it starts from the current generation.
+	int currentGeneration;
+	{
+		lock_guard<mutex> guard(lock);
+		isStopping = false;
+		currentGeneration = generation;
+	}
+	for (int i = isPinned ? 0 : 1; i < numWorkers; i++)
+		threads.emplace_back(&TileScheduler::workerLoop, this, i, currentGeneration);
+}
+
+int TileScheduler::numNodes()
+{
+	startWorkers();
+	return workers[numWorkers - 1].processor.node + 1;
+}
+
+void TileScheduler::stopWorkers()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		isStopping = true;
+	}
+	jobReady.notify_all();
+	for (thread& t : threads)
+		t.join();
+	threads.clear();
+	workers.reset();
+	numWorkers = 0;
+}
+
+// The calling thread takes part as worker 0 and returns once every worker has finished.
+void TileScheduler::execute(const Job& newJob)
+{
+	startWorkers();
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < numWorkers; i++)
+	{
+		Worker& worker = workers[i];
+		lock_guard<mutex> guard(worker.lock);
+		worker.front = int(newJob.count * int64_t(i) / numWorkers);
+		worker.back = int(newJob.count * int64_t(i + 1) / numWorkers);
+		worker.busyTime = 0.0;
+		worker.numPixels = 0;
+	}
+	nextBlock = 0;
+	numSteals = 0;
+
+	{
+		lock_guard<mutex> guard(lock);
+		job = newJob;
+		numBusyWorkers = isPinned ? numWorkers : numWorkers - 1;
+		generation++;
+	}
+	jobReady.notify_all();
+	if (!isPinned)
+		runJob(0);
+	{
+		unique_lock<mutex> guard(lock);
+		jobDone.wait(guard, [&]() { return numBusyWorkers == 0; });
+	}
+
+	if (newJob.kind != JobKind::Tiles)
+		return;
+	stats.wall = millisecondsBetween(start, chrono::steady_clock::now());
+	stats.busy = 0.0;
+	stats.numNodes = 0;
+	for (int node = 0; node < maxNumaNodes; node++)
+	{
+		stats.nodeThreads[node] = 0;
+		stats.nodePixels[node] = 0;
+		stats.nodeBusy[node] = 0.0;
+	}
+	for (int i = 0; i < numWorkers; i++)
+	{
+		const Worker& worker = workers[i];
+		int node = worker.processor.node;
+		stats.busy += worker.busyTime;
+		stats.numNodes = std::max(stats.numNodes, node + 1);
+		stats.nodeThreads[node]++;
+		stats.nodePixels[node] += worker.numPixels;
+		stats.nodeBusy[node] += worker.busyTime;
+	}
+	stats.idle = std::max(0.0, stats.wall * numWorkers - stats.busy);
+	stats.numThreads = numWorkers;
+	stats.numTiles = newJob.count;
+	stats.numSteals = numSteals.load();
+}
+
+void TileScheduler::workerLoop(int index, int lastGeneration)
+{
+	if (isPinned)
+		pinCurrentThread(workers[index].processor);
+	for (;;)
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			jobReady.wait(guard, [&]() { return isStopping || generation != lastGeneration; });
+			if (isStopping)
+				return;
+			lastGeneration = generation;
+		}
+		runJob(index);
+		{
+			lock_guard<mutex> guard(lock);
+			numBusyWorkers--;
+		}
+		jobDone.notify_one();
+	}
+}
+
+void TileScheduler::runJob(int index)
+{
+	Worker& worker = workers[index];
+	if (job.kind == JobKind::Nodes)
+	{
+		if (worker.isNodeLeader)
+			job.invoke(job.context, worker.processor.node, worker.processor.node + 1, worker.scratch);
+		return;
+	}
+	if (job.kind == JobKind::Tiles)
+	{
+		int tile;
+		while (takeTile(index, tile))
+		{
+			worker.scratch.reset();
+			auto tileStart = chrono::steady_clock::now();
+			job.invoke(job.context, tile, tile + 1, worker.scratch);
+			worker.busyTime += millisecondsBetween(tileStart, chrono::steady_clock::now());
+			worker.numPixels += tiles[tile].width * tiles[tile].height;
+		}
+		return;
+	}
+
+	for (int first = nextBlock.fetch_add(job.blockSize); first < job.count; first = nextBlock.fetch_add(job.blockSize))
+	{
+		worker.scratch.reset();
+		job.invoke(job.context, first, std::min(first + job.blockSize, job.count), worker.scratch);
+	}
+}
+
+// No tiles are added once a run has started, so a worker that finds every deque empty is done;
+// the tiles still in flight are finished by the workers that took them.
+bool TileScheduler::takeTile(int index, int& tile)
+{
+	{
+		Worker& worker = workers[index];
+		lock_guard<mutex> guard(worker.lock);
+		if (worker.front < worker.back)
+		{
+			tile = worker.front++;
+			return true;
+		}
+	}
+	for (int i = 1; i < numWorkers && job.allowStealing; i++)
+	{
+		Worker& victim = workers[(index + i) % numWorkers];
+		lock_guard<mutex> guard(victim.lock);
+		if (victim.front < victim.back)
+		{
+			tile = --victim.back;
+			numSteals++;
+			return true;
+		}
+	}
+	return false;
+}
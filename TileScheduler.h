@@ -0,0 +1,197 @@
+#pragma once
+#include "Arena.h"
+#include "Numa.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile
+{
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Timings of the last tiled run in milliseconds. busy is the time all workers together spent
+// inside the work function and idle the rest of numThreads * wall, which includes searching for
+// tiles to steal and waiting for the last tile to finish. The node arrays split the work by the
+// NUMA node of the worker that did it.
+struct TileSchedulerStats
+{
+	double wall;
+	double busy;
+	double idle;
+	int numThreads;
+	int numTiles;
+	int numSteals;
+	int numNodes;
+	int nodeThreads[maxNumaNodes];
+	long long nodePixels[maxNumaNodes];
+	double nodeBusy[maxNumaNodes];
+};
+
+// Splits a width by height frame into tiles, orders them along a Morton curve and deals each
+// worker a contiguous run of that order into its own deque, so a worker starts on a compact
+// region of the frame. Workers take tiles from the front of their own deque and, once it is
+// empty, steal from the back of someone else's, which takes the tiles furthest from where that
+// worker is busy. Expensive regions such as reflective objects therefore end up shared between
+// all threads instead of holding up the one that was given them.
+//
+// The worker threads are started once and kept waiting between runs, and each owns an arena that
+// is reset before every tile or block it is handed, so a run does not allocate once the tile
+// list and the arenas have reached their size.
+//
+// With pinThreads every worker is pinned to one processor, spread evenly over the NUMA nodes so
+// that consecutive workers, and with them consecutive runs of tiles, share a node. The calling
+// thread then only waits instead of working, since it cannot be pinned without affecting the rest
+// of the application. Memory a worker touches first, such as its arena, ends up on its node.
+class TileScheduler
+{
+public:
+	int tileSize = 16;
+	int numThreads = 0;
+	bool pinThreads = false;
+	TileSchedulerStats stats = {};
+
+	TileScheduler() = default;
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+	~TileScheduler();
+
+	// function(tile, scratch) for every tile of the frame. Without stealing every tile is done by
+	// the worker it was dealt to, which places memory touched there on that worker's node.
+	template <typename Function>
+	void run(int width, int height, Function function, bool allowStealing = true);
+	template <typename Function>
+	void forEachPixel(int width, int height, Function function);
+	// function(first, last, scratch) for blocks of blockSize items until count is reached, handed
+	// out in order from a shared counter.
+	template <typename Function>
+	void parallelForBlocks(int count, int blockSize, Function function);
+	// function(node) once for every NUMA node, called from a worker on that node.
+	template <typename Function>
+	void forEachNode(Function function);
+	int numNodes();
+private:
+	enum class JobKind
+	{
+		Blocks,
+		Tiles,
+		Nodes
+	};
+
+	struct Job
+	{
+		void* context;
+		void (*invoke)(void* context, int first, int last, Arena& scratch);
+		JobKind kind;
+		bool allowStealing;
+		int count;
+		int blockSize;
+	};
+
+	struct Worker
+	{
+		std::mutex lock;
+		int front;
+		int back;
+		double busyTime;
+		long long numPixels;
+		Processor processor;
+		bool isNodeLeader;
+		Arena scratch;
+	};
+
+	std::vector<Tile> tiles;
+	std::vector<uint64_t> tileOrder;
+	int tilesWidth = 0;
+	int tilesHeight = 0;
+	int tilesSize = 0;
+
+	std::vector<std::thread> threads;
+	std::unique_ptr<Worker[]> workers;
+	int numWorkers = 0;
+	bool isPinned = false;
+	NumaTopology topology;
+	std::mutex lock;
+	std::condition_variable jobReady;
+	std::condition_variable jobDone;
+	Job job = {};
+	int generation = 0;
+	int numBusyWorkers = 0;
+	bool isStopping = false;
+	std::atomic<int> nextBlock;
+	std::atomic<int> numSteals;
+
+	template <typename Task>
+	static Job makeJob(Task& task, JobKind kind, int count, int blockSize);
+	void buildTiles(int width, int height);
+	void startWorkers();
+	void stopWorkers();
+	void execute(const Job& job);
+	void workerLoop(int index, int lastGeneration);
+	void runJob(int index);
+	bool takeTile(int index, int& tile);
+};
+
+// The task is called through a plain function pointer rather than std::function, which may
+// allocate to hold a capturing lambda.
+template <typename Task>
+TileScheduler::Job TileScheduler::makeJob(Task& task, JobKind kind, int count, int blockSize)
+{
+	Job job;
+	job.context = &task;
+	job.invoke = [](void* context, int first, int last, Arena& scratch)
+	{
+		(*static_cast<Task*>(context))(first, last, scratch);
+	};
+	job.kind = kind;
+	job.allowStealing = true;
+	job.count = count;
+	job.blockSize = blockSize;
+	return job;
+}
+
+template <typename Function>
+void TileScheduler::run(int width, int height, Function function, bool allowStealing)
+{
+	buildTiles(width, height);
+	auto task = [&](int tile, int, Arena& scratch)
+	{
+		function(tiles[tile], scratch);
+	};
+	Job job = makeJob(task, JobKind::Tiles, int(tiles.size()), 1);
+	job.allowStealing = allowStealing;
+	execute(job);
+}
+
+template <typename Function>
+void TileScheduler::forEachPixel(int width, int height, Function function)
+{
+	run(width, height, [&](const Tile& tile, Arena&)
+	{
+		for (int y = tile.y; y < tile.y + tile.height; y++)
+			for (int x = tile.x; x < tile.x + tile.width; x++)
+				function(y * width + x);
+	});
+}
+
+template <typename Function>
+void TileScheduler::parallelForBlocks(int count, int blockSize, Function function)
+{
+	execute(makeJob(function, JobKind::Blocks, count, blockSize));
+}
+
+template <typename Function>
+void TileScheduler::forEachNode(Function function)
+{
+	auto task = [&](int node, int, Arena&)
+	{
+		function(node);
+	};
+	execute(makeJob(task, JobKind::Nodes, 0, 1));
+}
@@ -0,0 +1,128 @@
+#include "WideBVH.h"
+#include <limits>
+
+template <int Width>
+void WideBVH<Width>::build(const BVH& binary)
+{
+	nodes.clear();
+	binarySlots.assign(binary.nodes.size(), -1);
+	primitiveIndices = binary.primitiveIndices;
+
+	if (binary.isEmpty())
+		return;
+
+	nodes.reserve(binary.nodes.size() / 2 + 1);
+	if (binary.nodes[0].isLeaf())
+	{
+		nodes.push_back(WideBVHNode<Width>());
+		for (int slot = 0; slot < Width; slot++)
+		{
+			setSlot(0, slot, AABB(vec3(std::numeric_limits<float>::infinity())));
+			nodes[0].children[slot] = 0;
+			nodes[0].counts[slot] = -1;
+		}
+		setSlot(0, 0, binary.nodes[0].bounds);
+		nodes[0].children[0] = binary.nodes[0].firstPrimitive;
+		nodes[0].counts[0] = binary.nodes[0].numPrimitives;
+		binarySlots[0] = 0;
+		return;
+	}
+	collapse(binary, 0);
+}
+
+template <int Width>
+int WideBVH<Width>::collapse(const BVH& binary, int binaryNode)
+{
+	int slots[Width];
+	int numSlots = 2;
+	slots[0] = binary.nodes[binaryNode].leftChild;
+	slots[1] = binary.nodes[binaryNode].leftChild + 1;
+
+	while (numSlots < Width)
+	{
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (int i = 0; i < numSlots; i++)
+		{
+			const BVHNode& candidate = binary.nodes[slots[i]];
+			if (!candidate.isLeaf() && candidate.bounds.surfaceArea() > largestArea)
+			{
+				largest = i;
+				largestArea = candidate.bounds.surfaceArea();
+			}
+		}
+		if (largest == -1)
+			break;
+
+		int expanded = slots[largest];
+		slots[largest] = binary.nodes[expanded].leftChild;
+		slots[numSlots++] = binary.nodes[expanded].leftChild + 1;
+	}
+
+	int nodeIndex = int(nodes.size());
+	nodes.push_back(WideBVHNode<Width>());
+	for (int slot = 0; slot < Width; slot++)
+	{
+		if (slot >= numSlots)
+		{
+			setSlot(nodeIndex, slot, AABB(vec3(std::numeric_limits<float>::infinity())));
+			nodes[nodeIndex].children[slot] = 0;
+			nodes[nodeIndex].counts[slot] = -1;
+			continue;
+		}
+
+		const BVHNode& child = binary.nodes[slots[slot]];
+		binarySlots[slots[slot]] = nodeIndex * Width + slot;
+		setSlot(nodeIndex, slot, child.bounds);
+		if (child.isLeaf())
+		{
+			nodes[nodeIndex].children[slot] = child.firstPrimitive;
+			nodes[nodeIndex].counts[slot] = child.numPrimitives;
+		}
+		else
+		{
+			int childIndex = collapse(binary, slots[slot]);
+			nodes[nodeIndex].children[slot] = childIndex;
+			nodes[nodeIndex].counts[slot] = 0;
+		}
+	}
+	return nodeIndex;
+}
+
+template <int Width>
+void WideBVH<Width>::setSlot(int node, int slot, const AABB& bounds)
+{
+	WideBVHNode<Width>& wideNode = nodes[node];
+	wideNode.minX[slot] = bounds.min.x;
+	wideNode.minY[slot] = bounds.min.y;
+	wideNode.minZ[slot] = bounds.min.z;
+	wideNode.maxX[slot] = bounds.max.x;
+	wideNode.maxY[slot] = bounds.max.y;
+	wideNode.maxZ[slot] = bounds.max.z;
+}
+
+template <int Width>
+void WideBVH<Width>::refit(const BVH& binary, int primitive)
+{
+	for (int binaryNode = binary.primitiveLeaves[primitive]; binaryNode != -1; binaryNode = binary.nodes[binaryNode].parent)
+	{
+		int slot = binarySlots[binaryNode];
+		if (slot != -1)
+			setSlot(slot / Width, slot % Width, binary.nodes[binaryNode].bounds);
+	}
+}
+
+template <int Width>
+size_t WideBVH<Width>::memoryBytes() const
+{
+	return nodes.size() * sizeof(WideBVHNode<Width>) + primitiveIndices.size() * sizeof(int);
+}
+
+template <int Width>
+bool WideBVH<Width>::isEmpty() const
+{
+	return nodes.empty();
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
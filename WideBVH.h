@@ -0,0 +1,196 @@
+#pragma once
+#include "BVH.h"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_BVH_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+const int defaultBVHWidth = 8;
+#else
+const int defaultBVHWidth = 4;
+#endif
+
+// A node of a Width-ary BVH with the child bounds stored as structure of arrays, so all children
+// can be tested against a ray with one vectorized slab test. A child is an interior node when its
+// count is 0, a leaf of count primitives starting at child otherwise, and an empty slot when -1.
+// Empty slots hold an inverted box, but the slab test orders each axis's two distances and so still
+// reports them as hit; traversal has to skip them by their count.
+template <int Width>
+struct alignas(32) WideBVHNode
+{
+	float minX[Width], minY[Width], minZ[Width];
+	float maxX[Width], maxY[Width], maxZ[Width];
+	int children[Width];
+	int counts[Width];
+};
+
+struct WideRay
+{
+	vec3 origin;
+	vec3 inverseDirection;
+	WideRay() {}
+	WideRay(vec3 origin, vec3 direction) : origin(origin), inverseDirection(1.0f / direction)
+	{}
+};
+
+template <int Width>
+int intersectChildren(const WideBVHNode<Width>& node, const WideRay& ray, float tMax, float* tEnter)
+{
+	int hitMask = 0;
+	for (int i = 0; i < Width; i++)
+	{
+		float tx1 = (node.minX[i] - ray.origin.x) * ray.inverseDirection.x;
+		float tx2 = (node.maxX[i] - ray.origin.x) * ray.inverseDirection.x;
+		float ty1 = (node.minY[i] - ray.origin.y) * ray.inverseDirection.y;
+		float ty2 = (node.maxY[i] - ray.origin.y) * ray.inverseDirection.y;
+		float tz1 = (node.minZ[i] - ray.origin.z) * ray.inverseDirection.z;
+		float tz2 = (node.maxZ[i] - ray.origin.z) * ray.inverseDirection.z;
+		float tNear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0f));
+		float tFar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), tMax));
+		tEnter[i] = tNear;
+		if (tNear <= tFar)
+			hitMask |= 1 << i;
+	}
+	return hitMask;
+}
+
+#ifdef WIDE_BVH_SSE
+template <>
+inline int intersectChildren<4>(const WideBVHNode<4>& node, const WideRay& ray, float tMax, float* tEnter)
+{
+	__m128 originX = _mm_set1_ps(ray.origin.x);
+	__m128 originY = _mm_set1_ps(ray.origin.y);
+	__m128 originZ = _mm_set1_ps(ray.origin.z);
+	__m128 inverseX = _mm_set1_ps(ray.inverseDirection.x);
+	__m128 inverseY = _mm_set1_ps(ray.inverseDirection.y);
+	__m128 inverseZ = _mm_set1_ps(ray.inverseDirection.z);
+
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), originX), inverseX);
+	__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), originX), inverseX);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), originY), inverseY);
+	__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), originY), inverseY);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), originZ), inverseZ);
+	__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), originZ), inverseZ);
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_max_ps(_mm_min_ps(tz1, tz2), _mm_setzero_ps()));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_min_ps(_mm_max_ps(tz1, tz2), _mm_set1_ps(tMax)));
+	_mm_storeu_ps(tEnter, tNear);
+	return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline int intersectChildren<8>(const WideBVHNode<8>& node, const WideRay& ray, float tMax, float* tEnter)
+{
+	__m256 originX = _mm256_set1_ps(ray.origin.x);
+	__m256 originY = _mm256_set1_ps(ray.origin.y);
+	__m256 originZ = _mm256_set1_ps(ray.origin.z);
+	__m256 inverseX = _mm256_set1_ps(ray.inverseDirection.x);
+	__m256 inverseY = _mm256_set1_ps(ray.inverseDirection.y);
+	__m256 inverseZ = _mm256_set1_ps(ray.inverseDirection.z);
+
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minX), originX), inverseX);
+	__m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxX), originX), inverseX);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minY), originY), inverseY);
+	__m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxY), originY), inverseY);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minZ), originZ), inverseZ);
+	__m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxZ), originZ), inverseZ);
+
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), _mm256_max_ps(_mm256_min_ps(tz1, tz2), _mm256_setzero_ps()));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), _mm256_min_ps(_mm256_max_ps(tz1, tz2), _mm256_set1_ps(tMax)));
+	_mm256_storeu_ps(tEnter, tNear);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+}
+#endif
+
+template <int Width, typename Intersect>
+void traverseWideBVH(const WideBVHNode<Width>* nodes, const int* primitiveIndices, vec3 origin, vec3 direction, float& tMax, Intersect intersect);
+
+// Built by collapsing a binary BVH: each wide node absorbs the largest interior descendants of
+// the binary node until it has Width children. Every slot remembers the binary node it stands
+// for, so refitting the binary tree can be mirrored along the same path.
+template <int Width>
+class WideBVH
+{
+public:
+	std::vector<WideBVHNode<Width>> nodes;
+	std::vector<int> primitiveIndices;
+
+	void build(const BVH& binary);
+	void refit(const BVH& binary, int primitive);
+	size_t memoryBytes() const;
+	bool isEmpty() const;
+
+	template <typename Intersect>
+	void traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const;
+private:
+	std::vector<int> binarySlots;
+	int collapse(const BVH& binary, int binaryNode);
+	void setSlot(int node, int slot, const AABB& bounds);
+};
+
+typedef WideBVH<defaultBVHWidth> CpuBVH;
+
+template <int Width>
+template <typename Intersect>
+void WideBVH<Width>::traverse(vec3 origin, vec3 direction, float& tMax, Intersect intersect) const
+{
+	if (!nodes.empty())
+		traverseWideBVH(nodes.data(), primitiveIndices.data(), origin, direction, tMax, intersect);
+}
+
+// The traversal of a non-empty WideBVH over raw arrays, so a tree can also be traced straight from
+// a mapped file.
+template <int Width, typename Intersect>
+void traverseWideBVH(const WideBVHNode<Width>* nodes, const int* primitiveIndices, vec3 origin, vec3 direction, float& tMax, Intersect intersect)
+{
+	struct StackEntry
+	{
+		int child;
+		int count;
+		float tEnter;
+	};
+
+	WideRay ray = WideRay(origin, direction);
+	StackEntry stack[maxBVHDepth * Width];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.0f };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		if (entry.tEnter > tMax)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (int i = entry.child; i < entry.child + entry.count; i++)
+				intersect(primitiveIndices[i]);
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = nodes[entry.child];
+		float tEnter[Width];
+		int hitMask = intersectChildren<Width>(node, ray, tMax, tEnter);
+
+		// Sort the hit children far to near with an insertion sort, so the nearest is popped first.
+		int first = stackSize;
+		for (int i = 0; i < Width; i++)
+		{
+			if (!(hitMask & (1 << i)) || node.counts[i] < 0)
+				continue;
+			StackEntry child = { node.children[i], node.counts[i], tEnter[i] };
+			int j = stackSize++;
+			while (j > first && stack[j - 1].tEnter < child.tEnter)
+			{
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 textureCoord;
+
+// Resolves the internal render target to the window. The frame is scaled to the window's size,
+// with a Catmull-Rom filter or plain bilinear filtering, multiplied by the exposure and tone
+// mapped. Clamp leaves the colour as it is, which the window's 8 bit framebuffer then cuts off
+// at one.
+const int clampToneMapping = 0;
+const int reinhardToneMapping = 1;
+const int acesToneMapping = 2;
+
+uniform sampler2D sourceTexture;
+uniform vec2 outputSize;
+uniform bool useBicubic;
+uniform int toneMapping;
+uniform float exposure;
+
+// The 4x4 Catmull-Rom kernel in nine bilinear fetches: the two middle taps on each axis have
+// weights of the same sign, so a single fetch between them at the right offset returns their
+// weighted sum. The kernel overshoots at sharp edges, so the result is kept from going negative.
+vec3 sampleCatmullRom(vec2 uv)
+{
+    vec2 size = vec2(textureSize(sourceTexture, 0));
+    vec2 position = uv * size;
+    vec2 center = floor(position - 0.5) + 0.5;
+    vec2 f = position - center;
+
+    vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+    vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+    vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+    vec2 w3 = f * f * (-0.5 + 0.5 * f);
+    vec2 w12 = w1 + w2;
+
+    vec2 uv0 = (center - 1.0) / size;
+    vec2 uv12 = (center + w2 / w12) / size;
+    vec2 uv3 = (center + 2.0) / size;
+
+    vec3 color = vec3(0.0);
+    color += textureLod(sourceTexture, vec2(uv0.x, uv0.y), 0.0).rgb * w0.x * w0.y;
+    color += textureLod(sourceTexture, vec2(uv12.x, uv0.y), 0.0).rgb * w12.x * w0.y;
+    color += textureLod(sourceTexture, vec2(uv3.x, uv0.y), 0.0).rgb * w3.x * w0.y;
+    color += textureLod(sourceTexture, vec2(uv0.x, uv12.y), 0.0).rgb * w0.x * w12.y;
+    color += textureLod(sourceTexture, vec2(uv12.x, uv12.y), 0.0).rgb * w12.x * w12.y;
+    color += textureLod(sourceTexture, vec2(uv3.x, uv12.y), 0.0).rgb * w3.x * w12.y;
+    color += textureLod(sourceTexture, vec2(uv0.x, uv3.y), 0.0).rgb * w0.x * w3.y;
+    color += textureLod(sourceTexture, vec2(uv12.x, uv3.y), 0.0).rgb * w12.x * w3.y;
+    color += textureLod(sourceTexture, vec2(uv3.x, uv3.y), 0.0).rgb * w3.x * w3.y;
+    return max(color, vec3(0.0));
+}
+
+// Narkowicz's fit of the ACES filmic curve.
+vec3 aces(vec3 color)
+{
+    return clamp(color * (2.51 * color + 0.03) / (color * (2.43 * color + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy / outputSize;
+    vec3 color = useBicubic ? sampleCatmullRom(uv) : textureLod(sourceTexture, uv, 0.0).rgb;
+    color *= exposure;
+
+    if (toneMapping == reinhardToneMapping)
+        color = color / (1.0 + color);
+    else if (toneMapping == acesToneMapping)
+        color = aces(color);
+    FragColor = vec4(color, 1.0);
+}
@@ -0,0 +1,271 @@
+#version 330 core
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec2 momentsOutput;
+
+in vec2 textureCoord;
+
+// The passes of the à-trous filter in Denoiser.cpp, one per draw. The variance stage turns the
+// radiance and moments into colour with the variance of its mean in alpha, and each filter stage
+// reads the previous stage's output. The last one writes to the output with an opaque alpha.
+// With temporal accumulation the reprojection stage runs first and writes the new history, its
+// alpha holding how many frames it spans, and the present stage copies it to the output when
+// there is no spatial filtering.
+const int estimateVarianceStage = 0;
+const int filterStage = 1;
+const int finalFilterStage = 2;
+const int reprojectStage = 3;
+const int presentStage = 4;
+
+const int minSamplesForPixelVariance = 4;
+const float kernelWeights[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+const float varianceBlurWeights[2] = float[2](1.0 / 2.0, 1.0 / 4.0);
+const float depthEpsilon = 0.001;
+const float luminanceEpsilon = 0.0001;
+const float minHistoryWeight = 0.01;
+const float maxHistoryLength = 256.0;
+
+uniform int stage;
+uniform int stepSize;
+uniform int numSamples;
+uniform float colorPhi;
+uniform float depthPhi;
+uniform float albedoPhi;
+
+uniform bool isAccumulated;
+uniform bool hasHistory;
+uniform float historyBlend;
+uniform float depthTolerance;
+uniform float normalTolerance;
+uniform vec3 cameraOrigin;
+uniform vec3 cameraForward;
+uniform vec3 cameraRight;
+uniform vec3 cameraUp;
+uniform vec3 previousOrigin;
+uniform vec3 previousForward;
+uniform vec3 previousRight;
+uniform vec3 previousUp;
+
+uniform sampler2D colorTexture;
+uniform sampler2D albedoTexture;
+uniform sampler2D normalDepthTexture;
+uniform sampler2D momentsTexture;
+uniform sampler2D historyColorTexture;
+uniform sampler2D historyMomentsTexture;
+uniform sampler2D historyNormalDepthTexture;
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+bool isInside(ivec2 pixel)
+{
+    return all(greaterThanEqual(pixel, ivec2(0))) && all(lessThan(pixel, textureSize(colorTexture, 0)));
+}
+
+float fetchDepth(ivec2 pixel)
+{
+    return isInside(pixel) ? texelFetch(normalDepthTexture, pixel, 0).w : 0.0;
+}
+
+float depthSlope(float depth, float previous, float next)
+{
+    float backward = previous > 0.0 ? depth - previous : 3.4e38;
+    float forward = next > 0.0 ? next - depth : 3.4e38;
+    float slope = abs(backward) < abs(forward) ? backward : forward;
+    return slope == 3.4e38 ? 0.0 : slope;
+}
+
+vec2 depthSlopes(ivec2 pixel, float depth)
+{
+    float slopeX = depthSlope(depth, fetchDepth(pixel - ivec2(1, 0)), fetchDepth(pixel + ivec2(1, 0)));
+    float slopeY = depthSlope(depth, fetchDepth(pixel - ivec2(0, 1)), fetchDepth(pixel + ivec2(0, 1)));
+    return vec2(slopeX, slopeY);
+}
+
+float featureWeight(vec4 normalDepth, vec3 albedo, vec2 slope, ivec2 tap, vec2 offset)
+{
+    vec4 tapNormalDepth = texelFetch(normalDepthTexture, tap, 0);
+    vec3 albedoDifference = albedo - texelFetch(albedoTexture, tap, 0).rgb;
+    float normalWeight = pow(max(dot(normalDepth.xyz, tapNormalDepth.xyz), 0.0), 128.0);
+    float depthTerm = abs(normalDepth.w - tapNormalDepth.w) / (depthPhi * abs(dot(slope, offset)) + depthEpsilon);
+    float albedoTerm = dot(albedoDifference, albedoDifference) / albedoPhi;
+    return normalWeight * exp(-(depthTerm + albedoTerm));
+}
+
+// Accumulated history spans as many frames as its alpha says, but once the blend stops falling
+// the moving average is only worth (2 - historyBlend) / historyBlend of them.
+float sampleCount(float historyLength)
+{
+    if (!isAccumulated)
+        return float(numSamples);
+    return numSamples * min(historyLength, (2.0 - historyBlend) / historyBlend);
+}
+
+vec4 estimateVariance(ivec2 pixel)
+{
+    vec4 center = texelFetch(colorTexture, pixel, 0);
+    vec3 color = center.rgb;
+    vec2 moments = texelFetch(momentsTexture, pixel, 0).xy;
+    vec4 normalDepth = texelFetch(normalDepthTexture, pixel, 0);
+    float numPixelSamples = sampleCount(center.a);
+    if (numPixelSamples < minSamplesForPixelVariance && normalDepth.w > 0.0)
+    {
+        vec3 albedo = texelFetch(albedoTexture, pixel, 0).rgb;
+        vec2 slope = depthSlopes(pixel, normalDepth.w);
+        vec2 sum = moments;
+        float sumWeight = 1.0;
+        for (int y = -2; y <= 2; y++)
+        {
+            for (int x = -2; x <= 2; x++)
+            {
+                ivec2 tap = pixel + ivec2(x, y);
+                if ((x == 0 && y == 0) || !isInside(tap))
+                    continue;
+                float weight = featureWeight(normalDepth, albedo, slope, tap, vec2(x, y));
+                sum += weight * texelFetch(momentsTexture, tap, 0).xy;
+                sumWeight += weight;
+            }
+        }
+        moments = sum / sumWeight;
+    }
+    return vec4(color, max(moments.y - moments.x * moments.x, 0.0) / numPixelSamples);
+}
+
+vec4 filterColor(ivec2 pixel)
+{
+    vec4 center = texelFetch(colorTexture, pixel, 0);
+    vec4 normalDepth = texelFetch(normalDepthTexture, pixel, 0);
+    if (normalDepth.w == 0.0)
+        return center;
+
+    vec3 albedo = texelFetch(albedoTexture, pixel, 0).rgb;
+    vec2 slope = depthSlopes(pixel, normalDepth.w) * float(stepSize);
+
+    float blurredVariance = 0.0;
+    for (int y = -1; y <= 1; y++)
+    {
+        for (int x = -1; x <= 1; x++)
+        {
+            ivec2 tap = pixel + ivec2(x, y);
+            if (isInside(tap))
+                blurredVariance += varianceBlurWeights[abs(x)] * varianceBlurWeights[abs(y)] * texelFetch(colorTexture, tap, 0).a;
+        }
+    }
+    float luminanceScale = 1.0 / (colorPhi * sqrt(blurredVariance) + luminanceEpsilon);
+    float centerLuminance = luminance(center.rgb);
+
+    float sumWeight = kernelWeights[0] * kernelWeights[0];
+    vec3 sumColor = center.rgb * sumWeight;
+    float sumVariance = center.a * sumWeight * sumWeight;
+    for (int y = -2; y <= 2; y++)
+    {
+        for (int x = -2; x <= 2; x++)
+        {
+            ivec2 tap = pixel + ivec2(x, y) * stepSize;
+            if ((x == 0 && y == 0) || !isInside(tap))
+                continue;
+            vec4 tapColor = texelFetch(colorTexture, tap, 0);
+            float luminanceTerm = abs(centerLuminance - luminance(tapColor.rgb)) * luminanceScale;
+            float weight = kernelWeights[abs(x)] * kernelWeights[abs(y)] * featureWeight(normalDepth, albedo, slope, tap, vec2(x, y)) * exp(-luminanceTerm);
+
+            sumWeight += weight;
+            sumColor += tapColor.rgb * weight;
+            sumVariance += tapColor.a * weight * weight;
+        }
+    }
+    return vec4(sumColor / sumWeight, sumVariance / (sumWeight * sumWeight));
+}
+
+// Where a point offset from the previous camera's origin appeared in its frame, in the units of
+// gl_FragCoord, following the camera rays of fragmentshader.glsl backwards. Points behind the
+// camera land outside the frame.
+vec2 previousFragCoord(vec3 offset)
+{
+    float forward = dot(offset, previousForward) / dot(previousForward, previousForward);
+    if (forward <= 0.0)
+        return vec2(-1.0);
+    vec2 screen = vec2(dot(offset, previousRight) / dot(previousRight, previousRight), dot(offset, previousUp) / dot(previousUp, previousUp)) / forward;
+    return (screen + 0.5) * vec2(textureSize(colorTexture, 0));
+}
+
+// A history texel is reused if it saw the same surface: a miss for a miss, otherwise a hit at the
+// expected distance from the previous camera with a similar normal.
+bool isSameSurface(ivec2 tap, vec4 normalDepth, float expectedDepth)
+{
+    if (!isInside(tap))
+        return false;
+    vec4 previousNormalDepth = texelFetch(historyNormalDepthTexture, tap, 0);
+    if (normalDepth.w == 0.0 || previousNormalDepth.w == 0.0)
+        return normalDepth.w == previousNormalDepth.w;
+    return abs(previousNormalDepth.w - expectedDepth) <= depthTolerance * expectedDepth &&
+        dot(normalDepth.xyz, previousNormalDepth.xyz) >= normalTolerance;
+}
+
+// Blends this frame with the history found by reprojecting its surface, starting the history
+// over wherever none of the four nearest texels saw the same surface.
+vec4 reproject(ivec2 pixel, out vec2 moments)
+{
+    vec3 color = texelFetch(colorTexture, pixel, 0).rgb;
+    moments = texelFetch(momentsTexture, pixel, 0).xy;
+    if (!hasHistory)
+        return vec4(color, 1.0);
+
+    vec4 normalDepth = texelFetch(normalDepthTexture, pixel, 0);
+    vec2 screen = (gl_FragCoord.xy / vec2(textureSize(colorTexture, 0))) - 0.5;
+    vec3 direction = normalize(cameraForward + screen.x * cameraRight + screen.y * cameraUp);
+    vec3 offset = normalDepth.w > 0.0 ? cameraOrigin + direction * normalDepth.w - previousOrigin : direction;
+    float expectedDepth = length(offset);
+
+    vec2 position = previousFragCoord(offset) - 0.5;
+    ivec2 base = ivec2(floor(position));
+    vec2 fraction = position - vec2(base);
+    float sumWeight = 0.0;
+    vec4 sumHistory = vec4(0.0);
+    vec2 sumMoments = vec2(0.0);
+    for (int y = 0; y <= 1; y++)
+    {
+        for (int x = 0; x <= 1; x++)
+        {
+            ivec2 tap = base + ivec2(x, y);
+            if (!isSameSurface(tap, normalDepth, expectedDepth))
+                continue;
+            float weight = (x == 0 ? 1.0 - fraction.x : fraction.x) * (y == 0 ? 1.0 - fraction.y : fraction.y);
+            sumWeight += weight;
+            sumHistory += texelFetch(historyColorTexture, tap, 0) * weight;
+            sumMoments += texelFetch(historyMomentsTexture, tap, 0).xy * weight;
+        }
+    }
+    if (sumWeight < minHistoryWeight)
+        return vec4(color, 1.0);
+
+    vec4 history = sumHistory / sumWeight;
+    float historyLength = min(history.a + 1.0, maxHistoryLength);
+    float blend = max(1.0 / historyLength, historyBlend);
+    moments = mix(sumMoments / sumWeight, moments, blend);
+    return vec4(mix(history.rgb, color, blend), historyLength);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    if (stage == reprojectStage)
+    {
+        vec2 moments;
+        FragColor = reproject(pixel, moments);
+        momentsOutput = moments;
+        return;
+    }
+    if (stage == presentStage)
+    {
+        FragColor = vec4(texelFetch(colorTexture, pixel, 0).rgb, 1.0);
+        return;
+    }
+    if (stage == estimateVarianceStage)
+    {
+        FragColor = estimateVariance(pixel);
+        return;
+    }
+    vec4 filtered = filterColor(pixel);
+    FragColor = stage == filterStage ? filtered : vec4(filtered.rgb, 1.0);
+}
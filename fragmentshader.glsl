@@ -1,5 +1,9 @@
 #version 330 core
-out vec4 FragColor;
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec4 albedoOutput;
+layout(location = 2) out vec4 normalDepthOutput;
+layout(location = 3) out vec2 momentsOutput;
+layout(location = 4) out vec4 displayMomentsOutput;
 
 in vec2 textureCoord;
 
@@ -60,17 +64,10 @@ struct HitInfo
     Material material;
     vec3 hitNormal;
 };
-struct Plane
+// <primitive declarations>
+struct Mesh
 {
-    vec3 origin;
-    vec3 normal;
-    Material material;
-    bool isVisible;
-};
-struct Sphere
-{
-    vec3 origin;
-    float radius;
+    int bvhRoot;
     Material material;
     bool isVisible;
 };
@@ -90,96 +87,306 @@ uniform int numSamples;
 uniform int numLightBounces;
 uniform float blurDistance;
 uniform float blurStrength;
+uniform bool writeFeatures;
+uniform int frameIndex;
+
+// Time-sliced accumulation keeps a sample count per tile: how many samples the tile has and how
+// many more it wants. A pass gives each pixel no more than its tile wants and its weight in the
+// running mean as alpha, alongside the mean of its luminance and squared luminance, clamped the
+// way the image is displayed, for judging the tile's error.
+uniform bool useTileSamples;
+uniform isampler2D tileSampleTexture;
+uniform int tileSize;
+
+// With reduced indirect lighting the frame is traced twice: once at a fraction of the resolution
+// for the indirect light alone, with the surface it was traced from written alongside, and once at
+// full resolution for the direct light, which adds the indirect light upsampled from the first.
+const int fullLighting = 0;
+const int directLighting = 1;
+const int indirectLighting = 2;
+uniform int lightingMode;
+uniform sampler2D indirectTexture;
+uniform sampler2D indirectNormalDepthTexture;
+
+// With the G-buffer the primary hit of each pixel's centre ray starts from the rasterized surface,
+// and only the primitives the G-buffer pass does not draw are traced, no further than it.
+uniform bool useGBuffer;
+uniform sampler2D gBufferNormalDepthTexture;
+uniform isampler2D gBufferSurfaceTexture;
 
 uniform vec3 cameraOrigin;
 uniform vec3 cameraForward;
 uniform vec3 cameraRight;
 uniform vec3 cameraUp;
 
-const int maxNumSpheres = 64;
-const int maxNumPlanes = 64;
 const int maxNumLights = 64;
+const int maxNumGroups = 16;
+const int maxNumGroupSpheres = 64;
+const int maxNumMeshes = 16;
 
-uniform Sphere spheres[maxNumSpheres];
-uniform Plane planes[maxNumPlanes];
 uniform Light lights[maxNumLights];
+uniform Sphere groupSpheres[maxNumGroupSpheres];
+uniform int groupFirstSphere[maxNumGroups];
+uniform int groupNumSpheres[maxNumGroups];
+uniform Mesh meshes[maxNumMeshes];
 
-uniform int numSpheres;
-uniform int numPlanes;
 uniform int numLights;
+uniform int numMeshes;
 
 uniform sampler2D hdriTexture;
-
-uint seed = uint(gl_FragCoord.y * screenWidth + gl_FragCoord.x);
+uniform samplerBuffer meshVertices;
+uniform isamplerBuffer meshTriangles;
+uniform samplerBuffer bvhNodes;
+uniform isamplerBuffer bvhPrimitives;
+
+// Five texels per instance, written by Scene::uploadInstances: the top three rows of its inverse
+// transform, its colour and roughness, and its transmission, emission, group and flags. The
+// instance BVH is threaded like the meshes' and is empty with a root of -1.
+const int instanceTexels = 5;
+const int instanceOverridesMaterial = 1;
+const int instanceIsVisible = 2;
+uniform samplerBuffer instanceData;
+uniform samplerBuffer instanceNodes;
+uniform isamplerBuffer instancePrimitives;
+uniform int instanceBVHRoot;
+
+// frameIndex stays zero unless frames are accumulated, so a still image keeps the same noise.
+uint seed = uint(gl_FragCoord.y * screenWidth + gl_FragCoord.x) + uint(frameIndex) * uint(screenWidth * screenHeight);
 
 Material nullMaterial = Material(vec3(0.0, 0.0, 0.0), 0.0, 0.0, 0.0);
 HitInfo nullHitInfo = HitInfo(false, 10000000.0f, nullMaterial, vec3(0.0, 0.0, 0.0));
 
-HitInfo hitPlane(Ray ray, Plane plane)
+// <primitive functions>
+
+float hitAABB(Ray ray, vec3 boundsMin, vec3 boundsMax, float tMax)
 {
-    if (!plane.isVisible)
-        return nullHitInfo;
+    vec3 inverseDirection = 1.0 / ray.direction;
+    vec3 t1 = (boundsMin - ray.origin) * inverseDirection;
+    vec3 t2 = (boundsMax - ray.origin) * inverseDirection;
+    vec3 tSmall = min(t1, t2);
+    vec3 tBig = max(t1, t2);
+
+    float tEnter = max(max(tSmall.x, tSmall.y), tSmall.z);
+    float tExit = min(min(tBig.x, tBig.y), tBig.z);
+
+    if (tExit < max(tEnter, 0.0) || tEnter > tMax)
+        return 10000000.0f;
+    return tEnter;
+}
 
-    float dn = dot(ray.direction, plane.normal);
-    if (dn == 0.0) return nullHitInfo;
+float hitTriangle(Ray ray, int triangle, float tMax)
+{
+    ivec3 indices = texelFetch(meshTriangles, triangle).xyz;
+    vec3 a = texelFetch(meshVertices, indices.x).xyz - ray.origin;
+    vec3 b = texelFetch(meshVertices, indices.y).xyz - ray.origin;
+    vec3 c = texelFetch(meshVertices, indices.z).xyz - ray.origin;
+
+    vec3 absDirection = abs(ray.direction);
+    int kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.direction[kz] < 0.0)
+    {
+        int swap = kx;
+        kx = ky;
+        ky = swap;
+    }
+    vec3 shear = vec3(ray.direction[kx], ray.direction[ky], 1.0) / ray.direction[kz];
 
-    float t = dot(plane.origin - ray.origin, plane.normal)/dn;
-    if (t < 0.001)
-        return nullHitInfo;
-    return HitInfo(true, t, plane.material, plane.normal);
+    vec2 aSheared = vec2(a[kx], a[ky]) - shear.xy * a[kz];
+    vec2 bSheared = vec2(b[kx], b[ky]) - shear.xy * b[kz];
+    vec2 cSheared = vec2(c[kx], c[ky]) - shear.xy * c[kz];
+
+    float u = cSheared.x * bSheared.y - cSheared.y * bSheared.x;
+    float v = aSheared.x * cSheared.y - aSheared.y * cSheared.x;
+    float w = bSheared.x * aSheared.y - bSheared.y * aSheared.x;
+
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+        return 10000000.0f;
+
+    float determinant = u + v + w;
+    if (determinant == 0.0)
+        return 10000000.0f;
+
+    float t = (u * a[kz] + v * b[kz] + w * c[kz]) * shear.z / determinant;
+    if (t < 0.001 || t >= tMax)
+        return 10000000.0f;
+    return t;
 }
 
-HitInfo hitSphere(Ray ray, Sphere sphere)
+// Walks a BVH flattened in depth-first order with miss links: a hit moves on to the next node and
+// a miss jumps past the subtree, so no per-pixel stack is needed.
+HitInfo hitMesh(Ray ray, Mesh mesh, float tMax)
 {
-    if (!sphere.isVisible)
+    if (!mesh.isVisible || mesh.bvhRoot < 0)
         return nullHitInfo;
 
-    vec3 rayOrigin = ray.origin - sphere.origin;
-    vec3 rayDirection = ray.direction;
-
-    float rayDirectionLength = length(rayDirection);
-    float rayOriginLength = length(rayOrigin);
-
-    float a = rayDirectionLength * rayDirectionLength;
-    float b = 2 * dot(rayDirection, rayOrigin);
-    float c = rayOriginLength * rayOriginLength - sphere.radius * sphere.radius;
+    int closestTriangle = -1;
+    int node = mesh.bvhRoot;
+    while (node != -1)
+    {
+        vec4 boundsMin = texelFetch(bvhNodes, 2 * node);
+        vec4 boundsMax = texelFetch(bvhNodes, 2 * node + 1);
+        if (hitAABB(ray, boundsMin.xyz, boundsMax.xyz, tMax) == 10000000.0f)
+        {
+            node = floatBitsToInt(boundsMin.w);
+            continue;
+        }
 
-    float d = b*b - 4.0 * a * c;
-    
-    if (d < 0.0f)
+        int leaf = floatBitsToInt(boundsMax.w);
+        if (leaf >= 0)
+        {
+            int numPrimitives = texelFetch(bvhPrimitives, leaf).r;
+            for (int i = leaf + 1; i <= leaf + numPrimitives; i++)
+            {
+                int triangle = texelFetch(bvhPrimitives, i).r;
+                float t = hitTriangle(ray, triangle, tMax);
+                if (t == 10000000.0f) continue;
+                tMax = t;
+                closestTriangle = triangle;
+            }
+            node = floatBitsToInt(boundsMin.w);
+        }
+        else
+        {
+            node++;
+        }
+    }
+    if (closestTriangle == -1)
         return nullHitInfo;
 
-    float t1 = (-b + sqrt(d))/(2*a);
-    float t2 = (-b - sqrt(d))/(2*a);
+    ivec3 indices = texelFetch(meshTriangles, closestTriangle).xyz;
+    vec3 a = texelFetch(meshVertices, indices.x).xyz;
+    vec3 b = texelFetch(meshVertices, indices.y).xyz;
+    vec3 c = texelFetch(meshVertices, indices.z).xyz;
+    vec3 normal = normalize(cross(b - a, c - a));
+    if (dot(normal, ray.direction) > 0.0)
+        normal = -normal;
+    return HitInfo(true, tMax, mesh.material, normal);
+}
 
-    float t = 10000000.0f;
-    
-    if (t1 > 0.001 && t1 < t)
-        t = t1;
-    if (t2 > 0.001 && t2 < t)
-        t = t2;
-    
-    return HitInfo(true, t, sphere.material, rayPoint(ray, t) - sphere.origin);
+// The material of an instance's sphere, or the instance's own when it overrides it.
+Material instanceMaterial(int instance, Material sphereMaterial)
+{
+    int first = instanceTexels * instance;
+    vec4 flagsGroup = texelFetch(instanceData, first + 4);
+    if ((int(flagsGroup.w) & instanceOverridesMaterial) == 0)
+        return sphereMaterial;
+    vec4 colorRoughness = texelFetch(instanceData, first + 3);
+    return Material(colorRoughness.rgb, colorRoughness.a, flagsGroup.x, flagsGroup.y);
 }
 
-HitInfo hitScene(Ray ray)
+HitInfo hitInstance(Ray ray, int instance, float tMax)
 {
+    int first = instanceTexels * instance;
+    vec4 flagsGroup = texelFetch(instanceData, first + 4);
+    int flags = int(flagsGroup.w);
+    if ((flags & instanceIsVisible) == 0)
+        return nullHitInfo;
+
+    vec4 row0 = texelFetch(instanceData, first);
+    vec4 row1 = texelFetch(instanceData, first + 1);
+    vec4 row2 = texelFetch(instanceData, first + 2);
+    vec4 origin = vec4(ray.origin, 1.0);
+    Ray localRay = Ray(vec3(dot(row0, origin), dot(row1, origin), dot(row2, origin)), vec3(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction)));
+
     HitInfo closestHit = nullHitInfo;
-    for (int i = 0; i < numSpheres; i++)
+    closestHit.t = tMax;
+    int group = int(flagsGroup.z);
+    int firstSphere = groupFirstSphere[group];
+    for (int i = firstSphere; i < firstSphere + groupNumSpheres[group]; i++)
     {
-        HitInfo hitInfo = hitSphere(ray, spheres[i]);
+        HitInfo hitInfo = hitSphere(localRay, groupSpheres[i]);
         if (!hitInfo.hasHit) continue;
         if (hitInfo.t < closestHit.t) closestHit = hitInfo;
     }
-    for (int i = 0; i < numPlanes; i++)
+    if (!closestHit.hasHit)
+        return nullHitInfo;
+
+    vec3 normal = closestHit.hitNormal;
+    closestHit.hitNormal = normal.x * row0.xyz + normal.y * row1.xyz + normal.z * row2.xyz;
+    closestHit.material = instanceMaterial(instance, closestHit.material);
+    return closestHit;
+}
+
+// The same stackless walk as hitMesh, over the instances' bounds in world space.
+HitInfo hitInstances(Ray ray, HitInfo closestHit)
+{
+    int node = instanceBVHRoot;
+    while (node != -1)
     {
-        HitInfo hitInfo = hitPlane(ray, planes[i]);
-        if (!hitInfo.hasHit) continue;
-        if (hitInfo.t < closestHit.t) closestHit = hitInfo;
+        vec4 boundsMin = texelFetch(instanceNodes, 2 * node);
+        vec4 boundsMax = texelFetch(instanceNodes, 2 * node + 1);
+        if (hitAABB(ray, boundsMin.xyz, boundsMax.xyz, closestHit.t) == 10000000.0f)
+        {
+            node = floatBitsToInt(boundsMin.w);
+            continue;
+        }
+
+        int leaf = floatBitsToInt(boundsMax.w);
+        if (leaf >= 0)
+        {
+            int numPrimitives = texelFetch(instancePrimitives, leaf).r;
+            for (int i = leaf + 1; i <= leaf + numPrimitives; i++)
+            {
+                HitInfo hitInfo = hitInstance(ray, texelFetch(instancePrimitives, i).r, closestHit.t);
+                if (hitInfo.hasHit) closestHit = hitInfo;
+            }
+            node = floatBitsToInt(boundsMin.w);
+        }
+        else
+        {
+            node++;
+        }
     }
     return closestHit;
 }
 
+HitInfo hitTracedScene(Ray ray, HitInfo closestHit)
+{
+    for (int i = 0; i < numMeshes; i++)
+    {
+        HitInfo hitInfo = hitMesh(ray, meshes[i], closestHit.t);
+        if (hitInfo.hasHit) closestHit = hitInfo;
+    }
+    return hitInstances(ray, closestHit);
+}
+
+HitInfo hitScene(Ray ray)
+{
+    return hitTracedScene(ray, hitPrimitives(ray, nullHitInfo));
+}
+
+// The G-buffer holds the hitType and index of the rasterized surface, and for an instance the
+// sphere of its group, or a hitType of -1 where there is none, and its normal and distance. Every
+// primitive but the ones hitTracedPrimitives loops over is rasterized, along with the meshes and
+// instances, so only those are traced. A hitType of -2 marks a pixel the G-buffer could not
+// resolve, which is traced in full.
+HitInfo hitPrimaryRay(Ray ray)
+{
+    if (!useGBuffer)
+        return hitScene(ray);
+
+    HitInfo closestHit = nullHitInfo;
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec3 surface = texelFetch(gBufferSurfaceTexture, pixel, 0).xyz;
+    if (surface.x == -2)
+        return hitScene(ray);
+    if (surface.x >= 0)
+    {
+        Material material;
+        if (surface.x == meshHitType)
+            material = meshes[surface.y].material;
+        else if (surface.x == instanceHitType)
+            material = instanceMaterial(surface.y, groupSpheres[surface.z].material);
+        else
+            material = primitiveMaterial(surface.x, surface.y);
+        vec4 normalDepth = texelFetch(gBufferNormalDepthTexture, pixel, 0);
+        closestHit = HitInfo(true, normalDepth.w, material, normalDepth.xyz);
+    }
+    return hitTracedPrimitives(ray, closestHit);
+}
+
 vec3 calculateDirectLight(vec3 surfaceNormal, vec3 hitPoint, Material material)
 {
     vec3 totalDirectLight = vec3(0.0, 0.0, 0.0);
@@ -228,22 +435,70 @@ vec3 calculateIndirectLight(Ray incidentRay, vec3 normal, vec3 hitPoint, Materia
     return totalIndirectLight / maxBounces * 2.0;
 }
 
-vec3 trace(Ray ray, int maxBounces)
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+vec3 trace(Ray ray, HitInfo closestHit, int maxBounces)
 {
-    HitInfo closestHit = hitScene(ray);
     if(closestHit.hasHit)
     {
         vec3 hitPoint = rayPoint(ray, closestHit.t);
-        vec3 directLight = calculateDirectLight(closestHit.hitNormal, hitPoint, closestHit.material);
-        vec3 indirectLight = calculateIndirectLight(ray, closestHit.hitNormal, hitPoint, closestHit.material, maxBounces);
-
-        return indirectLight + directLight;
+        vec3 light = vec3(0.0, 0.0, 0.0);
+        if (lightingMode != indirectLighting)
+            light += calculateDirectLight(closestHit.hitNormal, hitPoint, closestHit.material);
+        if (lightingMode != directLighting)
+            light += calculateIndirectLight(ray, closestHit.hitNormal, hitPoint, closestHit.material, maxBounces);
+        return light;
     }
+    if (lightingMode == indirectLighting)
+        return vec3(0.0, 0.0, 0.0);
     vec2 textureCoordinate = equirectangularProjection(ray.direction);
     vec4 texturePixelColor = texture(hdriTexture, textureCoordinate);
     return vec3(texturePixelColor);
 }
 
+// Joint bilateral upsampling: the 2x2 texels of the reduced indirect light around the pixel are
+// blended with their bilinear weights, each scaled by how closely the surface it was traced from
+// matches this pixel's in depth and normal. Where none of them match, as on a thin object the
+// reduced pass missed, the texel nearest in depth is taken on its own.
+const float upsampleDepthTolerance = 0.02;
+const float upsampleNormalPower = 32.0;
+const float minUpsampleWeight = 0.0001;
+
+vec3 upsampleIndirectLight(vec3 normal, float depth)
+{
+    ivec2 size = textureSize(indirectTexture, 0);
+    vec2 position = gl_FragCoord.xy / vec2(screenWidth, screenHeight) * vec2(size) - 0.5;
+    ivec2 base = ivec2(floor(position));
+    vec2 f = position - floor(position);
+
+    vec3 totalLight = vec3(0.0, 0.0, 0.0);
+    float totalWeight = 0.0;
+    vec3 nearestLight = vec3(0.0, 0.0, 0.0);
+    float nearestDistance = 1e30;
+    for (int i = 0; i < 4; i++)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), size - 1);
+        vec3 light = texelFetch(indirectTexture, texel, 0).rgb;
+        vec4 normalDepth = texelFetch(indirectNormalDepthTexture, texel, 0);
+
+        float depthDistance = abs(normalDepth.w - depth) / depth;
+        float bilinearWeight = mix(1.0 - f.x, f.x, float(offset.x)) * mix(1.0 - f.y, f.y, float(offset.y));
+        float weight = bilinearWeight * exp(-depthDistance / upsampleDepthTolerance) * pow(max(dot(normalDepth.xyz, normal), 0.0), upsampleNormalPower);
+        totalLight += light * weight;
+        totalWeight += weight;
+        if (depthDistance < nearestDistance)
+        {
+            nearestDistance = depthDistance;
+            nearestLight = light;
+        }
+    }
+    return totalWeight > minUpsampleWeight ? totalLight / totalWeight : nearestLight;
+}
+
 void main()
 {   
     float x = (gl_FragCoord.x - (screenWidth/2.0f)) / screenWidth;
@@ -255,13 +510,53 @@ void main()
     Ray ray = Ray(cameraOrigin, rayDirection);
     vec3 rayPoint = rayPoint(ray, max(0.001, blurDistance));
 
+    int passSamples = numSamples;
+    float weight = 1.0;
+    if (useTileSamples)
+    {
+        ivec2 tileSamples = texelFetch(tileSampleTexture, ivec2(gl_FragCoord.xy) / tileSize, 0).xy;
+        passSamples = min(numSamples, tileSamples.y);
+        if (passSamples == 0)
+            discard;
+        weight = float(passSamples) / float(tileSamples.x + passSamples);
+    }
+
+    // Without depth of field every sample's ray is the centre ray, so all of them start from the
+    // same primary hit.
+    bool isPinhole = blurStrength == 0.0;
+    HitInfo centerHit;
+    if (writeFeatures || lightingMode == directLighting || (useGBuffer && isPinhole))
+        centerHit = hitPrimaryRay(Ray(cameraOrigin, rayDirection));
+    vec3 upsampledIndirectLight = vec3(0.0, 0.0, 0.0);
+    if (lightingMode == directLighting && centerHit.hasHit)
+        upsampledIndirectLight = upsampleIndirectLight(normalize(centerHit.hitNormal), centerHit.t);
+
     vec3 averageColor = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < numSamples; i++)
+    vec2 moments = vec2(0.0, 0.0);
+    vec2 displayMoments = vec2(0.0, 0.0);
+    for (int i = 0; i < passSamples; i++)
     {
         ray.origin += randomDirection(seed) * blurStrength;
         ray.direction = normalize(rayPoint - ray.origin);
-        averageColor += trace(ray, numLightBounces);
+        HitInfo primaryHit = useGBuffer && isPinhole ? centerHit : hitScene(ray);
+        vec3 color = trace(ray, primaryHit, numLightBounces) + upsampledIndirectLight;
+        averageColor += color;
+        float colorLuminance = luminance(color);
+        float displayLuminance = min(colorLuminance, 1.0);
+        moments += vec2(colorLuminance, colorLuminance * colorLuminance);
+        displayMoments += vec2(displayLuminance, displayLuminance * displayLuminance);
     }
 
-    FragColor = vec4(averageColor/numSamples, 1.0);
+    FragColor = vec4(averageColor/passSamples, weight);
+    if (useTileSamples)
+        displayMomentsOutput = vec4(displayMoments / passSamples, 0.0, weight);
+
+    // What the denoiser is guided by: the surface through the pixel centre, seen without depth of
+    // field, and the mean luminance and squared luminance of the samples.
+    if (writeFeatures)
+    {
+        albedoOutput = centerHit.hasHit ? vec4(centerHit.material.color, 1.0) : vec4(0.0);
+        normalDepthOutput = centerHit.hasHit ? vec4(normalize(centerHit.hitNormal), centerHit.t) : vec4(0.0);
+        momentsOutput = moments / passSamples;
+    }
 }
@@ -0,0 +1,188 @@
+#version 330 core
+layout(location = 0) out vec4 normalDepthOutput;
+layout(location = 1) out ivec4 surfaceOutput;
+
+flat in int primitiveIndex;
+
+// Intersects the centre ray of the pixel with the primitive being drawn, using the same GLSL as
+// the path tracer, so the G-buffer holds exactly the hit it would have found. The depth test keeps
+// the nearest; distances are mapped into the depth range by t / (t + 1), which keeps their order.
+// The surface is the hitType and index the scene program looks the material up by, and for an
+// instance the sphere of its group that was hit.
+struct Ray 
+{
+    vec3 origin;
+    vec3 direction;
+};
+vec3 rayPoint(Ray ray, float t)
+{
+    return ray.origin + ray.direction * t;
+}
+struct Material
+{
+    vec3 color;
+    float roughness;
+    float transmission;
+    float emission;
+};
+struct HitInfo
+{
+    bool hasHit;
+    float t;
+    Material material;
+    vec3 hitNormal;
+};
+// <primitive declarations>
+
+uniform int screenWidth;
+uniform int screenHeight;
+uniform int rasterizedHitType;
+uniform int meshIndex;
+
+// A mesh's triangles are rasterized, and a pixel the rasterizer gives to a triangle its ray misses
+// lies on an edge shared with another; rather than lose it, the pixel is marked to be traced.
+const int unresolvedSurface = -2;
+uniform samplerBuffer meshVertices;
+uniform isamplerBuffer meshTriangles;
+
+const int maxNumGroups = 16;
+const int maxNumGroupSpheres = 64;
+uniform Sphere groupSpheres[maxNumGroupSpheres];
+uniform int groupFirstSphere[maxNumGroups];
+uniform int groupNumSpheres[maxNumGroups];
+const int instanceTexels = 5;
+const int instanceIsVisible = 2;
+uniform samplerBuffer instanceData;
+
+uniform vec3 cameraOrigin;
+uniform vec3 cameraForward;
+uniform vec3 cameraRight;
+uniform vec3 cameraUp;
+
+Material nullMaterial = Material(vec3(0.0, 0.0, 0.0), 0.0, 0.0, 0.0);
+HitInfo nullHitInfo = HitInfo(false, 10000000.0f, nullMaterial, vec3(0.0, 0.0, 0.0));
+
+// <primitive functions>
+
+float hitTriangle(Ray ray, int triangle, float tMax)
+{
+    ivec3 indices = texelFetch(meshTriangles, triangle).xyz;
+    vec3 a = texelFetch(meshVertices, indices.x).xyz - ray.origin;
+    vec3 b = texelFetch(meshVertices, indices.y).xyz - ray.origin;
+    vec3 c = texelFetch(meshVertices, indices.z).xyz - ray.origin;
+
+    vec3 absDirection = abs(ray.direction);
+    int kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.direction[kz] < 0.0)
+    {
+        int swap = kx;
+        kx = ky;
+        ky = swap;
+    }
+    vec3 shear = vec3(ray.direction[kx], ray.direction[ky], 1.0) / ray.direction[kz];
+
+    vec2 aSheared = vec2(a[kx], a[ky]) - shear.xy * a[kz];
+    vec2 bSheared = vec2(b[kx], b[ky]) - shear.xy * b[kz];
+    vec2 cSheared = vec2(c[kx], c[ky]) - shear.xy * c[kz];
+
+    float u = cSheared.x * bSheared.y - cSheared.y * bSheared.x;
+    float v = aSheared.x * cSheared.y - aSheared.y * cSheared.x;
+    float w = bSheared.x * aSheared.y - bSheared.y * aSheared.x;
+
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+        return 10000000.0f;
+
+    float determinant = u + v + w;
+    if (determinant == 0.0)
+        return 10000000.0f;
+
+    float t = (u * a[kz] + v * b[kz] + w * c[kz]) * shear.z / determinant;
+    if (t < 0.001 || t >= tMax)
+        return 10000000.0f;
+    return t;
+}
+
+HitInfo hitMeshTriangle(Ray ray, int triangle)
+{
+    float t = hitTriangle(ray, triangle, 10000000.0f);
+    if (t == 10000000.0f)
+        return nullHitInfo;
+
+    ivec3 indices = texelFetch(meshTriangles, triangle).xyz;
+    vec3 a = texelFetch(meshVertices, indices.x).xyz;
+    vec3 b = texelFetch(meshVertices, indices.y).xyz;
+    vec3 c = texelFetch(meshVertices, indices.z).xyz;
+    vec3 normal = normalize(cross(b - a, c - a));
+    if (dot(normal, ray.direction) > 0.0)
+        normal = -normal;
+    return HitInfo(true, t, nullMaterial, normal);
+}
+
+// The path tracer's hitInstance, which also says which sphere of the group was hit.
+HitInfo hitInstance(Ray ray, int instance, out int sphere)
+{
+    int first = instanceTexels * instance;
+    vec4 flagsGroup = texelFetch(instanceData, first + 4);
+    if ((int(flagsGroup.w) & instanceIsVisible) == 0)
+        return nullHitInfo;
+
+    vec4 row0 = texelFetch(instanceData, first);
+    vec4 row1 = texelFetch(instanceData, first + 1);
+    vec4 row2 = texelFetch(instanceData, first + 2);
+    vec4 origin = vec4(ray.origin, 1.0);
+    Ray localRay = Ray(vec3(dot(row0, origin), dot(row1, origin), dot(row2, origin)), vec3(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction)));
+
+    HitInfo closestHit = nullHitInfo;
+    int group = int(flagsGroup.z);
+    int firstSphere = groupFirstSphere[group];
+    for (int i = firstSphere; i < firstSphere + groupNumSpheres[group]; i++)
+    {
+        HitInfo hitInfo = hitSphere(localRay, groupSpheres[i]);
+        if (!hitInfo.hasHit) continue;
+        if (hitInfo.t < closestHit.t)
+        {
+            closestHit = hitInfo;
+            sphere = i;
+        }
+    }
+    if (!closestHit.hasHit)
+        return nullHitInfo;
+
+    vec3 normal = closestHit.hitNormal;
+    closestHit.hitNormal = normal.x * row0.xyz + normal.y * row1.xyz + normal.z * row2.xyz;
+    return closestHit;
+}
+
+void main()
+{
+    float x = (gl_FragCoord.x - (screenWidth/2.0f)) / screenWidth;
+    float y = (gl_FragCoord.y - (screenHeight/2.0f)) / screenHeight;
+    Ray ray = Ray(cameraOrigin, normalize(cameraForward + x * cameraRight + y * cameraUp));
+
+    HitInfo hitInfo;
+    ivec4 surface = ivec4(rasterizedHitType, primitiveIndex, 0, 0);
+    if (rasterizedHitType == meshHitType)
+    {
+        hitInfo = hitMeshTriangle(ray, primitiveIndex);
+        surface.y = meshIndex;
+        if (!hitInfo.hasHit)
+        {
+            normalDepthOutput = vec4(0.0);
+            surfaceOutput = ivec4(unresolvedSurface, 0, 0, 0);
+            gl_FragDepth = 0.0;
+            return;
+        }
+    }
+    else if (rasterizedHitType == instanceHitType)
+        hitInfo = hitInstance(ray, primitiveIndex, surface.z);
+    else
+        hitInfo = hitPrimitive(ray, rasterizedHitType, primitiveIndex);
+    if (!hitInfo.hasHit)
+        discard;
+
+    normalDepthOutput = vec4(hitInfo.hitNormal, hitInfo.t);
+    surfaceOutput = surface;
+    gl_FragDepth = hitInfo.t / (hitInfo.t + 1.0);
+}
@@ -0,0 +1,69 @@
+#version 330 core
+layout(location = 0) in vec4 sphereBounds;
+
+flat out int primitiveIndex;
+
+// Each instance is one primitive. A sphere, or an instance's bounding sphere, is drawn as a square
+// facing the camera that covers its silhouette, a plane as a quad over the whole screen, and the
+// fragment shader keeps the pixels whose ray hits it. A mesh is drawn as its own triangles, pulled
+// from the scene's buffers by gl_VertexID, and primitiveIndex is the triangle. Points are
+// projected onto the path tracer's image plane: worldToCamera gives the coefficients of
+// cameraRight, cameraUp and cameraForward that make up a point's offset from the camera, and a ray
+// along cameraForward + x * cameraRight + y * cameraUp lands at (2x, 2y).
+uniform bool isSphere;
+uniform bool isMesh;
+uniform int firstTriangle;
+uniform vec3 cameraOrigin;
+uniform mat3 worldToCamera;
+uniform samplerBuffer meshVertices;
+uniform isamplerBuffer meshTriangles;
+
+const vec2 corners[4] = vec2[4](vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(-1.0, 1.0), vec2(1.0, 1.0));
+const float minCameraDistance = 0.0001;
+
+// The square lies in the plane through the sphere's centre facing the camera, and is made wide
+// enough to hold the cone of rays that touch the sphere. If the camera is inside the sphere or the
+// square reaches behind the camera, the whole screen is covered instead.
+bool sphereSquare(vec3 center, float radius, out vec3 corner)
+{
+    vec3 toCenter = center - cameraOrigin;
+    float distance = length(toCenter);
+    if (distance <= radius * 1.001)
+        return false;
+
+    vec3 axis = toCenter / distance;
+    vec3 side = normalize(cross(axis, abs(axis.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 upward = cross(side, axis);
+    float halfSize = radius * distance / sqrt(distance * distance - radius * radius);
+    for (int i = 0; i < 4; i++)
+    {
+        vec3 point = toCenter + (corners[i].x * side + corners[i].y * upward) * halfSize;
+        if ((worldToCamera * point).z < minCameraDistance)
+            return false;
+    }
+    corner = center + (corners[gl_VertexID].x * side + corners[gl_VertexID].y * upward) * halfSize;
+    return true;
+}
+
+// Triangles are clipped where they pass minCameraDistance in front of the camera.
+void main()
+{
+    if (isMesh)
+    {
+        primitiveIndex = firstTriangle + gl_VertexID / 3;
+        int vertex = texelFetch(meshTriangles, primitiveIndex)[gl_VertexID % 3];
+        vec3 camera = worldToCamera * (texelFetch(meshVertices, vertex).xyz - cameraOrigin);
+        gl_Position = vec4(2.0 * camera.xy, minCameraDistance, camera.z);
+        return;
+    }
+
+    primitiveIndex = gl_InstanceID;
+    gl_Position = vec4(corners[gl_VertexID], 0.0, 1.0);
+
+    vec3 corner;
+    if (isSphere && sphereSquare(sphereBounds.xyz, sphereBounds.w, corner))
+    {
+        vec3 camera = worldToCamera * (corner - cameraOrigin);
+        gl_Position = vec4(2.0 * camera.xy, 0.0, camera.z);
+    }
+}